@@ -0,0 +1,34 @@
+#!/bin/bash
+# Local stand-in for the array job submission of a cluster scheduler, to run
+# simka in cluster mode with -array-index without a scheduler:
+#
+#   -count-cmd "bash simka_array_local.sh {nb_tasks} {max_tasks}"
+#   -merge-cmd "bash simka_array_local.sh {nb_tasks} {max_tasks}"
+#   -array-index '$SIMKA_ARRAY_TASK_ID'
+#
+# Like a scheduler, it returns at once and runs the tasks 1..nb_tasks of the
+# job file in the background, at most max_tasks at the same time, each one
+# with SIMKA_ARRAY_TASK_ID set to its index.
+
+if [ $# -ne 3 ]; then
+	echo "usage: $0 <nb_tasks> <max_tasks> <job_file>" >&2
+	exit 1
+fi
+
+nb_tasks=$1
+max_tasks=$2
+job_file=$3
+
+if [ "$SIMKA_ARRAY_LOCAL_RUNNING" != "1" ]; then
+	SIMKA_ARRAY_LOCAL_RUNNING=1 nohup bash "$0" "$@" > /dev/null 2>&1 &
+	exit 0
+fi
+
+for ((i=1; i<=nb_tasks; i++)); do
+	while [ "$(jobs -rp | wc -l)" -ge "$max_tasks" ]; do
+		wait -n
+	done
+	SIMKA_ARRAY_TASK_ID=$i bash "$job_file" &
+done
+
+wait
@@ -0,0 +1,343 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKACOUNT_HPP_
+#define TOOLS_SIMKA_SRC_SIMKACOUNT_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <SimkaAlgorithm.hpp>
+#include "minikc/MiniKC.hpp"
+#include "minikc/SuperKC.hpp"
+
+// We use the required packages
+using namespace std;
+
+//#define NB_COUNT_CACHE 1
+//#define TRACK_DISK_USAGE
+
+
+
+class SimkaCount : public Tool
+{
+public:
+
+	SimkaCount () : Tool ("SimkaCount")
+    {
+        //getParser()->push_front (new OptionOneParam (STR_URI_OUTPUT, "output file",           true));
+        //getParser()->push_back (new OptionOneParam (STR_ID,   "dataset id", true));
+        //getParser()->push_back (new OptionOneParam (STR_KMER_SIZE,   "kmer size", true));
+        getParser()->push_back (new OptionOneParam ("-out-tmp-simka",   "tmp output", true));
+        getParser()->push_back (new OptionOneParam ("-bank-name",   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-bank-index",   "bank name", true));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_READ_SIZE,   "bank name", true));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_READ_SHANNON_INDEX,   "bank name", true));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_KMER_SHANNON_INDEX,   "minimal Shannon index of the k-mers written", false, "0"));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MAX_READS,   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-nb-datasets",   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-nb-partitions",   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-pack-stripe",   "temp dir stripe of the pack file", false, "0"));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_CODEC,   "compression of the partition files", false, SimkaCodecConfig().toString()));
+        getParser()->push_back (new OptionNoParam (STR_SIMKA_SINGLETON_FILTER,   "drop the first occurrence of each k-mer with a Bloom filter", false));
+        getParser()->push_back (new OptionNoParam ("-joint",   "count the datasets listed in count_synchro/joint_<bank index>.ids together", false));
+        //getParser()->push_back (new OptionOneParam ("-nb-cores",   "bank name", true));
+        //getParser()->push_back (new OptionOneParam ("-max-memory",   "bank name", true));
+
+        getParser()->push_back (SortingCountAlgorithm<>::getOptionsParser(), 1);
+        if (Option* p = dynamic_cast<Option*> (getParser()->getParser(STR_KMER_ABUNDANCE_MIN)))  {  p->setDefaultValue ("0"); }
+    }
+
+    void execute ()
+    {
+
+
+    	//size_t datasetId =  getInput()->getInt(STR_ID);
+    	size_t kmerSize =  getInput()->getInt(STR_KMER_SIZE);
+    	string outputDir =  getInput()->getStr("-out-tmp-simka");
+    	string bankName =  getInput()->getStr("-bank-name");
+    	size_t bankIndex =  getInput()->getInt("-bank-index");
+    	size_t minReadSize =  getInput()->getInt(STR_SIMKA_MIN_READ_SIZE);
+    	double minReadShannonIndex =  getInput()->getDouble(STR_SIMKA_MIN_READ_SHANNON_INDEX);
+    	u_int64_t maxReads =  getInput()->getInt(STR_SIMKA_MAX_READS);
+    	size_t nbDatasets =   getInput()->getInt("-nb-datasets");
+    	size_t nbPartitions =   getInput()->getInt("-nb-partitions");
+    	size_t packStripe =   getInput()->getInt("-pack-stripe");
+    	CountNumber abundanceMin =   getInput()->getInt(STR_KMER_ABUNDANCE_MIN);
+    	CountNumber abundanceMax =   getInput()->getInt(STR_KMER_ABUNDANCE_MAX);
+
+    	Parameter params(getInput(), kmerSize, outputDir, bankName, minReadSize, minReadShannonIndex, maxReads, nbDatasets, nbPartitions, abundanceMin, abundanceMax, bankIndex, packStripe);
+    	if(getInput()->get("-joint")) params.banks = readJointJournal(outputDir, bankIndex);
+
+        Integer::apply<Functor,Parameter> (kmerSize, params);
+
+    }
+
+
+    /** Dataset of a joint count job. */
+    struct JointBank
+    {
+    	JointBank (size_t index, const string& name, size_t nbDatasets) : index(index), name(name), nbDatasets(nbDatasets) {}
+    	size_t index;
+    	string name;
+    	size_t nbDatasets;
+    };
+
+    struct Parameter
+    {
+        Parameter (IProperties* props, size_t kmerSize, string outputDir, string bankName, size_t minReadSize, double minReadShannonIndex, u_int64_t maxReads, size_t nbDatasets, size_t nbPartitions, CountNumber abundanceMin, CountNumber abundanceMax, size_t bankIndex, size_t packStripe) :
+        	props(props), kmerSize(kmerSize), outputDir(outputDir), bankName(bankName), minReadSize(minReadSize), minReadShannonIndex(minReadShannonIndex), maxReads(maxReads), nbDatasets(nbDatasets), nbPartitions(nbPartitions), abundanceMin(abundanceMin), abundanceMax(abundanceMax), bankIndex(bankIndex), packStripe(packStripe)  {
+        	banks.push_back(JointBank(bankIndex, bankName, nbDatasets));
+        }
+        IProperties* props;
+        size_t kmerSize;
+        string outputDir;
+        string bankName;
+        size_t minReadSize;
+        double minReadShannonIndex;
+        u_int64_t maxReads;
+        size_t nbDatasets;
+        size_t nbPartitions;
+        CountNumber abundanceMin;
+        CountNumber abundanceMax;
+        size_t bankIndex;
+        size_t packStripe;
+        //Datasets of the job: this one, or the group of a joint count led by bankIndex
+        vector<JointBank> banks;
+    };
+
+    /** Several small datasets can be counted by a single job (simka -joint-count). The group is
+     * written by simka in count_synchro/joint_<index>.ids, index being the smallest bank index of
+     * the group, listed first: one line per dataset with its index, name and number of paired
+     * files, tab separated. */
+    static string getJointJournalFilename(const string& outputDir, size_t bankIndex){
+    	return outputDir + "/count_synchro/joint_" + Stringify::format("%i", bankIndex) + ".ids";
+    }
+
+    static void writeJointJournal(const string& outputDir, const vector<JointBank>& banks){
+    	ofstream file(getJointJournalFilename(outputDir, banks[0].index).c_str());
+    	for(size_t i=0; i<banks.size(); i++){
+    		file << banks[i].index << "\t" << banks[i].name << "\t" << banks[i].nbDatasets << endl;
+    	}
+    	file.close();
+    }
+
+    static vector<JointBank> readJointJournal(const string& outputDir, size_t bankIndex){
+
+    	vector<JointBank> banks;
+    	string line;
+    	ifstream file(getJointJournalFilename(outputDir, bankIndex).c_str());
+    	while(getline(file, line)){
+    		vector<string> fields;
+    		stringstream lineStream(line);
+    		string field;
+    		while(getline(lineStream, field, '\t')) fields.push_back(field);
+    		if(fields.size() != 3) continue;
+    		banks.push_back(JointBank(strtoull(fields[0].c_str(), NULL, 10), fields[1], strtoull(fields[2].c_str(), NULL, 10)));
+    	}
+
+    	if(banks.empty() || banks[0].index != bankIndex){
+    		SimkaError::raise(std::string("can't read joint count group ") + getJointJournalFilename(outputDir, bankIndex));
+    	}
+    	return banks;
+    }
+
+    template<size_t span> struct Functor  {
+
+        typedef typename Kmer<span>::Type  Type;
+        typedef typename Kmer<span>::Count Count;
+
+    	void operator ()  (Parameter p){
+
+			Configuration config;
+			Repartitor* repartitor = new Repartitor();
+			LOCAL(repartitor);
+
+			{
+				Storage* storage = StorageFactory(STORAGE_HDF5).load (p.outputDir + "/" + "config.h5");
+				LOCAL (storage);
+				config.load(storage->getGroup(""));
+				repartitor->load(storage->getGroup(""));
+			}
+
+			count(p, config, repartitor);
+		}
+
+		/** Count the k-mers of the datasets of a job with an already loaded configuration and repartition table.
+		 * Called directly by simka when jobs are run in-process, so that config.h5 is read only once. */
+		void count(Parameter& p, const Configuration& config, Repartitor* repartitor){
+
+			IProperties* props = p.props;
+			size_t nbBanks = p.banks.size();
+			bool isJoint = nbBanks > 1;
+
+			//Counts per dataset and partition, at index bank * nbPartitions + partition
+			vector<u_int64_t> nbKmerPerParts(nbBanks * p.nbPartitions, 0);
+			vector<u_int64_t> nbDistinctKmerPerParts(nbBanks * p.nbPartitions, 0);
+			vector<u_int64_t> chordNiPerParts(nbBanks * p.nbPartitions, 0);
+			vector<u_int64_t> nbReads(nbBanks, 0);
+			//Bytes the job wrote to its temp dir besides its pack (super-k-mers), for -max-disk
+			u_int64_t nbTempBytes = 0;
+
+
+			//Small k-mers are partitioned by ranges of values and their partition files are dense
+			SimkaDenseRanges ranges;
+			bool isDense = SimkaDenseRanges::isEnabled(p.kmerSize);
+			if(isDense && !ranges.load(SimkaCommons::getDenseRangesFilename(p.outputDir), p.kmerSize, p.nbPartitions)){
+				SimkaError::raise(std::string("can't read partition ranges ") + SimkaCommons::getDenseRangesFilename(p.outputDir));
+			}
+			if(isJoint && (isDense || nbBanks > SUPERKC_MAX_BANKS)){
+				SimkaError::raise(std::string("joint count of ") + std::to_string(nbBanks) + " datasets with k=" + std::to_string(p.kmerSize) + " (needs k > " + std::to_string(SIMKA_DENSE_MAX_KMER_SIZE) + " and at most " + std::to_string(SUPERKC_MAX_BANKS) + " datasets)");
+			}
+
+			{
+				vector<u_int32_t> bankIds;
+				for(size_t b=0; b<nbBanks; b++) bankIds.push_back(p.banks[b].index);
+
+				//The partition files are written to the pack of the job as their partition is done.
+				//A joint count writes multi bank files covering the datasets of the group.
+				SimkaCodecConfig codecs(p.props->getStr(STR_SIMKA_CODEC));
+				string packFilename = SimkaCommons::getPackFilename(p.outputDir, p.packStripe, p.bankIndex);
+				SimkaPackWriter pack(packFilename + ".temp", p.nbPartitions);
+				vector<SimkaPartitionWriter<Type>* > partitionWriters;
+		    	for(size_t i=0; i<p.nbPartitions; i++){
+					if(isDense)
+						partitionWriters.push_back(new SimkaPartitionWriter<Type>(pack, i, codecs.get(SIMKA_STAGE_COUNT), p.bankIndex, ranges.getStart(i), ranges.getEnd(i)));
+					else if(isJoint)
+						partitionWriters.push_back(new SimkaPartitionWriter<Type>(pack, i, codecs.get(SIMKA_STAGE_COUNT), bankIds));
+					else
+						partitionWriters.push_back(new SimkaPartitionWriter<Type>(pack, i, codecs.get(SIMKA_STAGE_COUNT), p.bankIndex));
+		    	}
+
+
+				//The read threads of the datasets follow the cores of the job
+				size_t nbCores = props->getInt(STR_NB_CORES);
+				if(nbCores == 0) nbCores = System::info().getNbCores();
+
+				SimkaSequenceFilter sequenceFilter(p.minReadSize, p.minReadShannonIndex);
+				vector<IBank*> inputBanks;
+				vector<SimkaPotaraBankFiltered<SimkaSequenceFilter>*> filteredBanks;
+				for(size_t b=0; b<nbBanks; b++){
+					string inputFilename = p.outputDir + "/input/" + p.banks[b].name;
+					IBank* bank = Bank::open(inputFilename);
+					bank->use();
+					SimkaPotaraBankFiltered<SimkaSequenceFilter>* filteredBank = new SimkaPotaraBankFiltered<SimkaSequenceFilter>(bank, sequenceFilter, p.maxReads, p.banks[b].nbDatasets, inputFilename, nbCores);
+					filteredBank->use();
+					inputBanks.push_back(bank);
+					filteredBanks.push_back(filteredBank);
+				}
+
+				SimkaCountWriter<span> countWriter(partitionWriters, bankIds);
+				SimkaKmerComplexityFilter complexityFilter(p.kmerSize, props->getDouble(STR_SIMKA_MIN_KMER_SHANNON_INDEX));
+				SimkaCompressedProcessor<span>* proc = new SimkaCompressedProcessor<span>(countWriter, nbKmerPerParts, nbDistinctKmerPerParts, chordNiPerParts, p.abundanceMin, p.abundanceMax, complexityFilter);
+
+				if(isDense){
+					MiniKC<span> miniKc(props, p.kmerSize, filteredBanks[0], ranges, proc);
+					miniKc.execute();
+					proc->flush();
+
+					nbReads[0] = miniKc._nbReads;
+				}
+				else{
+					//Without abundance-min, the singletons dropped by the filter would be missing from the counts
+					bool singletonFilter = props->get(STR_SIMKA_SINGLETON_FILTER) && p.abundanceMin >= 2;
+
+					SuperKC<span> superKc(props, p.kmerSize, vector<IBank*>(filteredBanks.begin(), filteredBanks.end()), config, *repartitor, proc, props->getStr(STR_URI_OUTPUT_TMP), singletonFilter);
+					superKc.execute();
+					//The clones are flushed by finishClones
+					proc->flush();
+
+					nbReads = superKc._nbReads;
+					nbTempBytes = superKc._nbSpilledBytes;
+				}
+
+				//A read or write error ends the job before the pack is named and the datasets marked as counted
+				for(size_t b=0; b<nbBanks; b++) filteredBanks[b]->checkErrors();
+				countWriter.close();
+
+				for(size_t b=0; b<nbBanks; b++){
+					filteredBanks[b]->forget();
+					inputBanks[b]->forget();
+				}
+
+
+#ifdef TRACK_DISK_USAGE
+				string command = "du -sh " +  p.outputDir;
+				system(command.c_str());
+#endif
+
+		    	for(size_t i=0; i<p.nbPartitions; i++){
+		    		partitionWriters[i]->flush();
+		    		delete partitionWriters[i];
+		    	}
+
+				//The pack gets its name once complete
+				pack.close();
+				System::file().rename(packFilename + ".temp", packFilename);
+			}
+
+			//The first dataset of a joint count is the one watched by simka: it is finished last
+			for(size_t b=nbBanks; b-- > 0; ){
+
+				vector<string> outInfo;
+				u_int64_t nbDistinctKmers = 0;
+				u_int64_t nbKmers = 0;
+				u_int64_t chord_N2 = 0;
+				string contents = "";
+				for(size_t i=0; i<p.nbPartitions; i++){
+					size_t index = b * p.nbPartitions + i;
+					nbDistinctKmers += nbDistinctKmerPerParts[index];
+					nbKmers += nbKmerPerParts[index];
+					chord_N2 += chordNiPerParts[index];
+					contents += Stringify::format("%llu", nbDistinctKmerPerParts[index]) + "\n";
+				}
+				outInfo.push_back(Stringify::format("%llu", nbReads[b]));
+				outInfo.push_back(Stringify::format("%llu", nbDistinctKmers));
+				outInfo.push_back(Stringify::format("%llu", nbKmers));
+				outInfo.push_back(Stringify::format("%llu", chord_N2));
+				outInfo.push_back(Stringify::format("%llu", b == 0 ? nbTempBytes : 0));
+
+				IFile* nbKmerPerPartFile = System::file().newFile(p.outputDir + "/kmercount_per_partition/" + p.banks[b].name + ".txt", "w");
+				nbKmerPerPartFile->fwrite(contents.c_str(), contents.size(), 1);
+				nbKmerPerPartFile->flush();
+				delete nbKmerPerPartFile;
+
+				writeFinishSignal(p, p.banks[b].name, outInfo);
+			}
+		}
+
+		void writeFinishSignal(Parameter& p, const string& bankName, const vector<string>& outInfo){
+
+			string finishFilename = p.outputDir + "/count_synchro/" +  bankName + ".ok";
+			IFile* file = System::file().newFile(finishFilename, "w");
+			string contents = "";
+
+			for(size_t i=0; i<outInfo.size(); i++){
+				contents += outInfo[i] + "\n";
+			}
+			file->fwrite(contents.c_str(), contents.size(), 1);
+			file->flush();
+
+			delete file;
+		}
+
+    };
+
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_SIMKACOUNTCACHE_HPP_
+#define TOOLS_SIMKA_SRC_SIMKACOUNTCACHE_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include "minikc/MiniKC.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+
+//Number of blocks of the input files read to compute the cache key
+#define SIMKA_COUNT_CACHE_NB_SAMPLES 16
+#define SIMKA_COUNT_CACHE_SAMPLE_SIZE 4096
+
+//Change it when the layout or the record format of the cached counts change
+#define SIMKA_COUNT_CACHE_VERSION "simka-count-2"
+
+
+/*********************************************************************
+* ** SimkaCountCache
+*
+* Persistent cache of the outputs of simkaCount, shared between runs:
+*
+*   <cache>/repartition/k<k>_m<m>_t<t>_r<r>_p<P>_<id>.h5 : repartition tables
+*   <cache>/counts/<key>/pack                             : pack file of the dataset
+*   <cache>/counts/<key>/count.ok                         : contents of count_synchro/<bank>.ok
+*   <cache>/counts/<key>/kmercount_per_partition.txt
+*   <cache>/counts/<key>/bank_index                       : bank id stored in the records
+*
+* The key of a dataset is a hash of its input files (size, mtime and
+* sampled contents), of the counting parameters and of the repartition
+* table. A repartition table depends on the whole input, so a new run
+* reuses a cached table when one fits, otherwise the cached counts could
+* never match.
+*
+* Files are hard linked when the cache and the temp dir share a
+* filesystem, copied otherwise. Entries are published with a rename, so
+* concurrent runs can share a cache.
+*********************************************************************/
+template<size_t span>
+class SimkaCountCache
+{
+
+public:
+
+	typedef typename Kmer<span>::Type Type;
+
+	/** \param[in] parameters : description of every counting parameter that changes the counts */
+	SimkaCountCache(const string& cacheDir, const string& outputDir, const vector<string>& bankNames, const vector<size_t>& nbBankPerDataset, size_t nbPartitions, const string& parameters){
+
+		_cacheDir = cacheDir;
+		_outputDir = outputDir;
+		_nbPartitions = nbPartitions;
+
+		System::file().mkdir(_cacheDir + "/counts/", -1);
+
+		string repartitionId;
+		ifstream file((_outputDir + "/count_cache_repartition").c_str());
+		getline(file, repartitionId);
+		file.close();
+
+		//Computed once here, restore and store are called from several threads
+		for(size_t i=0; i<bankNames.size(); i++){
+			string description = string(SIMKA_COUNT_CACHE_VERSION) + " " + parameters;
+			description += " repartition=" + repartitionId;
+			description += " partitions=" + Stringify::format("%i", nbPartitions);
+			description += " nb-datasets=" + Stringify::format("%i", nbBankPerDataset[i]);
+			description += describeInputFiles(_outputDir + "/input/" + bankNames[i]);
+			_keys.push_back(hash(description, 0xcbf29ce484222325ULL) + hash(description, 0x84222325cbf29ce4ULL));
+		}
+	}
+
+	/** Replace the count job of a dataset by its cached counts.
+	 * \param[in] packFilename : pack file the count job would have written
+	 * \return false if the dataset is not in the cache */
+	bool restore(size_t bankIndex, const string& bankName, const string& packFilename){
+
+		string entryDir = _cacheDir + "/counts/" + _keys[bankIndex] + "/";
+		if(!System::file().doesExist(entryDir + "count.ok")) return false;
+
+		size_t cachedBankIndex;
+		{
+			ifstream file((entryDir + "bank_index").c_str());
+			if(!(file >> cachedBankIndex)) return false;
+		}
+
+		if(System::file().doesExist(packFilename)) System::file().remove(packFilename);
+
+		if(cachedBankIndex == bankIndex){
+			if(!linkOrCopy(entryDir + "pack", packFilename)) return false;
+		}
+		else{
+			rewriteBankId(entryDir + "pack", packFilename, bankIndex);
+		}
+
+		//The synchro file is written last: until then the dataset is not counted
+		return linkOrCopy(entryDir + "kmercount_per_partition.txt", _outputDir + "/kmercount_per_partition/" + bankName + ".txt")
+			&& linkOrCopy(entryDir + "count.ok", _outputDir + "/count_synchro/" + bankName + ".ok");
+	}
+
+	/** Add the outputs of a finished count job to the cache. */
+	void store(size_t bankIndex, const string& bankName, const string& packFilename){
+
+		string entryDir = _cacheDir + "/counts/" + _keys[bankIndex];
+		if(System::file().doesExist(entryDir)) return;
+
+		std::ostringstream tempDir;
+		tempDir << entryDir << ".tmp_" << getpid() << "_" << std::this_thread::get_id();
+		System::file().mkdir(tempDir.str(), -1);
+
+		bool isValid = linkOrCopy(packFilename, tempDir.str() + "/pack");
+		isValid = isValid && linkOrCopy(_outputDir + "/kmercount_per_partition/" + bankName + ".txt", tempDir.str() + "/kmercount_per_partition.txt");
+		isValid = isValid && linkOrCopy(_outputDir + "/count_synchro/" + bankName + ".ok", tempDir.str() + "/count.ok");
+
+		if(isValid){
+			ofstream file((tempDir.str() + "/bank_index").c_str());
+			file << bankIndex << endl;
+			file.close();
+		}
+
+		if(!isValid || rename(tempDir.str().c_str(), entryDir.c_str()) != 0){
+			//Another run published the same entry meanwhile, or a file is missing
+			string command = "rm -rf " + tempDir.str();
+			system(command.c_str());
+		}
+	}
+
+	/** Cached repartition table that fits the configuration: the smallest number of partitions
+	 * between minPartitions and 4 times more, "" if none. */
+	static string findRepartition(const string& cacheDir, size_t kmerSize, const Configuration& config, size_t minPartitions, size_t& nbPartitions){
+
+		string prefix = getRepartitionPrefix(kmerSize, config);
+		vector<string> filenames = System::file().listdir(cacheDir + "/repartition/");
+		sort(filenames.begin(), filenames.end());
+
+		string best = "";
+		for(size_t i=0; i<filenames.size(); i++){
+
+			const string& filename = filenames[i];
+			if(filename.compare(0, prefix.size(), prefix) != 0) continue;
+			if(filename.size() < 3 || filename.compare(filename.size()-3, 3, ".h5") != 0) continue;
+
+			size_t p = strtoull(filename.c_str() + prefix.size(), NULL, 10);
+			if(p < minPartitions || p > 4*minPartitions) continue;
+			if(best == "" || p < nbPartitions){
+				best = filename;
+				nbPartitions = p;
+			}
+		}
+
+		return best;
+	}
+
+	static void loadRepartition(const string& cacheDir, const string& repartitionId, Repartitor& repartitor){
+		Storage* storage = StorageFactory(STORAGE_HDF5).load(cacheDir + "/repartition/" + repartitionId);
+		LOCAL(storage);
+		repartitor.load(storage->getGroup(""));
+	}
+
+	/** Add the repartition table of this run to the cache, unless it comes from the cache.
+	 * Its id, part of every key, is kept in <out-tmp>/count_cache_repartition. */
+	static void registerRepartition(const string& cacheDir, const string& outputDir, size_t kmerSize, const Configuration& config, Repartitor& repartitor){
+
+		string idFilename = outputDir + "/count_cache_repartition";
+		if(System::file().doesExist(idFilename)) return;
+
+		System::file().mkdir(cacheDir + "/repartition/", -1);
+
+		std::ostringstream repartitionId;
+		repartitionId << getRepartitionPrefix(kmerSize, config) << config._nb_partitions << "_" << time(0) << "_" << getpid() << ".h5";
+
+		string filename = cacheDir + "/repartition/" + repartitionId.str();
+		{
+			Storage* storage = StorageFactory(STORAGE_HDF5).create(filename + ".tmp", true, false);
+			LOCAL(storage);
+			repartitor.save(storage->getGroup(""));
+		}
+		System::file().rename(filename + ".tmp", filename);
+
+		writeRepartitionId(outputDir, repartitionId.str());
+	}
+
+	static void writeRepartitionId(const string& outputDir, const string& repartitionId){
+		ofstream file((outputDir + "/count_cache_repartition").c_str());
+		file << repartitionId << endl;
+		file.close();
+	}
+
+private:
+
+	static string getRepartitionPrefix(size_t kmerSize, const Configuration& config){
+		return "k" + Stringify::format("%i", kmerSize) + "_m" + Stringify::format("%i", config._minim_size)
+			+ "_t" + Stringify::format("%i", config._minimizerType) + "_r" + Stringify::format("%i", config._repartitionType) + "_p";
+	}
+
+	static bool linkOrCopy(const string& src, const string& dst){
+
+		if(link(src.c_str(), dst.c_str()) == 0) return true;
+
+		ifstream in(src.c_str(), std::ios::binary);
+		if(!in) return false;
+		ofstream out(dst.c_str(), std::ios::binary);
+		out << in.rdbuf();
+		out.close();
+		return out.good();
+	}
+
+	/** Cached counts of a dataset that had another index in the run that stored them.
+	 * Each partition is written to the new pack as it is read. */
+	void rewriteBankId(const string& src, const string& dst, size_t bankIndex){
+
+		SimkaPackWriter pack(dst, _nbPartitions);
+
+		for(size_t i=0; i<_nbPartitions; i++){
+
+			u_int64_t offset, length;
+			if(!SimkaPackFile::getRange(src, i, offset, length)) continue;
+
+			{
+				SimkaPartitionReader<Type> reader(src, offset, length);
+				SimkaPartitionWriter<Type>* writer;
+				if(reader.isDense())
+					writer = new SimkaPartitionWriter<Type>(pack, i, reader.getCodec(), bankIndex, reader.getRangeStart(), reader.getRangeEnd());
+				else
+					writer = new SimkaPartitionWriter<Type>(pack, i, reader.getCodec(), bankIndex);
+
+				for(reader.first(); !reader.isDone(); reader.next()){
+					writer->insert(reader.kmer(), bankIndex, reader.count());
+				}
+
+				writer->flush();
+				delete writer;
+			}
+		}
+
+		pack.close();
+	}
+
+	/** Size, mtime and a hash of evenly spaced blocks of each input file. */
+	static string describeInputFiles(const string& inputFilename){
+
+		string description = "";
+		string filename;
+		ifstream inputFile(inputFilename.c_str());
+
+		while(getline(inputFile, filename)){
+
+			if(filename == "") continue;
+
+			struct stat st;
+			if(stat(filename.c_str(), &st) != 0){
+				description += " missing";
+				continue;
+			}
+
+			u_int64_t size = st.st_size;
+			description += " " + Stringify::format("%llu", size) + ":" + Stringify::format("%llu", (u_int64_t) st.st_mtime);
+
+			string samples = "";
+			vector<char> buffer(SIMKA_COUNT_CACHE_SAMPLE_SIZE);
+			ifstream file(filename.c_str(), std::ios::binary);
+
+			for(size_t i=0; i<SIMKA_COUNT_CACHE_NB_SAMPLES; i++){
+				u_int64_t offset = 0;
+				if(size > SIMKA_COUNT_CACHE_SAMPLE_SIZE) offset = (size - SIMKA_COUNT_CACHE_SAMPLE_SIZE) * i / (SIMKA_COUNT_CACHE_NB_SAMPLES-1);
+				file.clear();
+				file.seekg(offset);
+				file.read(&buffer[0], buffer.size());
+				samples.append(&buffer[0], file.gcount());
+			}
+
+			description += ":" + hash(samples, 0xcbf29ce484222325ULL);
+		}
+
+		return description;
+	}
+
+	/** 64 bits FNV-1a, as hexadecimal. */
+	static string hash(const string& data, u_int64_t seed){
+		u_int64_t h = seed;
+		for(size_t i=0; i<data.size(); i++){
+			h ^= (unsigned char) data[i];
+			h *= 0x100000001b3ULL;
+		}
+		return Stringify::format("%016llx", h);
+	}
+
+	string _cacheDir;
+	string _outputDir;
+	size_t _nbPartitions;
+	vector<string> _keys;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_SIMKACOUNTCACHE_HPP_ */
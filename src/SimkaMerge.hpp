@@ -0,0 +1,1239 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+
+#ifndef TOOLS_SIMKA_SRC_SIMKAMERGE_HPP_
+#define TOOLS_SIMKA_SRC_SIMKAMERGE_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <SimkaAlgorithm.hpp>
+#include <SimkaDistance.hpp>
+#include <SimkaPartitionFile.hpp>
+#include <SimkaDenseRanges.hpp>
+#include <fstream>
+#include "json.hpp"
+// We use the required packages
+using namespace std;
+
+
+
+using namespace gatb::core::system;
+using namespace gatb::core::system::impl;
+using json = nlohmann::json;
+
+#define MERGE_BUFFER_SIZE 1000
+#define SIMKA_MERGE_MAX_FILE_USED 200
+
+struct sortItem_Size_Filename_ID{
+
+	u_int64_t _size;
+	size_t _datasetID;
+
+	sortItem_Size_Filename_ID(){}
+
+	sortItem_Size_Filename_ID(u_int64_t size, size_t datasetID){
+		_size = size;
+		_datasetID = datasetID;
+	}
+};
+
+inline bool sortFileBySize (sortItem_Size_Filename_ID i, sortItem_Size_Filename_ID j){
+	return ( i._size < j._size );
+}
+
+inline u_int64_t getFileSize(const string& filename){
+	std::ifstream in(filename.c_str(), std::ifstream::ate | std::ifstream::binary);
+	u_int64_t size = in.tellg();
+	in.close();
+	return size;
+}
+
+
+
+
+struct SimkaMergeParameter
+{
+    SimkaMergeParameter (IProperties* props, string inputFilename, string outputDir, size_t partitionId, size_t kmerSize, double minShannonIndex, bool computeSimpleDistances, bool computeComplexDistances, size_t nbCores, string f_matrix, string d_matrix, bool is_pipe, string json_path, bool keepMerged=false, bool removeInputs=false) : props(props), inputFilename(inputFilename), outputDir(outputDir), partitionId(partitionId), kmerSize(kmerSize), minShannonIndex(minShannonIndex), computeSimpleDistances(computeSimpleDistances), computeComplexDistances(computeComplexDistances), nbCores(nbCores), f_matrix(f_matrix), d_matrix(d_matrix), is_pipe(is_pipe), json_path(json_path), keepMerged(keepMerged), removeInputs(removeInputs) {}
+    IProperties* props;
+    string inputFilename;
+    string outputDir;
+    size_t partitionId;
+    size_t kmerSize;
+    double minShannonIndex;
+    bool computeSimpleDistances;
+    bool computeComplexDistances;
+    size_t nbCores;
+    string f_matrix;
+    string d_matrix;
+    bool is_pipe;
+    string json_path;
+    //Replace the partition files by the merged stream, for a later run with -reuse-counts
+    bool keepMerged;
+    bool removeInputs;
+};
+
+
+template<size_t span=KMER_DEFAULT_SPAN>
+class StorageIt
+{
+
+public:
+
+
+    typedef typename Kmer<span>::Type                                       Type;
+    typedef typename Kmer<span>::Count                                      Count;
+
+    StorageIt(SimkaPartitionReader<Type>* it, size_t bankId, size_t partitionId);
+
+    ~StorageIt(){
+    	delete _it;
+    }
+
+
+	bool next(){
+		_it->next();
+		return !_it->isDone();
+	}
+
+	Type& value(){
+		return _it->kmer();
+	}
+
+	u_int16_t getBankId(){
+		return _it->bankId();
+	}
+
+	u_int64_t& abundance(){
+		return _it->count();
+	}
+
+
+	u_int16_t _bankId;
+	u_int16_t _partitionId;
+    SimkaPartitionReader<Type>* _it;
+};
+
+template<size_t span>
+StorageIt<span>::StorageIt (SimkaPartitionReader<Type> *it, size_t bankId, size_t partitionId)
+{
+    _it = it;
+    _bankId = bankId;
+    _partitionId = partitionId;
+}
+
+
+class SimkaCounterBuilderMerge
+{
+public:
+
+    /** Constructor.
+     * \param[in] nbBanks : number of banks parsed during kmer counting.
+     */
+	SimkaCounterBuilderMerge (CountVector& abundancePerBank)  :  _abundancePerBank(abundancePerBank)  {}
+
+    /** Get the number of banks.
+     * \return the number of banks. */
+    size_t size() const  { return _abundancePerBank.size(); }
+
+    /** Initialization of the counting for the current kmer. This method should be called
+     * when a kmer is seen for the first time.
+     * \param[in] idxBank : bank index where the new current kmer has been found. */
+    void init (size_t idxBank, CountNumber abundance)
+    {
+        for (size_t k=0; k<_abundancePerBank.size(); k++)  { _abundancePerBank[k]=0; }
+        _abundancePerBank [idxBank]= abundance;
+    }
+
+    /** Increase the abundance of the current kmer for the provided bank index.
+     * \param[in] idxBank : index of the bank */
+    void increase (size_t idxBank, CountNumber abundance)  {  _abundancePerBank [idxBank] += abundance;  }
+
+    /** Set the abundance of the current kmer for the provided bank index.
+     * \param[in] idxBank : index of the bank */
+    //void set (CountNumber val, size_t idxBank=0)  {  _abundancePerBank [idxBank] = val;  }
+
+    /** Get the abundance of the current kmer for the provided bank index.
+     * \param[in] idxBank : index of the bank
+     * \return the abundance of the current kmer for the given bank. */
+    //CountNumber operator[] (size_t idxBank) const  { return _abundancePerBank[idxBank]; }
+
+    /** */
+    //const CountVector& get () const { return _abundancePerBank; }
+
+    void print(const string& kmer){
+		cout << kmer << ": ";
+    	for(size_t i=0; i<size(); i++){
+    		cout << _abundancePerBank[i] << " ";
+    	}
+    	cout << endl;
+    }
+
+private:
+    CountVector& _abundancePerBank;
+};
+
+
+/*********************************************************************
+* ** SimkaPartitionInputs
+*
+* Count files of a partition. The counts of a dataset are read from its
+* pack file (the one of the first dataset of its group for a joint count)
+* until they are merged with other datasets in a partition file
+* (__p__<id>.gz, or .txt with -codec none). A partition file covers the datasets listed in its
+* header: their pack files, and the partition files left by an
+* interrupted merge, are not inputs anymore.
+*********************************************************************/
+template<size_t span>
+class SimkaPartitionInputs
+{
+
+public:
+
+	typedef typename Kmer<span>::Type Type;
+
+	SimkaPartitionInputs(const string& outputDir){
+		_outputDir = outputDir;
+		_packFilenames = SimkaCommons::listPackFilenames(outputDir);
+	}
+
+	/** Ids and sizes of the inputs of a partition. */
+	vector<sortItem_Size_Filename_ID> list(size_t partitionId){
+
+		string partDir = SimkaCommons::getPartitionDir(_outputDir, partitionId);
+		vector<string> filenames = System::file().listdir(partDir);
+
+		vector<size_t> ids;
+		vector<string> paths;
+		vector<vector<u_int32_t> > sources;
+		for(size_t i=0; i<filenames.size(); i++){
+			//skip the .temp files of an interrupted merge
+			const string& filename = filenames[i];
+			if(!SimkaCommons::isPartitionFilename(filename)) continue;
+
+			SimkaPartitionReader<Type> reader(partDir + filename);
+			ids.push_back(strtoull(filename.c_str() + 5, NULL, 10));
+			paths.push_back(partDir + filename);
+			sources.push_back(reader.getSources());
+		}
+
+		//Each dataset goes to the file with the most sources among those covering it
+		map<size_t, size_t> coveredBy;
+		for(size_t i=0; i<ids.size(); i++){
+			for(size_t j=0; j<sources[i].size(); j++){
+				map<size_t, size_t>::iterator it = coveredBy.find(sources[i][j]);
+				if(it == coveredBy.end() || sources[it->second].size() < sources[i].size()) coveredBy[sources[i][j]] = i;
+			}
+		}
+
+		vector<sortItem_Size_Filename_ID> inputs;
+
+		for(size_t i=0; i<ids.size(); i++){
+			if(!sources[i].empty() && coveredBy[sources[i][0]] != i) continue;
+			inputs.push_back(sortItem_Size_Filename_ID(getFileSize(paths[i]), ids[i]));
+		}
+
+		for(map<size_t, string>::iterator it=_packFilenames.begin(); it!=_packFilenames.end(); ++it){
+			if(coveredBy.find(it->first) != coveredBy.end()) continue;
+			u_int64_t offset, length;
+			if(!SimkaPackFile::getRange(it->second, partitionId, offset, length)) continue;
+			inputs.push_back(sortItem_Size_Filename_ID(length, it->first));
+		}
+
+		return inputs;
+	}
+
+	bool hasInput(size_t partitionId, size_t id){
+		return !SimkaCommons::findPartitionFilename(_outputDir, partitionId, id).empty() || _packFilenames.find(id) != _packFilenames.end();
+	}
+
+	/** Reader of the partition file of id, or else of its segment in the pack file of id. */
+	SimkaPartitionReader<Type>* open(size_t partitionId, size_t id){
+
+		string filename = SimkaCommons::findPartitionFilename(_outputDir, partitionId, id);
+		if(!filename.empty()) return new SimkaPartitionReader<Type>(filename);
+
+		map<size_t, string>::iterator it = _packFilenames.find(id);
+		u_int64_t offset, length;
+		if(it == _packFilenames.end() || !SimkaPackFile::getRange(it->second, partitionId, offset, length)){
+			SimkaError::raise(std::string("no counts of ") + std::to_string(id) + " in partition " + std::to_string(partitionId));
+		}
+		return new SimkaPartitionReader<Type>(it->second, offset, length);
+	}
+
+	/** Once the partition is merged, remove the partition file of id, or else release the range of the
+	 * partition in the pack file of id. Pack files are shared by every partition, they are only removed
+	 * by removePack. */
+	void removeInput(size_t partitionId, size_t id){
+		string filename = SimkaCommons::findPartitionFilename(_outputDir, partitionId, id);
+		if(!filename.empty()){
+			System::file().remove(filename);
+			return;
+		}
+
+		map<size_t, string>::iterator it = _packFilenames.find(id);
+		if(it != _packFilenames.end()) SimkaPackFile::release(it->second, partitionId);
+	}
+
+	void removePack(size_t id){
+		map<size_t, string>::iterator it = _packFilenames.find(id);
+		if(it == _packFilenames.end()) return;
+		System::file().remove(it->second);
+		_packFilenames.erase(it);
+	}
+
+private:
+
+	string _outputDir;
+	map<size_t, string> _packFilenames;
+};
+
+
+template<size_t span>
+class DiskBasedMergeSort
+{
+
+public:
+
+	typedef typename Kmer<span>::Type                                       Type;
+	typedef typename Kmer<span>::Count                                      Count;
+
+	struct kxp{
+		Type _type;
+		u_int32_t _bankId;
+		u_int64_t _count;
+		StorageIt<span>* _it;
+
+		kxp(){
+
+		}
+
+		kxp(Type type, u_int64_t bankId, u_int64_t count, StorageIt<span>* it){
+			_type = type;
+			_bankId = bankId;
+			_count = count;
+			_it = it;
+		}
+	};
+
+	struct kxpcomp { bool operator() (kxp& l, kxp& r) { return (r._type < l._type); } } ;
+
+	string _outputDir;
+	string _outputFilename;
+	vector<size_t>& _datasetIds;
+	size_t _partitionId;
+	size_t _mergeId;
+	SimkaCodecType _codec;
+	SimkaPartitionInputs<span>& _inputs;
+	SimkaPartitionWriter<Type>* _outputFile;
+
+
+
+    DiskBasedMergeSort(size_t mergeId, const string& outputDir, vector<size_t>& datasetIds, size_t partitionId, SimkaCodecType codec, SimkaPartitionInputs<span>& inputs):
+    	_datasetIds(datasetIds), _inputs(inputs)
+    {
+    	_outputDir = outputDir;
+    	_partitionId = partitionId;
+    	_mergeId = mergeId;
+    	_codec = codec;
+
+    	_outputFilename = SimkaCommons::getPartitionFilename(_outputDir, partitionId, mergeId, codec) + ".temp";
+    	_outputFile = 0;
+    }
+
+    ~DiskBasedMergeSort(){
+    }
+
+    void execute(){
+
+		vector<StorageIt<span>*> its;
+
+		size_t _nbBanks = _datasetIds.size();
+
+		//The merged file covers the datasets of its inputs
+		vector<u_int32_t> sources;
+		for(size_t i=0; i<_nbBanks; i++){
+			its.push_back(new StorageIt<span>(_inputs.open(_partitionId, _datasetIds[i]), i, _partitionId));
+			const vector<u_int32_t>& inputSources = its[i]->_it->getSources();
+			sources.insert(sources.end(), inputSources.begin(), inputSources.end());
+		}
+		_outputFile = new SimkaPartitionWriter<Type>(_outputFilename, _codec, sources);
+
+		Type previous_kmer;
+
+		std::priority_queue< kxp, vector<kxp>,kxpcomp > pq;
+		StorageIt<span>* bestIt;
+
+
+		for(size_t i=0; i<_nbBanks; i++){
+			StorageIt<span>* it = its[i];
+			it->_it->first();
+		}
+
+		//fill the  priority queue with the first elems
+		for (size_t ii=0; ii<_nbBanks; ii++)
+		{
+			if(its[ii]->_it->isDone()) continue;
+			pq.push(kxp(its[ii]->value(), its[ii]->getBankId(), its[ii]->abundance(), its[ii]));
+		}
+
+		if (pq.size() != 0) // everything empty, no kmer at all
+		{
+			//get first pointer
+			bestIt = pq.top()._it; pq.pop();
+			_outputFile->insert(bestIt->value(), bestIt->getBankId(), bestIt->abundance());
+			//best_p = get<1>(pq.top()) ; pq.pop();
+			//previous_kmer = bestIt->value();
+			//solidCounter->init (bestIt->getBankId(), bestIt->abundance());
+			//nbBankThatHaveKmer = 1;
+
+			while(1){
+
+				if (! bestIt->next())
+				{
+					//reaches end of one array
+					if(pq.size() == 0){
+						break;
+					}
+
+					//otherwise get new best
+					//best_p = get<1>(pq.top()) ; pq.pop();
+					bestIt = pq.top()._it; pq.pop();
+				}
+
+				pq.push(kxp(bestIt->value(), bestIt->getBankId(), bestIt->abundance(), bestIt)); //push new val of this pointer in pq, will be counted later
+
+		    	bestIt = pq.top()._it; pq.pop();
+		    	_outputFile->insert(bestIt->value(), bestIt->getBankId(), bestIt->abundance());
+		    	//cout << bestIt->value().toString(31) << " " << bestIt->getBankId() <<  " "<< bestIt->abundance() << endl;
+				//bestIt = get<3>(pq.top()); pq.pop();
+
+
+				//pq.push(kxp(bestIt->value(), bestIt->getBankId(), bestIt->abundance(), bestIt));
+
+			}
+		}
+
+		for(size_t i=0; i<its.size(); i++){
+			delete its[i];
+		}
+
+
+		_outputFile->flush();
+    	delete _outputFile;
+
+		//The merged file replaces its inputs only once it is complete: an interruption leaves
+		//either the inputs untouched, or the merged file plus some inputs to remove
+		string newOutputFilename = _outputFilename;
+		newOutputFilename.erase(_outputFilename.size()-5, 5);
+    	System::file().rename(_outputFilename, newOutputFilename); //remove .temp at the end of new merged file
+
+		for(size_t i=0; i<_nbBanks; i++){
+			if(_datasetIds[i] == _mergeId) continue;
+			_inputs.removeInput(_partitionId, _datasetIds[i]);
+		}
+    }
+
+};
+
+
+/*********************************************************************
+* ** SimkaPreMergeAlgorithm
+*
+* Merge the partition files of a group of datasets that are already
+* counted into one multi-bank file per partition, __p__<mergeId>.gz (.txt
+* with -codec none), while the other datasets are still being counted.
+* The final merge then has a small fan-in.
+*
+* The group is read from count_synchro/premerge_<mergeId>.ids, and
+* count_synchro/premerge_<mergeId>.ok is written at the end. The merge is
+* idempotent per partition, so an interrupted pre-merge is completed by
+* running it again.
+*********************************************************************/
+template<size_t span>
+class SimkaPreMergeAlgorithm
+{
+
+public:
+
+	SimkaPreMergeAlgorithm(const string& outputDir, size_t mergeId, size_t nbPartitions, SimkaCodecType codec){
+		_outputDir = outputDir;
+		_mergeId = mergeId;
+		_nbPartitions = nbPartitions;
+		_codec = codec;
+	}
+
+	static string getJournalFilename(const string& outputDir, size_t mergeId){
+		return outputDir + "/count_synchro/premerge_" + Stringify::format("%i", mergeId) + ".ids";
+	}
+
+	static string getFinishFilename(const string& outputDir, size_t mergeId){
+		return outputDir + "/count_synchro/premerge_" + Stringify::format("%i", mergeId) + ".ok";
+	}
+
+	static void writeJournal(const string& outputDir, size_t mergeId, const vector<size_t>& datasetIds){
+		ofstream file(getJournalFilename(outputDir, mergeId).c_str());
+		for(size_t i=0; i<datasetIds.size(); i++){
+			file << datasetIds[i] << endl;
+		}
+		file.close();
+	}
+
+	void execute(){
+
+		vector<size_t> datasetIds;
+		{
+			string line;
+			ifstream file(getJournalFilename(_outputDir, _mergeId).c_str());
+			while(getline(file, line)){
+				if(line == "") continue;
+				datasetIds.push_back(strtoull(line.c_str(), NULL, 10));
+			}
+			file.close();
+		}
+
+		SimkaPartitionInputs<span> inputs(_outputDir);
+
+		for(size_t i=0; i<_nbPartitions; i++){
+
+			string mergedFilename = SimkaCommons::findPartitionFilename(_outputDir, i, _mergeId);
+
+			vector<size_t> remainingIds;
+			for(size_t j=0; j<datasetIds.size(); j++){
+				if(inputs.hasInput(i, datasetIds[j])){
+					remainingIds.push_back(datasetIds[j]);
+				}
+			}
+
+			if(!mergedFilename.empty()){
+				//Interrupted after the merged file was completed: only the inputs are left to remove
+				for(size_t j=0; j<remainingIds.size(); j++){
+					inputs.removeInput(i, remainingIds[j]);
+				}
+				continue;
+			}
+
+			if(remainingIds.empty()) continue;
+
+			DiskBasedMergeSort<span> diskBasedMergeSort(_mergeId, _outputDir, remainingIds, i, _codec, inputs);
+			diskBasedMergeSort.execute();
+		}
+
+		//Every partition of the group is merged: the pack files are not needed anymore
+		for(size_t j=0; j<datasetIds.size(); j++){
+			inputs.removePack(datasetIds[j]);
+		}
+
+		IFile* file = System::file().newFile(getFinishFilename(_outputDir, _mergeId), "w");
+		delete file;
+	}
+
+private:
+
+	string _outputDir;
+	size_t _mergeId;
+	size_t _nbPartitions;
+	SimkaCodecType _codec;
+};
+
+
+template<size_t span>
+class SimkaMergeAlgorithm : public Algorithm
+{
+
+public:
+
+	typedef typename Kmer<span>::Type                                       Type;
+	typedef typename Kmer<span>::Count                                      Count;
+	typedef typename DiskBasedMergeSort<span>::kxp kxp;
+
+    struct kxpcomp { bool operator() (kxp& l,kxp& r) { return (r._type < l._type); } } ;
+
+	SimkaMergeParameter& p;
+
+	SimkaMergeAlgorithm(SimkaMergeParameter& p) :
+		Algorithm("SimkaMergeAlgorithm", p.nbCores, p.props), p(p)
+	{
+		_abundanceThreshold.first = 0;
+		_abundanceThreshold.second = 999999999;
+
+		_computeSimpleDistances = p.computeSimpleDistances;
+		_computeComplexDistances = p.computeComplexDistances;
+		_kmerSize = p.kmerSize;
+		_minShannonIndex = p.minShannonIndex;
+	}
+
+	~SimkaMergeAlgorithm(){
+		//delete _progress;
+	}
+
+	void execute(){
+	    //Alexandre
+        _output_matrix = p.f_matrix;
+        _is_pipe = p.is_pipe;
+        _output_dir_m = p.d_matrix;
+        _nbCores = p.nbCores;
+
+        _json_file = p.json_path;
+        bool _groups = (_json_file != "None");
+        json _j_groups;
+        if (_groups)
+        {
+            std::ifstream ifs(_json_file);
+            ifs >> _j_groups;
+        }
+
+		//removeStorage(p);
+
+		_partitionId = p.partitionId;
+
+		_codecs = SimkaCodecConfig(p.props->getStr(STR_SIMKA_CODEC));
+
+		ofstream matrix_pipe;
+        SimkaCodecTextFile matrix_file;
+        char buffer[2048];
+
+        if ( _is_pipe )
+        {
+            matrix_pipe.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
+		    matrix_pipe.open(_output_matrix, std::ios::app);
+        }
+
+        else
+        {
+            SimkaCodecType matrixCodec = _codecs.get(SIMKA_STAGE_MATRIX);
+            const std::string matrix_part = _output_dir_m + "/" + Stringify::format("%i", _partitionId) + SimkaCodecTextFile::getExtension(matrixCodec);
+            matrix_file.open(matrix_part, matrixCodec);
+        }
+        //Alexandre
+		createDatasetIdList(p);
+		_nbBanks = _datasetIds.size();
+
+		string partDir = SimkaCommons::getPartitionDir(p.outputDir, _partitionId);
+		recoverKeptMerge(partDir);
+		SimkaPartitionInputs<span> inputs(p.outputDir);
+		vector<sortItem_Size_Filename_ID> filenameSizes = inputs.list(_partitionId);
+
+		//Dense inputs are merged window by window, without heap, whatever their number
+		bool isDenseMerge = isDenseInput(inputs, filenameSizes);
+
+		while(!isDenseMerge && filenameSizes.size() > SIMKA_MERGE_MAX_FILE_USED){
+
+			sort(filenameSizes.begin(),filenameSizes.end(),sortFileBySize);
+
+			vector<size_t> mergeDatasetIds;
+			vector<size_t> toRemoveItem;
+
+
+			for(size_t i=0; i<SIMKA_MERGE_MAX_FILE_USED; i++){
+				sortItem_Size_Filename_ID sfi = filenameSizes[i];
+				mergeDatasetIds.push_back(sfi._datasetID);
+			}
+
+			for(size_t i=0; i<mergeDatasetIds.size(); i++){
+				filenameSizes.erase(filenameSizes.begin());
+			}
+
+			size_t mergedId = mergeDatasetIds[0];
+			DiskBasedMergeSort<span> diskBasedMergeSort(mergedId, p.outputDir, mergeDatasetIds, _partitionId, _codecs.get(SIMKA_STAGE_CASCADE), inputs);
+			diskBasedMergeSort.execute();
+
+			filenameSizes.push_back(sortItem_Size_Filename_ID(getFileSize(diskBasedMergeSort._outputFilename), mergedId));
+		}
+
+		_stats = new SimkaStatistics(_nbBanks, p.computeSimpleDistances, p.computeComplexDistances, p.outputDir, _datasetIds);
+
+		string line;
+		vector<StorageIt<span>*> its;
+		u_int64_t nbKmers = 0;
+
+    	for(size_t i=0; i<filenameSizes.size(); i++){
+    		size_t datasetId = filenameSizes[i]._datasetID;
+    		its.push_back(new StorageIt<span>(inputs.open(_partitionId, datasetId), i, _partitionId));
+
+    		size_t currentPart = 0;
+	    	ifstream file((p.outputDir + "/kmercount_per_partition/" +  _datasetIds[i] + ".txt").c_str());
+			while(getline(file, line)){
+				if(line == "") continue;
+				if(currentPart == _partitionId){
+					nbKmers += strtoull(line.c_str(), NULL, 10);
+					break;
+				}
+				currentPart += 1;
+			}
+			file.close();
+    	}
+
+		
+		_nbDistinctKmers = 0;
+		_nbSharedDistinctKmers = 0;
+		u_int64_t nbKmersProcessed = 0;
+		size_t nbBankThatHaveKmer = 0;
+		u_int16_t best_p = 0;
+		Type previous_kmer;
+	    CountVector abundancePerBank;
+		abundancePerBank.resize(_nbBanks, 0);
+		SimkaCounterBuilderMerge* solidCounter = new SimkaCounterBuilderMerge(abundancePerBank);;
+		std::priority_queue< kxp, vector<kxp>,kxpcomp > pq;
+
+    	StorageIt<span>* bestIt;
+
+		//Dense inputs are read window by window by mergeDense
+		for(size_t i=0; i<its.size() && !isDenseMerge; i++){
+			StorageIt<span>* it = its[i];
+			it->_it->first();
+		}
+
+		_keptMergeBag = 0;
+		if(p.keepMerged){
+			vector<u_int32_t> sources;
+			for(size_t i=0; i<its.size(); i++){
+				const vector<u_int32_t>& inputSources = its[i]->_it->getSources();
+				sources.insert(sources.end(), inputSources.begin(), inputSources.end());
+			}
+			_keptMergeBag = new SimkaPartitionWriter<Type>(getKeptMergeFilename(partDir, _codecs.get(SIMKA_STAGE_CASCADE)) + ".temp", _codecs.get(SIMKA_STAGE_CASCADE), sources);
+		}
+
+		if(isDenseMerge) mergeDense(its, abundancePerBank, matrix_pipe, matrix_file, _groups, _j_groups);
+
+	    //fill the  priority queue with the first elems (it stays empty after a dense merge)
+	    for (size_t ii=0; ii<its.size() && !isDenseMerge; ii++)
+	    {
+	    	if(its[ii]->_it->isDone()) continue;
+	    	pq.push(kxp(its[ii]->value(), its[ii]->getBankId(), its[ii]->abundance(), its[ii]));
+	    }
+
+	    if (pq.size() != 0) // everything empty, no kmer at all
+	    {
+	        //get first pointer
+	    	bestIt = pq.top()._it; pq.pop();
+	        //best_p = get<1>(pq.top()) ; pq.pop();
+	        previous_kmer = bestIt->value();
+	        solidCounter->init (bestIt->getBankId(), bestIt->abundance());
+	        keepMerged(bestIt);
+	        nbBankThatHaveKmer = 1;
+
+	        unsigned int counter = 0;
+			while(1){
+
+				if (! bestIt->next())
+				{
+					//reaches end of one array
+					if(pq.size() == 0){
+						break;
+					}
+
+					//otherwise get new best
+					//best_p = get<1>(pq.top()) ; pq.pop();
+			    	bestIt = pq.top()._it; pq.pop();
+				}
+
+
+				if (bestIt->value() != previous_kmer )
+				{
+					//if diff, changes to new array, get new min pointer
+					pq.push(kxp(bestIt->value(), bestIt->getBankId(), bestIt->abundance(), bestIt)); //push new val of this pointer in pq, will be counted later
+
+			    	bestIt = pq.top()._it; pq.pop();
+					//best_p = get<1>(pq.top()) ; pq.pop();
+
+					//if new best is diff, this is the end of this kmer
+					if(bestIt->value()!=previous_kmer )
+					{
+						insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
+						//alexandre
+						if ( _is_pipe )
+                        {
+                            if (_groups) matrix_pipe << toMatrix(previous_kmer, abundancePerBank, _j_groups);
+                            else matrix_pipe << toMatrix (previous_kmer, abundancePerBank);
+                        }
+                        else
+                        {
+                            if (_groups) matrix_file << toMatrix(previous_kmer, abundancePerBank, _j_groups);
+                            else matrix_file << toMatrix (previous_kmer, abundancePerBank);
+                        }
+
+						solidCounter->init (bestIt->getBankId(), bestIt->abundance());
+						keepMerged(bestIt);
+						nbBankThatHaveKmer = 1;
+						previous_kmer = bestIt->value();
+					}
+					else
+					{
+						solidCounter->increase (bestIt->getBankId(), bestIt->abundance());
+						keepMerged(bestIt);
+						nbBankThatHaveKmer += 1;
+					}
+				}
+				else
+				{
+					solidCounter->increase (bestIt->getBankId(), bestIt->abundance());
+					keepMerged(bestIt);
+					nbBankThatHaveKmer += 1;
+				}
+			}
+
+			insert(previous_kmer, abundancePerBank, nbBankThatHaveKmer);
+			//Alexandre
+            if ( _is_pipe )
+            {
+                if (_groups) matrix_pipe << toMatrix(previous_kmer, abundancePerBank, _j_groups);
+                else matrix_pipe << toMatrix (previous_kmer, abundancePerBank);
+            }
+            else
+            {
+                if (_groups) matrix_file << toMatrix(previous_kmer, abundancePerBank, _j_groups);
+                else matrix_file << toMatrix (previous_kmer, abundancePerBank);
+            }
+        }
+
+
+	    matrix_file.close();
+		matrix_pipe.close();
+
+		saveStats(p);
+
+		delete _stats;
+		delete solidCounter;
+		
+        for(size_t i=0; i<its.size(); i++){
+			delete its[i];
+		}
+
+		if(_keptMergeBag){
+			vector<size_t> mergedIds;
+			for(size_t i=0; i<filenameSizes.size(); i++) mergedIds.push_back(filenameSizes[i]._datasetID);
+			finishKeptMerge(partDir, mergedIds);
+		}
+
+		writeFinishSignal(p);
+
+		//Only once the partition is marked as merged: a merge interrupted before needs its inputs again
+		if(p.removeInputs && !p.keepMerged){
+			for(size_t i=0; i<filenameSizes.size(); i++){
+				inputs.removeInput(_partitionId, filenameSizes[i]._datasetID);
+			}
+		}
+	}
+	
+	/** True if every input of the partition is a dense file (see SimkaDenseRanges) of the same range. */
+	bool isDenseInput(SimkaPartitionInputs<span>& inputs, const vector<sortItem_Size_Filename_ID>& filenameSizes){
+
+		if(!SimkaDenseRanges::isEnabled(_kmerSize)) return false;
+
+		bool isDense = true;
+		u_int64_t rangeStart = 0;
+		u_int64_t rangeEnd = 0;
+
+		for(size_t i=0; i<filenameSizes.size() && isDense; i++){
+			SimkaPartitionReader<Type>* reader = inputs.open(_partitionId, filenameSizes[i]._datasetID);
+			if(i == 0){
+				rangeStart = reader->getRangeStart();
+				rangeEnd = reader->getRangeEnd();
+			}
+			isDense = reader->isDense() && reader->getRangeStart() == rangeStart && reader->getRangeEnd() == rangeEnd;
+			delete reader;
+		}
+
+		return isDense;
+	}
+
+	/** Merge of dense inputs. Their windows cover the same k-mers, so the k-mers of a window are the
+	 * set bits of the union of the bitmaps of the inputs, in increasing order, and the count of an
+	 * input is its next count when its bit is set. The rows and statistics are the ones of the heap
+	 * merge. */
+	void mergeDense(vector<StorageIt<span>*>& its, CountVector& abundancePerBank, ofstream& matrix_pipe, SimkaCodecTextFile& matrix_file, bool groups, const json& j_groups){
+
+		if(its.empty()) return;
+
+		vector<SimkaPartitionReader<Type>*> readers;
+		for(size_t i=0; i<its.size(); i++){
+			readers.push_back(its[i]->_it);
+			readers[i]->firstWindow();
+		}
+
+		u_int64_t rangeStart = readers[0]->getRangeStart();
+		vector<SimkaPartitionReader<Type>*> windowReaders;
+		vector<u_int64_t> words;
+		Type kmer;
+
+		while(true){
+
+			u_int64_t window = (u_int64_t) -1;
+			for(size_t i=0; i<readers.size(); i++){
+				if(!readers[i]->isDone() && readers[i]->window() < window) window = readers[i]->window();
+			}
+			if(window == (u_int64_t) -1) break;
+
+			windowReaders.clear();
+			for(size_t i=0; i<readers.size(); i++){
+				if(!readers[i]->isDone() && readers[i]->window() == window) windowReaders.push_back(readers[i]);
+			}
+			words.resize(windowReaders.size());
+
+			u_int64_t windowStart = rangeStart + window * SIMKA_DENSE_WINDOW_SIZE;
+
+			for(size_t w=0; w<SIMKA_DENSE_WINDOW_SIZE/64; w++){
+
+				u_int64_t kmerBits = 0;
+				for(size_t i=0; i<windowReaders.size(); i++){
+					words[i] = windowReaders[i]->bitmapWord(w);
+					kmerBits |= words[i];
+				}
+
+				while(kmerBits != 0){
+
+					size_t bit = __builtin_ctzll(kmerBits);
+					kmerBits &= kmerBits - 1;
+					u_int64_t mask = (u_int64_t)1 << bit;
+					kmer.setVal(windowStart + w*64 + bit);
+
+					size_t nbBankThatHaveKmer = 0;
+					for(size_t i=0; i<windowReaders.size(); i++){
+						if((words[i] & mask) == 0) continue;
+						u_int32_t bankId = windowReaders[i]->bankId();
+						u_int64_t count = windowReaders[i]->nextCount();
+						abundancePerBank[bankId] = count;
+						if(_keptMergeBag) _keptMergeBag->insert(kmer, bankId, count);
+						nbBankThatHaveKmer += 1;
+					}
+
+					insert(kmer, abundancePerBank, nbBankThatHaveKmer);
+					if ( _is_pipe )
+					{
+						if (groups) matrix_pipe << toMatrix(kmer, abundancePerBank, j_groups);
+						else matrix_pipe << toMatrix (kmer, abundancePerBank);
+					}
+					else
+					{
+						if (groups) matrix_file << toMatrix(kmer, abundancePerBank, j_groups);
+						else matrix_file << toMatrix (kmer, abundancePerBank);
+					}
+
+					for(size_t i=0; i<windowReaders.size(); i++){
+						if(words[i] & mask) abundancePerBank[windowReaders[i]->bankId()] = 0;
+					}
+				}
+			}
+
+			for(size_t i=0; i<windowReaders.size(); i++) windowReaders[i]->nextWindow();
+		}
+	}
+
+	void keepMerged(StorageIt<span>* it){
+		if(_keptMergeBag) _keptMergeBag->insert(it->value(), it->getBankId(), it->abundance());
+	}
+
+	/** Stream of a kept merge, named after its codec as the other partition files. */
+	static string getKeptMergeFilename(const string& partDir, SimkaCodecType codec){
+		return partDir + "__p__0" + SimkaCodecTextFile::getExtension(codec);
+	}
+
+	/** Replace the merged partition files by the merged stream, __p__0.gz (no dataset is appended
+	 * with id 0). The stream is marked complete with a rename before any input is removed, and
+	 * its input list is kept until then, so recoverKeptMerge can finish an interrupted swap. */
+	void finishKeptMerge(const string& partDir, const vector<size_t>& mergedIds){
+
+		_keptMergeBag->flush();
+		delete _keptMergeBag;
+		_keptMergeBag = 0;
+
+		string filename = getKeptMergeFilename(partDir, _codecs.get(SIMKA_STAGE_CASCADE));
+		{
+			ofstream file((filename + ".inputs").c_str());
+			for(size_t i=0; i<mergedIds.size(); i++) file << mergedIds[i] << endl;
+			file.close();
+		}
+
+		System::file().rename(filename + ".temp", filename + ".merged");
+		recoverKeptMerge(partDir);
+	}
+
+	/** The swap may have been interrupted by a run with another codec: both names are looked up. */
+	void recoverKeptMerge(const string& partDir){
+
+		SimkaCodecType codecs[2] = {SIMKA_CODEC_ZLIB, SIMKA_CODEC_NONE};
+		for(size_t i=0; i<2; i++){
+
+			string filename = getKeptMergeFilename(partDir, codecs[i]);
+			if(!System::file().doesExist(filename + ".merged")) continue;
+
+			string line;
+			ifstream file((filename + ".inputs").c_str());
+			while(getline(file, line)){
+				if(line == "") continue;
+				for(size_t j=0; j<2; j++){
+					string inputFilename = partDir + "__p__" + line + SimkaCodecTextFile::getExtension(codecs[j]);
+					if(System::file().doesExist(inputFilename)) System::file().remove(inputFilename);
+				}
+			}
+			file.close();
+
+			System::file().rename(filename + ".merged", filename);
+			System::file().remove(filename + ".inputs");
+		}
+	}
+
+    void insert(const Type& kmer, const CountVector& counts, size_t nbBankThatHaveKmer)
+    {
+		//_stats->_nbDistinctKmers += 1;
+        if ( nbBankThatHaveKmer > 1 ) { _stats->_nbSharedKmers += 1; }
+	}
+
+	std::string toMatrix (const Type& kmer, const CountVector& counts) {
+        std::string new_line;
+
+        int sumLine = 0;
+        for ( auto& n : counts )
+        {
+            sumLine += n;
+            if ( sumLine > 1) goto keep;
+        }
+        return new_line;
+
+        keep:
+            _stats->_nbDistinctKmers += 1;
+            new_line += kmer.toString(_kmerSize);
+            new_line += " ";
+            for ( auto& i : counts )
+            {
+                if (i) new_line += "1";
+                else { new_line += "0";}
+            }
+            new_line += "\n";
+            return new_line;
+    }
+
+    std::string toMatrix (const Type& kmer, const CountVector& counts, const json& groups)
+    {
+	    std::string new_line(kmer.toString(_kmerSize));
+	    new_line += " ";
+        bool keep_kmers = false;
+	    for (int i=0; i<counts.size(); i++)
+        {
+	        if (counts[i] == 0) new_line += "0";
+	        else if (counts[i] > 1)
+            {
+                new_line += "1";
+                keep_kmers = true;
+            }
+	        else if (counts[i] == 1)
+            {
+	            std::cout << "enter" << std::endl;
+	            bool in_grp = check_group(counts, groups, i);
+	            if (in_grp)
+                {
+                    keep_kmers = true;
+	                new_line += "1";
+                }
+	            else new_line += "0";
+            }
+        }
+
+        if (keep_kmers) _stats->_nbDistinctKmers += 1;
+
+	    new_line += "\n";
+	    return new_line;
+    }
+
+    bool check_group(const CountVector& counts, const json& groups, const int& exp)
+    {
+	    auto l_groups = groups[std::to_string(exp)];
+	    int sum_in_group = 0;
+	    for ( auto& pos : l_groups )
+        {
+	        sum_in_group += counts[pos.get<int>()];
+	        if ( sum_in_group > 1 ) return true;
+        }
+	    return false;
+    }
+    //Alexandre
+    void createDatasetIdList(SimkaMergeParameter& p)
+    {
+
+    	string datasetIdFilename = p.outputDir + "/" + "datasetIds";
+        IFile* inputFile = System::file().newFile(datasetIdFilename, "rb");
+
+        inputFile->seeko(0, SEEK_END);
+		u_int64_t size = inputFile->tell();
+		inputFile->seeko(0, SEEK_SET);
+		char buffer2[size];
+		inputFile->fread(buffer2, size, size);
+		string fileContents(buffer2, size);
+
+		string line;
+		string linePart;
+		vector<string> linePartList;
+		stringstream fileContentsStream(fileContents);
+
+		while(getline(fileContentsStream, line)){
+
+			if(line == "") continue;
+
+			_datasetIds.push_back(line);
+		}
+
+		delete inputFile;
+	}
+
+
+	//void removeStorage(SimkaMergeParameter& p){
+	//	//Storage* storage = 0;
+	//	//storage = StorageFactory(STORAGE_HDF5).create (p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".stats", true, true);
+	//	//LOCAL (storage);
+	//}
+
+	void saveStats(SimkaMergeParameter& p){
+
+		string filename = p.outputDir + "/stats/part_" + SimkaAlgorithm<>::toString(p.partitionId) + ".gz";
+
+		_stats->save(filename, _codecs.get(SIMKA_STAGE_STATS)); //storage->getGroup(""));
+
+	}
+
+	void writeFinishSignal(SimkaMergeParameter& p){
+		string finishFilename = p.outputDir + "/merge_synchro/" +  SimkaAlgorithm<>::toString(p.partitionId) + ".ok";
+		IFile* file = System::file().newFile(finishFilename, "w");
+		delete file;
+	}
+
+private:
+	size_t _nbBanks;
+	bool _computeSimpleDistances;
+	bool _computeComplexDistances;
+	size_t _kmerSize;
+	float _minShannonIndex;
+    string _output_matrix;
+    string _output_dir_m;
+    bool _is_pipe;
+    string _json_file;
+	pair<size_t, size_t> _abundanceThreshold;
+	vector<string> _datasetIds;
+	size_t _partitionId;
+
+	IteratorListener* _progress;
+
+    //vector<ICommand*> _cmds;
+	//ICommand* _mergeCommand;
+	size_t _nbCores;
+
+
+	SimkaStatistics* _stats;
+	SimkaPartitionWriter<Type>* _keptMergeBag;
+	SimkaCodecConfig _codecs;
+	//SimkaCountProcessorSimple<span>* _processor;
+	u_int64_t _nbDistinctKmers;
+	u_int64_t _nbSharedDistinctKmers;
+};
+
+
+class SimkaMerge : public Tool
+{
+public:
+
+	SimkaMerge () : Tool ("SimkaMerge")
+    {
+		//Original input filename given to simka. Used to recreate dataset id list
+        getParser()->push_back (new OptionOneParam (STR_NB_CORES,   "nb cores", true));
+        getParser()->push_back (new OptionOneParam (STR_KMER_SIZE,   "kmer size", true));
+        getParser()->push_back (new OptionOneParam (STR_URI_INPUT,   "input filename", true));
+        getParser()->push_back (new OptionOneParam ("-out-tmp-simka",   "tmp output", true));
+        getParser()->push_back (new OptionOneParam ("-partition-id",   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-nb-cores",   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-max-memory",   "bank name", true));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_MIN_KMER_SHANNON_INDEX,   "bank name", true));
+        getParser()->push_back (new OptionOneParam ("-matrix", "output matrix", true));
+        getParser()->push_back (new OptionOneParam ("-dir-matrix", "dir output matrix", false, "./simka_results"));
+        getParser()->push_back (new OptionOneParam ("-pipe", "if pipe", false, "false"));
+        getParser()->push_back (new OptionOneParam ("-groups", "json file", false, "None"));
+        getParser()->push_back (new OptionNoParam ("-keep-merged", "replace the partition files by the merged one, for a later simka -reuse-counts", false));
+        getParser()->push_back (new OptionNoParam ("-remove-inputs", "remove the partition files, and release the pack file ranges, once the partition is merged", false));
+        getParser()->push_back (new OptionOneParam ("-premerge-id", "pre-merge the group of datasets listed in count_synchro/premerge_<id>.ids", false));
+        getParser()->push_back (new OptionOneParam ("-nb-partitions", "number of partitions (pre-merge only)", false, "0"));
+        getParser()->push_back (new OptionOneParam (STR_SIMKA_CODEC, "compression of the merged partition files, the matrix and the statistics", false, SimkaCodecConfig().toString()));
+
+        getParser()->push_back (new OptionNoParam (STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES.c_str(), "compute simple distances"));
+        getParser()->push_back (new OptionNoParam (STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES.c_str(), "compute complex distances"));
+    }
+
+    void execute ()
+    {
+
+    	if(getInput()->get("-premerge-id")){
+    		SimkaCodecConfig codecs(getInput()->getStr(STR_SIMKA_CODEC));
+    		SimkaPreMergeParameter params(getInput()->getStr("-out-tmp-simka"), getInput()->getInt("-premerge-id"), getInput()->getInt("-nb-partitions"), codecs.get(SIMKA_STAGE_CASCADE));
+    		Integer::apply<PreMergeFunctor,SimkaPreMergeParameter> (getInput()->getInt(STR_KMER_SIZE), params);
+    		return;
+    	}
+
+    	size_t nbCores =  getInput()->getInt(STR_NB_CORES);
+    	size_t kmerSize =  getInput()->getInt(STR_KMER_SIZE);
+    	size_t partitionId =  getInput()->getInt("-partition-id");
+    	string inputFilename =  getInput()->getStr(STR_URI_INPUT);
+    	string outputDir =  getInput()->getStr("-out-tmp-simka");
+    	double minShannonIndex =   getInput()->getDouble(STR_SIMKA_MIN_KMER_SHANNON_INDEX);
+    	bool computeSimpleDistances =   getInput()->get(STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES);
+    	bool computeComplexDistances =   getInput()->get(STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES);
+        string f_matrix = getInput()->getStr("-matrix");
+        string d_matrix = getInput()->getStr("-dir-matrix");
+        string pipe = getInput()->getStr("-pipe");
+        string json_path = getInput()->getStr("-groups");
+
+        bool is_pipe;
+        if (pipe == "true") is_pipe = true;
+        else is_pipe = false;
+
+        SimkaMergeParameter params(getInput(), inputFilename, outputDir, partitionId, kmerSize, minShannonIndex, computeSimpleDistances, computeComplexDistances, nbCores, f_matrix, d_matrix, is_pipe, json_path, getInput()->get("-keep-merged") != 0, getInput()->get("-remove-inputs") != 0);
+
+        Integer::apply<Functor,SimkaMergeParameter> (kmerSize, params);
+
+    }
+
+
+    template<size_t span>
+    struct Functor  {
+
+    	void operator ()  (SimkaMergeParameter& p)
+		{
+    		SimkaMergeAlgorithm<span>(p).execute();
+		}
+
+    };
+
+    struct SimkaPreMergeParameter
+    {
+    	SimkaPreMergeParameter (const string& outputDir, size_t mergeId, size_t nbPartitions, SimkaCodecType codec) : outputDir(outputDir), mergeId(mergeId), nbPartitions(nbPartitions), codec(codec) {}
+    	string outputDir;
+    	size_t mergeId;
+    	size_t nbPartitions;
+    	SimkaCodecType codec;
+    };
+
+    template<size_t span>
+    struct PreMergeFunctor  {
+
+    	void operator ()  (SimkaPreMergeParameter& p)
+		{
+    		SimkaPreMergeAlgorithm<span>(p.outputDir, p.mergeId, p.nbPartitions, p.codec).execute();
+		}
+
+    };
+};
+
+#endif
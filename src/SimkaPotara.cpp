@@ -38,6 +38,12 @@ SimkaPotara::SimkaPotara(const string& execFilename)  : Tool ("Simka")
 
     coreParser->push_back (new OptionOneParam (STR_SIMKA_NB_JOB_COUNT, "maximum number of simultaneous counting jobs (a higher value improve execution time but increase temporary disk usage)", false));
     coreParser->push_back (new OptionOneParam (STR_SIMKA_NB_JOB_MERGE, "maximum number of simultaneous merging jobs (1 job = 1 core)", false));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_MAX_DISK, "max temporary disk usage (MB): count jobs are delayed when they would exceed it", false));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_COUNT_CACHE, "directory of k-mer counts kept between runs: unchanged datasets are not counted again", false));
+    coreParser->push_back (new OptionNoParam (STR_SIMKA_REUSE_COUNTS, "reuse the kept counts of a previous run made with -keep-tmp in the same -out-tmp (its datasets must be listed first): only the new datasets are counted. The merge and the outputs still cover every dataset, they take as long as for a full run", false));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_CODEC, "compression of the temporary and output files: none, fast or default, for every file or per stage as <stage>=<codec>,... with stage in count, cascade, matrix, stats", false, SimkaCodecConfig().toString()));
+    coreParser->push_back (new OptionOneParam (STR_SIMKA_JOINT_COUNT, "count the datasets of less than this number of reads together, in jobs of about this number of reads (k > 15)", false));
+    coreParser->push_back (new OptionNoParam (STR_SIMKA_IN_PROCESS, "run counting and merging jobs on a thread pool inside simka instead of one process per job (ignored in cluster mode)", false));
 
 
     IOptionsParser* clusterParser = new OptionsParser ("cluster");
@@ -45,6 +51,9 @@ SimkaPotara::SimkaPotara(const string& execFilename)  : Tool ("Simka")
     clusterParser->push_back (new OptionOneParam (STR_SIMKA_JOB_MERGE_COMMAND, "command to submit merging job", false ));
     clusterParser->push_back (new OptionOneParam (STR_SIMKA_JOB_COUNT_FILENAME, "filename to the couting job template", false ));
     clusterParser->push_back (new OptionOneParam (STR_SIMKA_JOB_MERGE_FILENAME, "filename to the merging job template", false ));
+    clusterParser->push_back (new OptionOneParam (STR_SIMKA_NODE_CORES, "cores of a cluster node, the most a counting job is given (default: -nb-cores / -max-count)", false, "0"));
+    clusterParser->push_back (new OptionOneParam (STR_SIMKA_NODE_MEMORY, "memory of a cluster node (MB), the most a counting job is given (default: -max-memory / -max-count)", false, "0"));
+    clusterParser->push_back (new OptionOneParam (STR_SIMKA_JOB_ARRAY_INDEX, "submit each phase as a single array job: shell expression of the task index (from 1) set by the scheduler, ex: $SGE_TASK_ID, $SLURM_ARRAY_TASK_ID", false ));
 
 
 	//getParser()->push_back(coreParser);
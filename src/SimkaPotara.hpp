@@ -26,17 +26,27 @@
 #include <SimkaAlgorithm.hpp>
 #include <KmerCountCompressor.hpp>
 #include <Simka.hpp>
+#include <SimkaWorkStealingPool.hpp>
+#include <SimkaJobMonitor.hpp>
+#include <SimkaConcurrencyController.hpp>
+#include <SimkaDiskBudget.hpp>
+#include <SimkaCodec.hpp>
+#include "SimkaCount.hpp"
+#include "SimkaMerge.hpp"
+#include "SimkaCountCache.hpp"
 
 #include <gatb/kmer/impl/RepartitionAlgorithm.hpp>
 #include <gatb/kmer/impl/ConfigurationAlgorithm.hpp>
 
-//#include <unistd.h>
+#include <unistd.h>
 //#include <sys/wait.h>
 #include <cstdlib>
 
 //#define CLUSTER
 //#define SERIAL
 #define SLEEP_TIME_SEC 1
+//Least memory a count job is started with
+#define SIMKA_COUNT_MIN_MEMORY_MB 500
 
 const string STR_SIMKA_CLUSTER_MODE = "-cluster";
 const string STR_SIMKA_NB_JOB_COUNT = "-max-count";
@@ -45,6 +55,14 @@ const string STR_SIMKA_JOB_COUNT_COMMAND = "-count-cmd";
 const string STR_SIMKA_JOB_MERGE_COMMAND = "-merge-cmd";
 const string STR_SIMKA_JOB_COUNT_FILENAME = "-count-file";
 const string STR_SIMKA_JOB_MERGE_FILENAME = "-merge-file";
+const string STR_SIMKA_JOB_ARRAY_INDEX = "-array-index";
+const string STR_SIMKA_NODE_CORES = "-node-cores";
+const string STR_SIMKA_NODE_MEMORY = "-node-memory";
+const string STR_SIMKA_IN_PROCESS = "-in-process";
+const string STR_SIMKA_COUNT_CACHE = "-count-cache";
+const string STR_SIMKA_REUSE_COUNTS = "-reuse-counts";
+const string STR_SIMKA_MAX_DISK = "-max-disk";
+const string STR_SIMKA_JOINT_COUNT = "-joint-count";
 
 class SimkaBankSample : public BankDelegate
 {
@@ -142,6 +160,14 @@ public:
 		//cout << _refMaxReadSize << endl;
 	}
 
+	/** Constructor with the estimate of the referred bank already known. */
+	SimkaBankTemp (IBank* ref, u_int64_t maxReads, u_int64_t refNbReads, u_int64_t refTotalSeqSize, u_int64_t refMaxReadSize) : BankDelegate (ref) {
+		_maxReads = maxReads;
+		_refNbReads = refNbReads;
+		_refTotalSeqSize = refTotalSeqSize;
+		_refMaxReadSize = refMaxReadSize;
+	}
+
 
     void estimate (u_int64_t& number, u_int64_t& totalSize, u_int64_t& maxSize){
 
@@ -194,6 +220,15 @@ public:
 	{
 
 		_isClusterMode = false;
+		_nodeCores = 0;
+		_nodeMemory = 0;
+		_isInProcess = false;
+		_singletonFilter = false;
+		_repartitor = 0;
+		_countController = 0;
+		_mergeController = 0;
+		_countCache = 0;
+		_diskBudget = 0;
 
 		_execDir = System::file().getRealPath(execFilename);
 		_execDir = System::file().getDirectory(_execDir) + "/";
@@ -201,7 +236,11 @@ public:
 	}
 
 	~SimkaPotaraAlgorithm(){
-
+		if(_repartitor) _repartitor->forget();
+		delete _countController;
+		delete _mergeController;
+		delete _countCache;
+		delete _diskBudget;
 	}
 
 
@@ -215,8 +254,20 @@ public:
 
 		SimkaAlgorithm<span>::computeMaxReads();
 
+		if(this->_options->get(STR_SIMKA_REUSE_COUNTS)) loadMaxReads();
+		saveMaxReads();
+
+		applyCgroupLimits();
+
 		createConfig();
 
+		createDenseRanges();
+
+		createControllers();
+
+		if(_isInProcess) loadConfig();
+
+		createCountCache();
 
 		count();
 
@@ -224,6 +275,9 @@ public:
 
 		merge();
 
+		//With -keep-tmp, the merged stream kept in each partition covers every dataset
+		if(this->_keepTmpFiles) removePacks();
+
 		stats();
 
 
@@ -259,6 +313,17 @@ public:
 			system(command.c_str());
 			command = "rm " + this->_outputDirTemp + "/datasetIds";
 			system(command.c_str());
+			command = "rm -f " + this->_outputDirTemp + "/max_reads";
+			system(command.c_str());
+			command = "rm -f " + this->_outputDirTemp + "/config_estimates";
+			system(command.c_str());
+			command = "rm -f " + this->_outputDirTemp + "/dense_ranges";
+			system(command.c_str());
+
+			for(size_t i=1; i<this->_outputDirTempStripes.size(); i++){
+				command = "rm -rf " + this->_outputDirTempStripes[i];
+				system(command.c_str());
+			}
 		}
 	}
 
@@ -272,6 +337,11 @@ public:
 			_jobMergeFilename = this->_options->getStr(STR_SIMKA_JOB_MERGE_FILENAME);
 			_jobCountCommand = this->_options->getStr(STR_SIMKA_JOB_COUNT_COMMAND);
 			_jobMergeCommand = this->_options->getStr(STR_SIMKA_JOB_MERGE_COMMAND);
+			_isArrayMode = this->_options->get(STR_SIMKA_JOB_ARRAY_INDEX);
+			if(_isArrayMode) _arrayIndex = this->_options->getStr(STR_SIMKA_JOB_ARRAY_INDEX);
+			_nbArrayJobs = 0;
+			_nodeCores = this->_options->getInt(STR_SIMKA_NODE_CORES);
+			_nodeMemory = this->_options->getInt(STR_SIMKA_NODE_MEMORY);
 
 			if(! this->_options->get(STR_SIMKA_NB_JOB_COUNT) || this->_options->get(STR_SIMKA_NB_JOB_MERGE)){
 				cout << "Cluster mode enable. Be sure to set correctly the following arguments if you have any job submission constraints:" << endl;
@@ -307,6 +377,16 @@ public:
 		}
 		else{
 			_isClusterMode = false;
+			_isArrayMode = false;
+		}
+
+		_isInProcess = !_isClusterMode && this->_options->get(STR_SIMKA_IN_PROCESS);
+		_codecs = SimkaCodecConfig(this->_options->getStr(STR_SIMKA_CODEC));
+
+		_singletonFilter = this->_options->get(STR_SIMKA_SINGLETON_FILTER);
+		if(_singletonFilter && (SimkaDenseRanges::isEnabled(this->_kmerSize) || this->_abundanceThreshold.first < 2)){
+			cout << "WARNING: " << STR_SIMKA_SINGLETON_FILTER << " ignored, it needs -kmer-size > " << SIMKA_DENSE_MAX_KMER_SIZE << " and -abundance-min >= 2" << endl;
+			_singletonFilter = false;
 		}
 	}
 
@@ -315,10 +395,56 @@ public:
 		SimkaAlgorithm<span>::setup();
 
 		createDirs();
+		if(this->_options->get(STR_SIMKA_REUSE_COUNTS)) checkReuseCounts();
 		layoutInputFilename();
 
 	}
 
+	/** With -reuse-counts, the temp dir holds a previous run made with -keep-tmp. Its datasets must come
+	 * first in -in, in the same order, so that they keep their ids in the merged partition files.
+	 * They are already counted: only the new datasets are counted, then merged with the merged
+	 * partition files of the previous run. The merge and its outputs still cover every dataset. */
+	void checkReuseCounts(){
+
+		string datasetIdFilename = this->_outputDirTemp + "/" + "datasetIds";
+		if(!System::file().doesExist(datasetIdFilename) || !System::file().doesExist(this->_outputDirTemp + "/config.h5")){
+			cerr << "ERROR: -reuse-counts needs the temporary dir of a previous run made with -keep-tmp (" << this->_outputDirTemp << ")" << endl;
+			exit(1);
+		}
+
+		vector<string> previousBankNames;
+		string line;
+		ifstream file(datasetIdFilename.c_str());
+		while(getline(file, line)){
+			if(line == "") continue;
+			previousBankNames.push_back(line);
+		}
+		file.close();
+
+		if(previousBankNames.size() > this->_bankNames.size() || !equal(previousBankNames.begin(), previousBankNames.end(), this->_bankNames.begin())){
+			cerr << "ERROR: -reuse-counts: the " << previousBankNames.size() << " datasets of the previous run must be the first ones of the input file, in the same order" << endl;
+			exit(1);
+		}
+
+		cout << "Reusing the counts of the " << previousBankNames.size() << " datasets of the previous run, counting " << this->_bankNames.size() - previousBankNames.size() << " new datasets" << endl;
+	}
+
+	//The datasets of a previous run were counted with its number of reads per dataset
+	void loadMaxReads(){
+
+		ifstream file((this->_outputDirTemp + "/max_reads").c_str());
+		u_int64_t maxReads;
+		if(file >> maxReads){
+			this->_maxNbReads = maxReads;
+			cout << "Reads per sample used up to: " << (maxReads == 0 ? string("all") : SimkaAlgorithm<>::toString(maxReads)) << " (previous run)" << endl;
+		}
+	}
+
+	void saveMaxReads(){
+		ofstream file((this->_outputDirTemp + "/max_reads").c_str());
+		file << this->_maxNbReads << endl;
+	}
+
 	void layoutInputFilename(){
 
 		string datasetIdFilename = this->_outputDirTemp + "/" + "datasetIds";
@@ -348,13 +474,60 @@ public:
 		System::file().mkdir(this->_outputDirTemp + "/job_merge/", -1);
 		System::file().mkdir(this->_outputDirTemp + "/kmercount_per_partition/", -1);
 
+		for(size_t i=1; i<this->_outputDirTempStripes.size(); i++){
+			System::file().mkdir(this->_outputDirTempStripes[i] + "/solid/", -1);
+			System::file().mkdir(this->_outputDirTempStripes[i] + "/temp/", -1);
+		}
+
+	}
+
+	/** Do not plan for more cores or memory than the cgroup (container, slurm job...) allows,
+	 * so that simka is throttled or OOM-killed less often. */
+	void applyCgroupLimits(){
+
+		SimkaCgroupLimits cgroup;
+
+		double cpuLimit = cgroup.getCpuLimit();
+		if(cpuLimit > 0 && (size_t) ceil(cpuLimit) < this->_nbCores){
+			cout << "cgroup cpu.max allows " << cpuLimit << " cores: using " << (size_t) ceil(cpuLimit) << " cores instead of " << this->_nbCores << endl;
+			this->_nbCores = (size_t) ceil(cpuLimit);
+		}
+
+		u_int64_t memoryLimit = cgroup.getMemoryLimitMB() * 0.9;
+		if(memoryLimit > 0 && memoryLimit < this->_maxMemory){
+			cout << "cgroup memory.max allows " << cgroup.getMemoryLimitMB() << " MB: using " << memoryLimit << " MB instead of " << this->_maxMemory << " MB" << endl;
+			this->_maxMemory = memoryLimit;
+		}
+	}
+
+	/** The number of simultaneous jobs computed by createConfig is the starting point. It is adjusted
+	 * at runtime up to the number of cores, or up to -max-count/-max-merge when they are given.
+	 * Decisions are logged in log/concurrency.txt. */
+	void createControllers(){
+
+		string logFilename = this->_outputDirTemp + "/log/concurrency.txt";
+		string tempDir = this->_outputDirTemp + "/solid/";
+
+		//Raises stay within the memory and cores given to simka, whatever the number of datasets
+		size_t memoryPerMergeJob = max(this->_maxMemory / this->_nbCores, (size_t)1);
+		size_t capCount = max(min(this->_maxMemory / _memoryPerJob, this->_nbCores / _coresPerJob), (size_t)1);
+		size_t capMerge = max(min(this->_maxMemory / memoryPerMergeJob, this->_nbCores / _coresPerMergeJob), (size_t)1);
+
+		size_t maxJobCount = this->_options->get(STR_SIMKA_NB_JOB_COUNT) ? _maxJobCount : capCount;
+		size_t maxJobMerge = this->_options->get(STR_SIMKA_NB_JOB_MERGE) ? _maxJobMerge : capMerge;
+
+		_countController = new SimkaConcurrencyController("count", _maxJobCount, maxJobCount, _memoryPerJob, _coresPerJob, tempDir, logFilename);
+		_mergeController = new SimkaConcurrencyController("merge", _maxJobMerge, maxJobMerge, memoryPerMergeJob, _coresPerMergeJob, tempDir, logFilename);
+
+		_maxJobCount = maxJobCount;
+		_maxJobMerge = maxJobMerge;
 	}
 
 	void createConfig(){
 
 		size_t maxCores = this->_nbCores;
 		size_t maxMemory = this->_maxMemory;
-		size_t minMemoryPerJobMB = 500;
+		size_t minMemoryPerJobMB = SIMKA_COUNT_MIN_MEMORY_MB;
 
 
 		if(this->_options->get(STR_SIMKA_NB_JOB_COUNT)){
@@ -411,7 +584,7 @@ public:
 
 		cout << endl;
 		cout << "Maximum ressources used by Simka: " << endl;
-		cout << "\t - " << _maxJobCount << " simultaneous processes for counting the kmers (per job: " << _coresPerJob << " cores, " << _memoryPerJob << " MB memory)" << endl;
+		cout << "\t - " << _maxJobCount << " simultaneous processes for counting the kmers (per job: " << _coresPerJob << " cores, " << _memoryPerJob << " MB memory on average, larger datasets get more)" << endl;
 		cout << "\t - " << _maxJobMerge << " simultaneous processes for merging the kmer counts (per job: " << _coresPerMergeJob << " cores, memory undefined)" << endl;
 		cout << endl;
 
@@ -434,6 +607,7 @@ public:
 				repartitor->load(storage->getGroup(""));
 				delete repartitor;
 
+				loadDatasetEstimates();
 				return;
 		    }
 		    catch (Exception& e)
@@ -456,38 +630,64 @@ public:
 
 
 
-        size_t chosenBankId = 0;
-    	SimkaSequenceFilter dummyFilter(0, 0);
-    	//vector<SimkaBankFiltered<SimkaSequenceFilter>*> banksToDelete;
+        estimateDatasets();
 
+        size_t chosenBankId = 0;
     	string inputDir = this->_outputDirTemp + "/input/";
-    	u_int64_t maxPart = 0;
-    	for (size_t i=0; i<this->_nbBanks; i++){
-
-    		IBank* bank = Bank::open(inputDir + this->_bankNames[i]);
-    		LOCAL(bank);
+    	vector<size_t> datasetPartitions(this->_nbBanks, 0);
+
+    	{
+    		//Only the estimates of the datasets are needed here, not their reads
+    		SimkaWorkStealingPool pool(min((size_t)this->_nbCores, (size_t)this->_nbBanks));
+
+    		for (size_t i=0; i<this->_nbBanks; i++){
+    			pool.submit([this, i, &inputDir, &datasetPartitions](){
+    				try{
+    		    		IProperties* props = this->_options->clone();
+    		    		LOCAL(props);
+
+    		    		IBank* bank = Bank::open(inputDir + this->_bankNames[i]);
+    		    		LOCAL(bank);
+
+    		    		const DatasetEstimate& e = _datasetEstimates[i];
+    		    		SimkaBankTemp* simkaBank = new SimkaBankTemp(bank, this->_maxNbReads*this->_nbBankPerDataset[i], e._nbReads, e._totalSeqSize, e._maxReadSize);
+    		    		ConfigurationAlgorithm<span> testConfig(simkaBank, props);
+    		    		testConfig.execute();
+
+    		    		datasetPartitions[i] = testConfig.getConfiguration()._nb_partitions;
+    				}
+    				catch (Exception& e){
+    					addJobError("config " + this->_bankNames[i] + ": " + e.getMessage());
+    				}
+    				catch (std::exception& e){
+    					addJobError("config " + this->_bankNames[i] + ": " + e.what());
+    				}
+    			});
+    		}
 
-    		//size_t nbBank_ = bank->getCompositionNb();
-    		SimkaBankTemp* simkaBank = new SimkaBankTemp(bank, this->_maxNbReads*this->_nbBankPerDataset[i]);
-    		//banksToDelete.push_back(simkaBank);
-    		ConfigurationAlgorithm<span> testConfig(simkaBank, this->_options);
-    		testConfig.execute();
+    		pool.join();
+    		checkJobErrors(pool);
+    	}
 
-    		size_t part = testConfig.getConfiguration()._nb_partitions;
-    		if(part > maxPart){
-    			maxPart = part;
+    	u_int64_t maxPart = 0;
+    	DatasetEstimate inputEstimate;
+    	for (size_t i=0; i<this->_nbBanks; i++){
+    		if(datasetPartitions[i] > maxPart){
+    			maxPart = datasetPartitions[i];
     			chosenBankId = i;
     		}
-
-    		//delete simkaBank;
+    		inputEstimate._nbReads += _datasetEstimates[i]._nbReads;
+    		inputEstimate._totalSeqSize += _datasetEstimates[i]._totalSeqSize;
+    		inputEstimate._maxReadSize = max(inputEstimate._maxReadSize, _datasetEstimates[i]._maxReadSize);
     	}
 		
         this->_options->setInt(STR_MAX_MEMORY, _memoryPerJob);
 
-    	IBank* inputbank = Bank::open(this->_banksInputFilename);
+    	IBank* inputbank = new SimkaBankTemp(Bank::open(this->_banksInputFilename), 0, inputEstimate._nbReads, inputEstimate._totalSeqSize, inputEstimate._maxReadSize);
     	LOCAL(inputbank);
 
-		IBank* bank = Bank::open(this->_outputDirTemp + "/input/" + this->_bankNames[chosenBankId]);
+    	const DatasetEstimate& chosenEstimate = _datasetEstimates[chosenBankId];
+		IBank* bank = new SimkaBankTemp(Bank::open(this->_outputDirTemp + "/input/" + this->_bankNames[chosenBankId]), 0, chosenEstimate._nbReads, chosenEstimate._totalSeqSize, chosenEstimate._maxReadSize);
 		LOCAL(bank);
 
 		
@@ -504,14 +704,32 @@ public:
 		_nbPartitions = max((size_t)maxPart, (size_t)_maxJobMerge);
 		//_nbPartitions = max(_nbPartitions, (size_t)32);
 
+		//Cached counts are only valid with the repartition table they were computed with
+		string cachedRepartitionId = "";
+		if(this->_options->get(STR_SIMKA_COUNT_CACHE)){
+			size_t nbPartitions = 0;
+			cachedRepartitionId = SimkaCountCache<span>::findRepartition(this->_options->getStr(STR_SIMKA_COUNT_CACHE), this->_kmerSize, config2, _nbPartitions, nbPartitions);
+			if(cachedRepartitionId != "") _nbPartitions = nbPartitions;
+		}
+
 		cout << "Nb partitions: " << _nbPartitions << " partitions" << endl << endl << endl;
 		//_nbPartitions = max((int)_nbPartitions, (int)30);
 
 		config1._nb_partitions = _nbPartitions;
 		config2._nb_partitions = _nbPartitions;
 
-        RepartitorAlgorithm<span> repart (inputbank, storage->getGroup(""), config1);
-        repart.execute ();
+        if(cachedRepartitionId != ""){
+        	cout << "\tusing repartition table " << cachedRepartitionId << " of the count cache" << endl;
+        	Repartitor* repartitor = new Repartitor();
+        	LOCAL(repartitor);
+        	SimkaCountCache<span>::loadRepartition(this->_options->getStr(STR_SIMKA_COUNT_CACHE), cachedRepartitionId, *repartitor);
+        	repartitor->save(storage->getGroup(""));
+        	SimkaCountCache<span>::writeRepartitionId(this->_outputDirTemp, cachedRepartitionId);
+        }
+        else{
+        	RepartitorAlgorithm<span> repart (inputbank, storage->getGroup(""), config1);
+        	repart.execute ();
+        }
 
 		uint64_t memoryUsageCachedItems;
 		config2._nb_cached_items_per_core_per_part = 1 << 8; // cache at least 256 items (128 here, then * 2 in the next while loop)
@@ -526,10 +744,341 @@ public:
 		
 	}
 
+	/** Value ranges of the partitions of the small k-mers, computed once the number of partitions is known. */
+	void createDenseRanges(){
+
+		if(!SimkaDenseRanges::isEnabled(this->_kmerSize)) return;
+
+		string filename = SimkaCommons::getDenseRangesFilename(this->_outputDirTemp);
+		SimkaDenseRanges ranges;
+		if(ranges.load(filename, this->_kmerSize, _nbPartitions)) return;
+
+		ranges.compute(this->_kmerSize, _nbPartitions);
+		ranges.save(filename + ".temp");
+		System::file().rename(filename + ".temp", filename);
+	}
+
+	struct DatasetEstimate{
+		DatasetEstimate() : _nbReads(0), _totalSeqSize(0), _maxReadSize(0) {}
+		u_int64_t _nbReads;
+		u_int64_t _totalSeqSize;
+		u_int64_t _maxReadSize;
+	};
+
+	/** Estimate the number of reads and the size of every dataset, in parallel. The estimate of a
+	 * dataset only samples the reads of its first file: its other files (paired reads, runs of a
+	 * same sample) are assumed to hold the same number of reads per byte.
+	 * Estimates are kept in config_estimates next to config.h5, and reused while the files of
+	 * the dataset are unchanged. */
+	void estimateDatasets(){
+
+		string estimatesFilename = this->_outputDirTemp + "/config_estimates";
+		string inputDir = this->_outputDirTemp + "/input/";
+
+		map<string, pair<string, DatasetEstimate> > cachedEstimates;
+		readEstimates(estimatesFilename, cachedEstimates);
+
+		_datasetEstimates.assign(this->_nbBanks, DatasetEstimate());
+		vector<string> descriptions(this->_nbBanks);
+		size_t nbCached = 0;
+
+		{
+			SimkaWorkStealingPool pool(min((size_t)this->_nbCores, (size_t)this->_nbBanks));
+
+			for (size_t i=0; i<this->_nbBanks; i++){
+
+				vector<string> filenames;
+				vector<u_int64_t> sizes;
+				descriptions[i] = describeDataset(inputDir + this->_bankNames[i], filenames, sizes);
+
+				map<string, pair<string, DatasetEstimate> >::iterator it = cachedEstimates.find(this->_bankNames[i]);
+				if(it != cachedEstimates.end() && it->second.first == descriptions[i]){
+					_datasetEstimates[i] = it->second.second;
+					nbCached += 1;
+					continue;
+				}
+
+				pool.submit([this, i, filenames, sizes](){
+					try{
+						estimateDataset(filenames, sizes, _datasetEstimates[i]);
+					}
+					catch (Exception& e){
+						addJobError("estimate " + this->_bankNames[i] + ": " + e.getMessage());
+					}
+					catch (std::exception& e){
+						addJobError("estimate " + this->_bankNames[i] + ": " + e.what());
+					}
+				});
+			}
+
+			pool.join();
+			checkJobErrors(pool);
+		}
+
+		if(nbCached > 0) cout << "\t" << nbCached << " dataset estimates reused from " << estimatesFilename << endl;
+
+		ofstream file(estimatesFilename.c_str());
+		for (size_t i=0; i<this->_nbBanks; i++){
+			const DatasetEstimate& e = _datasetEstimates[i];
+			file << this->_bankNames[i] << "\t" << descriptions[i] << "\t" << e._nbReads << "\t" << e._totalSeqSize << "\t" << e._maxReadSize << "\n";
+		}
+	}
+
+	/** Estimates of a previous configuration (config.h5 already exists). The datasets missing
+	 * from config_estimates are estimated again, one by one. */
+	void loadDatasetEstimates(){
+
+		map<string, pair<string, DatasetEstimate> > cachedEstimates;
+		readEstimates(this->_outputDirTemp + "/config_estimates", cachedEstimates);
+
+		_datasetEstimates.assign(this->_nbBanks, DatasetEstimate());
+
+		for (size_t i=0; i<this->_nbBanks; i++){
+
+			map<string, pair<string, DatasetEstimate> >::iterator it = cachedEstimates.find(this->_bankNames[i]);
+			if(it != cachedEstimates.end()){
+				_datasetEstimates[i] = it->second.second;
+				continue;
+			}
+
+			IBank* bank = Bank::open(this->_outputDirTemp + "/input/" + this->_bankNames[i]);
+			LOCAL(bank);
+			_datasetEstimates[i]._nbReads = bank->estimateNbItems();
+		}
+	}
+
+	//name <tab> files <tab> nbReads <tab> totalSeqSize <tab> maxReadSize
+	static void readEstimates(const string& filename, map<string, pair<string, DatasetEstimate> >& estimates){
+
+		ifstream file(filename.c_str());
+		string line;
+		while(getline(file, line)){
+			vector<string> fields;
+			stringstream lineStream(line);
+			string field;
+			while(getline(lineStream, field, '\t')) fields.push_back(field);
+			if(fields.size() != 5) continue;
+
+			DatasetEstimate e;
+			e._nbReads = strtoull(fields[2].c_str(), NULL, 10);
+			e._totalSeqSize = strtoull(fields[3].c_str(), NULL, 10);
+			e._maxReadSize = strtoull(fields[4].c_str(), NULL, 10);
+			estimates[fields[0]] = make_pair(fields[1], e);
+		}
+	}
+
+	/** Files of a dataset and their size, with a description (path, size, mtime of every file)
+	 * that changes when one of the files changes. */
+	static string describeDataset(const string& inputFilename, vector<string>& filenames, vector<u_int64_t>& sizes){
+
+		string description = "";
+		string filename;
+		ifstream inputFile(inputFilename.c_str());
+
+		while(getline(inputFile, filename)){
+
+			if(filename == "") continue;
+
+			struct stat st;
+			if(stat(filename.c_str(), &st) != 0){
+				st.st_size = 0;
+				st.st_mtime = 0;
+			}
+
+			filenames.push_back(filename);
+			sizes.push_back(st.st_size);
+			description += filename + ":" + Stringify::format("%llu", (u_int64_t) st.st_size) + ":" + Stringify::format("%llu", (u_int64_t) st.st_mtime) + "|";
+		}
+
+		return description;
+	}
+
+	static void estimateDataset(const vector<string>& filenames, const vector<u_int64_t>& sizes, DatasetEstimate& estimate){
+
+		if(filenames.empty()) return;
+
+		IBank* bank = Bank::open(filenames[0]);
+		LOCAL(bank);
+		bank->estimate(estimate._nbReads, estimate._totalSeqSize, estimate._maxReadSize);
+
+		u_int64_t totalSize = 0;
+		for(size_t i=0; i<sizes.size(); i++) totalSize += sizes[i];
+
+		if(sizes[0] > 0 && totalSize > sizes[0]){
+			double factor = (double) totalSize / (double) sizes[0];
+			estimate._nbReads *= factor;
+			estimate._totalSeqSize *= factor;
+		}
+	}
+
+	/** Load the configuration and the repartition table once, to be shared by the in-process count jobs. */
+	void loadConfig(){
+
+		Storage* storage = StorageFactory(STORAGE_HDF5).load (this->_outputDirTemp + "/" + "config.h5");
+		LOCAL (storage);
+
+		_config.load(storage->getGroup(""));
+
+		_repartitor = new Repartitor();
+		_repartitor->use();
+		_repartitor->load(storage->getGroup(""));
+	}
+
+	/** Open the count cache (-count-cache). The repartition table of this run is added to the
+	 * cache when it was not taken from it. */
+	void createCountCache(){
+
+		if(!this->_options->get(STR_SIMKA_COUNT_CACHE)) return;
+
+		string cacheDir = this->_options->getStr(STR_SIMKA_COUNT_CACHE);
+		System::file().mkdir(cacheDir, -1);
+
+		{
+			Storage* storage = StorageFactory(STORAGE_HDF5).load (this->_outputDirTemp + "/" + "config.h5");
+			LOCAL (storage);
+
+			Configuration config;
+			config.load(storage->getGroup(""));
+
+			Repartitor* repartitor = new Repartitor();
+			LOCAL(repartitor);
+			repartitor->load(storage->getGroup(""));
+
+			SimkaCountCache<span>::registerRepartition(cacheDir, this->_outputDirTemp, this->_kmerSize, config, *repartitor);
+		}
+
+		string parameters = "k=" + SimkaAlgorithm<>::toString(this->_kmerSize);
+		parameters += " abundance-min=" + SimkaAlgorithm<>::toString(this->_abundanceThreshold.first);
+		parameters += " abundance-max=" + SimkaAlgorithm<>::toString(this->_abundanceThreshold.second);
+		parameters += " min-read-size=" + SimkaAlgorithm<>::toString(this->_minReadSize);
+		parameters += " read-shannon-index=" + Stringify::format("%f", this->_minReadShannonIndex);
+		parameters += " max-reads=" + SimkaAlgorithm<>::toString(this->_maxNbReads);
+		//Counts cached in an older partition file format are not reused
+		parameters += " format=" SIMKA_PARTITION_MAGIC;
+		if(SimkaDenseRanges::isEnabled(this->_kmerSize)) parameters += " partitioning=ranges";
+		if(_singletonFilter) parameters += " singleton-filter";
+		if(this->_minKmerShannonIndex > 0) parameters += " kmer-shannon-index=" + Stringify::format("%f", this->_minKmerShannonIndex);
+
+		_countCache = new SimkaCountCache<span>(cacheDir, this->_outputDirTemp, this->_bankNames, this->_nbBankPerDataset, _nbPartitions, parameters);
+	}
+
+	/** Take the counts of a dataset from the count cache instead of counting it. */
+	bool restoreCount(size_t i){
+
+		if(!_countCache || !_countCache->restore(i, this->_bankNames[i], getPackFilename(i))) return false;
+
+		{
+			std::unique_lock<std::mutex> lock(_countResourcesMutex);
+			_countNotStarted.erase(_countRank[i]);
+		}
+		finishCountDisk(i);
+		return true;
+	}
+
+	/** Enforce -max-disk on the count jobs. The partition files left by a previous run are
+	 * already on disk. Array jobs are all submitted at once: the budget can't be applied. */
+	void createDiskBudget(){
+
+		if(!this->_options->get(STR_SIMKA_MAX_DISK) || _diskBudget) return;
+
+		if(_isArrayMode){
+			cout << "\t" << STR_SIMKA_MAX_DISK << " is ignored with " << STR_SIMKA_JOB_ARRAY_INDEX << endl;
+			return;
+		}
+
+		_diskBudget = new SimkaDiskBudget((u_int64_t) this->_options->getInt(STR_SIMKA_MAX_DISK) * 1024 * 1024);
+		_datasetDiskBytes.assign(this->_bankNames.size(), 0);
+
+		u_int64_t usedBytes = 0;
+		for(size_t p=0; p<_nbPartitions; p++){
+			string partDir = SimkaCommons::getPartitionDir(this->_outputDirTemp, p);
+			vector<string> filenames = System::file().listdir(partDir);
+			for(size_t j=0; j<filenames.size(); j++){
+				if(filenames[j].compare(0, 5, "__p__") != 0) continue;
+				usedBytes += getFileBytes(partDir + filenames[j]);
+			}
+		}
+		map<size_t, string> packFilenames = SimkaCommons::listPackFilenames(this->_outputDirTemp);
+		for(map<size_t, string>::iterator it=packFilenames.begin(); it!=packFilenames.end(); ++it){
+			usedBytes += getFileBytes(it->second);
+		}
+		_diskBudget->addUsed(usedBytes);
+
+		cout << "\tTemporary disk budget: " << _diskBudget->getMaxBytes()/(1024*1024) << " MB (" << usedBytes/(1024*1024) << " MB already used)" << endl;
+	}
+
+	static u_int64_t getFileBytes(const string& filename){
+		struct stat st;
+		if(stat(filename.c_str(), &st) != 0) return 0;
+		return st.st_size;
+	}
+
+	/** Bytes of the pack file of a dataset, or of the partition files of a pre-merge output. */
+	u_int64_t getPartitionBytes(size_t id){
+		u_int64_t bytes = 0;
+		if(id < this->_bankNames.size()){
+			bytes += getFileBytes(getPackFilename(id));
+		}
+		for(size_t p=0; p<_nbPartitions; p++){
+			bytes += getFileBytes(SimkaCommons::findPartitionFilename(this->_outputDirTemp, p, id));
+		}
+		return bytes;
+	}
+
+	string getPackFilename(size_t i){
+		return SimkaCommons::getPackFilename(this->_outputDirTemp, _countStripes[i], i);
+	}
+
+	void finishCountDisk(size_t i){
+		if(!_diskBudget) return;
+		_datasetDiskBytes[i] = getPartitionBytes(i);
+		_diskBudget->finish(i, _datasetSizes[i], _datasetDiskBytes[i], getCountTempBytes(i));
+	}
+
+	/** Bytes of the temporary files of the count job of a dataset, line 5 of its .ok file
+	 * (0 for the files written before it was there). */
+	u_int64_t getCountTempBytes(size_t i){
+		ifstream file((this->_outputDirTemp + "/count_synchro/" + this->_bankNames[i] + ".ok").c_str());
+		string line;
+		for(size_t j=0; j<5; j++){
+			if(!getline(file, line)) return 0;
+		}
+		return strtoull(line.c_str(), NULL, 10);
+	}
+
+	//The partition files of the group are replaced by the pre-merged ones
+	void finishPreMergeDisk(size_t mergeId){
+
+		if(!_diskBudget) return;
+
+		vector<size_t> group;
+		{
+			std::unique_lock<std::mutex> lock(_preMergeMutex);
+			map<size_t, vector<size_t> >::iterator it = _preMergeGroups.find(mergeId);
+			if(it == _preMergeGroups.end()) return;
+			group.swap(it->second);
+			_preMergeGroups.erase(it);
+		}
+
+		u_int64_t removedBytes = 0;
+		for(size_t j=0; j<group.size(); j++) removedBytes += _datasetDiskBytes[group[j]];
+
+		_diskBudget->addUsed(getPartitionBytes(mergeId));
+		_diskBudget->removeUsed(removedBytes);
+	}
+
+	void removePacks(){
+		map<size_t, string> packFilenames = SimkaCommons::listPackFilenames(this->_outputDirTemp);
+		for(map<size_t, string>::iterator it=packFilenames.begin(); it!=packFilenames.end(); ++it){
+			System::file().remove(it->second);
+		}
+	}
+
+	//Partitions have to be merged again once a dataset is (re)counted
 	void removeMergeSynchro(){
 
-	    for (size_t i=0; i<this->_bankNames.size(); i++){
-			string finishFilename = this->_outputDirTemp + "/merge_synchro/" +  this->_bankNames[i] + ".ok";
+	    for (size_t i=0; i<_nbPartitions; i++){
+			string finishFilename = this->_outputDirTemp + "/merge_synchro/" +  SimkaAlgorithm<>::toString(i) + ".ok";
 			if(System::file().doesExist(finishFilename)) System::file().remove(finishFilename);
 	    }
 	}
@@ -566,10 +1115,15 @@ public:
 
 		cout << endl << "Counting k-mers... (log files are " + this->_outputDirTemp + "/log/count_*)" << endl;
 
-	    for (size_t i=0; i<_nbPartitions; i++){
-	    	System::file().mkdir(this->_outputDirTemp + "/solid/part_" + Stringify::format("%i", i), -1);
+	    createPartitionDirs();
+
+	    _bankIndexes.clear();
+	    for (size_t i=0; i<this->_bankNames.size(); i++){
+	    	_bankIndexes[this->_bankNames[i]] = i;
 	    }
 
+	    scheduleCountJobs();
+
 		vector<string> commands;
 
 		_progress = new ProgressSynchro (
@@ -577,22 +1131,62 @@ public:
 			System::thread().newSynchronizer());
 		_progress->init ();
 
-		vector<string> filenameQueue;
-		vector<string> filenameQueueToRemove;
-		size_t nbJobs = 0;
+		if(_isInProcess){
+			countInProcess();
+			_progress->finish();
+			delete _progress;
+			return;
+		}
 
-	    for (size_t i=0; i<this->_bankNames.size(); i++){
+		resumePreMerges();
+		createDiskBudget();
+
+		SimkaJobMonitor monitor(this->_outputDirTemp + "/count_synchro/");
+		_nbRunningPreMerges = 0;
+		_preMergeCandidates.clear();
+		vector<string> arrayNames;
+		vector<string> arrayCommands;
 
+	    for (size_t k=0; k<_countOrder.size(); k++){
+
+	    	size_t i = _countOrder[k];
 			string logFilename = this->_outputDirTemp + "/log/count_" + this->_bankNames[i] + ".txt";
 
 			string finishFilename = this->_outputDirTemp + "/count_synchro/" +  this->_bankNames[i] + ".ok";
 			if(System::file().doesExist(finishFilename)){
-				_progress->inc(1);
+				_progress->inc(getNbJobDatasets(i));
 				cout << "\t" << this->_bankNames[i] << " already counted (remove file " << finishFilename << " to count again)" << endl;
 				continue;
 			}
 
-			string tempDir = this->_outputDirTemp + "/temp/" + this->_bankNames[i];
+			removeMergeSynchro();
+
+			if(restoreCount(i)){
+				_progress->inc(1);
+				if(isPreMergeEnabled(i)) _preMergeCandidates.push_back(i);
+				continue;
+			}
+
+			if(_diskBudget){
+				while(!_diskBudget->canStart(_datasetSizes[i])){
+					waitCountJobs(monitor);
+					launchPreMerges(monitor, false);
+				}
+				_diskBudget->start(i, _datasetSizes[i]);
+			}
+
+			string tempDir = _countTempDirs[i];
+
+			//Array tasks start whenever the scheduler decides: they all get the average share
+			size_t nbCores = _coresPerJob;
+			size_t memory = _memoryPerJob;
+			if(!_isArrayMode){
+				while(!canReserveCountResources()){
+					waitCountJobs(monitor);
+					launchPreMerges(monitor, false);
+				}
+				reserveCountResources(i, nbCores, memory);
+			}
 
 			string command = "nohup " + _execDir + "/simkaCountProcess " + _execDir + "/simkaCount ";
 			command += " " + string(STR_KMER_SIZE) + " " + SimkaAlgorithm<>::toString(this->_kmerSize);
@@ -601,114 +1195,706 @@ public:
 			command += " -bank-name " + this->_bankNames[i];
 			command += " -bank-index " + SimkaAlgorithm<>::toString(i);
 			command += " -nb-datasets " + SimkaAlgorithm<>::toString(this->_nbBankPerDataset[i]);
-			command += " " + string(STR_MAX_MEMORY) + " " + SimkaAlgorithm<>::toString(_memoryPerJob);
-			command += " " + string(STR_NB_CORES) + " " + SimkaAlgorithm<>::toString(_coresPerJob);
+			command += " " + string(STR_MAX_MEMORY) + " " + SimkaAlgorithm<>::toString(memory);
+			command += " " + string(STR_NB_CORES) + " " + SimkaAlgorithm<>::toString(nbCores);
 			command += " " + string(STR_URI_INPUT) + " dummy ";
             command += " " + string(STR_KMER_ABUNDANCE_MIN) + " " + SimkaAlgorithm<>::toString(this->_abundanceThreshold.first);
 			command += " " + string(STR_KMER_ABUNDANCE_MAX) + " " + SimkaAlgorithm<>::toString(this->_abundanceThreshold.second);
 			command += " " + string(STR_SIMKA_MIN_READ_SIZE) + " " + SimkaAlgorithm<>::toString(this->_minReadSize);
 			command += " " + string(STR_SIMKA_MIN_READ_SHANNON_INDEX) + " " + Stringify::format("%f", this->_minReadShannonIndex);
+			command += " " + string(STR_SIMKA_MIN_KMER_SHANNON_INDEX) + " " + Stringify::format("%f", this->_minKmerShannonIndex);
 			command += " " + string(STR_SIMKA_MAX_READS) + " " + SimkaAlgorithm<>::toString(this->_maxNbReads);
 			command += " -nb-partitions " + SimkaAlgorithm<>::toString(_nbPartitions);
+			command += " -pack-stripe " + SimkaAlgorithm<>::toString(_countStripes[i]);
+			command += " " + STR_SIMKA_CODEC + " " + _codecs.toString();
+			if(_singletonFilter) command += " " + STR_SIMKA_SINGLETON_FILTER;
+			if(getNbJobDatasets(i) > 1) command += " -joint";
 			command += " >> " + logFilename + " 2>&1";
 
-			filenameQueue.push_back(this->_bankNames[i]);
 			System::file().mkdir(tempDir, -1);
 
 			string str = "Counting dataset " + SimkaAlgorithm<>::toString(i) + "\n";
 			str += "\t" + command + "\n\n\n";
 			system(("echo \"" + str + "\" > " + logFilename).c_str());
 
-			removeMergeSynchro();
-
 
-			if(_isClusterMode){
+			if(_isArrayMode){
+				arrayNames.push_back(this->_bankNames[i]);
+				arrayCommands.push_back(command);
+			}
+			else if(_isClusterMode){
 				string jobFilename = this->_outputDirTemp + "/job_count/job_count_" + SimkaAlgorithm<>::toString(i) + ".bash";
-				IFile* jobFile = System::file().newFile(jobFilename.c_str(), "w");
-				system(("chmod 755 " + jobFilename).c_str());
-				string jobCommand = _jobCountContents + '\n' + '\n';
-				jobCommand += command;
-
-
-				jobFile->fwrite(jobCommand.c_str(), jobCommand.size(), 1);
-				jobFile->flush();
-				string submitCommand = _jobCountCommand + " " + jobFile->getPath();
-				delete jobFile;
-				system(submitCommand.c_str());
+				submitJob(monitor, this->_bankNames[i], command, jobFilename, _jobCountContents, _jobCountCommand);
 			}
 			else{
-				command += " &";
-				system(command.c_str());
+				monitor.launchLocal(this->_bankNames[i], command);
 			}
 
+			while(monitor.nbRunning() >= _countController->getLimit() + _nbRunningPreMerges){
+				waitCountJobs(monitor);
+				launchPreMerges(monitor, k+1 == _countOrder.size());
+			}
+	    }
 
-			nbJobs += 1;
+	    if(!arrayNames.empty()){
+	    	submitArrayJob(monitor, arrayNames, arrayCommands, "job_count", "count", _jobCountContents, _jobCountCommand, _countController->getLimit());
+	    }
 
-			if(nbJobs >= _maxJobCount){
-				while(true){
-					bool isJobAvailbale = false;
+	    launchPreMerges(monitor, true);
 
-					for(size_t j=0; j<filenameQueue.size(); j++){
+	    while(monitor.nbRunning() > 0){
+	    	waitCountJobs(monitor);
+	    	launchPreMerges(monitor, true);
+	    }
 
-						string finishFilename2 = this->_outputDirTemp + "/count_synchro/" + filenameQueue[j] + ".ok";
-						if(System::file().doesExist(finishFilename2)){
-							filenameQueueToRemove.push_back(filenameQueue[j]);
-							isJobAvailbale = true;
-							nbJobs -= 1;
-							//cout << "job finished" << endl;
-							_progress->inc(1);
-						}
-					}
+	    _progress->finish();
+	    delete _progress;
+	}
 
-					if(isJobAvailbale){
-						for(size_t j=0; j<filenameQueueToRemove.size(); j++){
-							filenameQueue.erase(std::remove(filenameQueue.begin(), filenameQueue.end(), filenameQueueToRemove[j]), filenameQueue.end());
-						}
-						filenameQueueToRemove.clear();
-						break;
-					}
-					else{
-						//sleep(1);
-                        const struct timespec t[] {{0, 1000000000L}};
-						nanosleep(t, NULL);
-					}
+	/** Partitions are striped round-robin over the temp dirs (-out-tmp dir1,dir2,...), so that the
+	 * count and merge jobs of different partitions use different devices. The partition dir in the
+	 * first temp dir is a link to the actual one, the path used by every job. */
+	void createPartitionDirs(){
 
-					if(i >= this->_bankNames.size()) break;
-				}
-			}
+		const vector<string>& tempDirs = this->_outputDirTempStripes;
+
+	    for (size_t i=0; i<_nbPartitions; i++){
+
+	    	string partDir = this->_outputDirTemp + "/solid/part_" + Stringify::format("%i", i);
+	    	size_t stripe = i % tempDirs.size();
+
+	    	if(stripe == 0 || System::file().doesExist(partDir)){
+	    		System::file().mkdir(partDir, -1);
+	    		continue;
+	    	}
+
+	    	string stripeDir = tempDirs[stripe] + "/solid/part_" + Stringify::format("%i", i);
+	    	System::file().mkdir(stripeDir, -1);
+
+	    	if(symlink(stripeDir.c_str(), partDir.c_str()) != 0){
+	    		cerr << "ERROR: can't link " << partDir << " to " << stripeDir << " (" << strerror(errno) << ")" << endl;
+	    		exit(1);
+	    	}
+	    }
+
+	    //Pack files follow the temp dir of their count job
+	    System::file().mkdir(this->_outputDirTemp + "/solid/packs/", -1);
+	    for (size_t i=0; i<tempDirs.size(); i++){
+
+	    	string packDir = SimkaCommons::getPackDir(this->_outputDirTemp, i);
+	    	if(i == 0 || System::file().doesExist(packDir)){
+	    		System::file().mkdir(packDir, -1);
+	    		continue;
+	    	}
 
+	    	string stripeDir = tempDirs[i] + "/solid/packs";
+	    	System::file().mkdir(stripeDir, -1);
 
+	    	packDir.erase(packDir.size()-1);
+	    	if(symlink(stripeDir.c_str(), packDir.c_str()) != 0){
+	    		cerr << "ERROR: can't link " << packDir << " to " << stripeDir << " (" << strerror(errno) << ")" << endl;
+	    		exit(1);
+	    	}
 	    }
+	}
+
+	/** Order the count jobs largest first (LPT) from the estimates of createConfig, so that a
+	 * large dataset does not end up running alone at the end of the phase. */
+	void scheduleCountJobs(){
+
+		_datasetSizes.resize(this->_bankNames.size());
+		_countOrder.clear();
+
+		for (size_t i=0; i<this->_bankNames.size(); i++){
+
+			u_int64_t nbReads = _datasetEstimates[i]._nbReads;
+			if(this->_maxNbReads > 0) nbReads = min(nbReads, (u_int64_t) this->_maxNbReads * this->_nbBankPerDataset[i]);
+			_datasetSizes[i] = max(nbReads, (u_int64_t) 1);
+		}
+
+		//A joint count job is run by its first dataset, the others are not scheduled
+		createJointGroups();
+		vector<bool> isJointMember(this->_bankNames.size(), false);
+		for(map<size_t, vector<size_t> >::iterator it=_jointGroups.begin(); it!=_jointGroups.end(); ++it){
+			for(size_t j=1; j<it->second.size(); j++){
+				isJointMember[it->second[j]] = true;
+				_datasetSizes[it->first] += _datasetSizes[it->second[j]];
+			}
+		}
+
+		for (size_t i=0; i<this->_bankNames.size(); i++){
+			if(!isJointMember[i]) _countOrder.push_back(i);
+		}
+
+		stable_sort(_countOrder.begin(), _countOrder.end(), [this](size_t a, size_t b){
+			return _datasetSizes[a] > _datasetSizes[b];
+		});
+
+		_countNotStarted.clear();
+		for (size_t k=0; k<_countOrder.size(); k++){
+			if(System::file().doesExist(this->_outputDirTemp + "/count_synchro/" +  this->_bankNames[_countOrder[k]] + ".ok")) continue;
+			_countNotStarted.insert(k);
+		}
+
+		_countRank.resize(this->_bankNames.size());
+		for (size_t k=0; k<_countOrder.size(); k++){
+			_countRank[_countOrder[k]] = k;
+		}
+
+		//With several temp dirs, the temporary files of a count job go to the one with the least data assigned
+		const vector<string>& tempDirs = this->_outputDirTempStripes;
+		vector<u_int64_t> tempDirSizes(tempDirs.size(), 0);
+		_countTempDirs.resize(this->_bankNames.size());
+		_countStripes.resize(this->_bankNames.size());
+		for (size_t k=0; k<_countOrder.size(); k++){
+			size_t i = _countOrder[k];
+			size_t best = min_element(tempDirSizes.begin(), tempDirSizes.end()) - tempDirSizes.begin();
+			tempDirSizes[best] += _datasetSizes[i];
+			_countTempDirs[i] = tempDirs[best] + "/temp/" + this->_bankNames[i];
+			_countStripes[i] = best;
+		}
+
+		_countCoresInUse = 0;
+		_countMemoryInUse = 0;
+		_countSizeInUse = 0;
+		_countResources.clear();
+	}
+
+	/** Group the datasets of less than -joint-count reads not counted yet into joint count jobs of
+	 * about -joint-count reads (see SimkaCount::JointBank). The groups of a previous run are kept:
+	 * an interrupted joint job is counted again with the same datasets. Joint counts need the
+	 * super-k-mer counter (k > SIMKA_DENSE_MAX_KMER_SIZE); datasets are cached one by one, so
+	 * they are not grouped with -count-cache. */
+	void createJointGroups(){
+
+		_jointGroups.clear();
+		if(!this->_options->get(STR_SIMKA_JOINT_COUNT)) return;
+
+		if(SimkaDenseRanges::isEnabled(this->_kmerSize) || _countCache){
+			cout << "\t" << STR_SIMKA_JOINT_COUNT << " is ignored with k <= " << SIMKA_DENSE_MAX_KMER_SIZE << " or with " << STR_SIMKA_COUNT_CACHE << endl;
+			return;
+		}
+
+		u_int64_t maxGroupSize = this->_options->getInt(STR_SIMKA_JOINT_COUNT);
+		string synchroDir = this->_outputDirTemp + "/count_synchro/";
+		vector<bool> isGrouped(this->_bankNames.size(), false);
+
+		vector<string> filenames = System::file().listdir(synchroDir);
+		for(size_t i=0; i<filenames.size(); i++){
+
+			const string& filename = filenames[i];
+			if(filename.compare(0, 6, "joint_") != 0 || filename.size() <= 4 || filename.compare(filename.size()-4, 4, ".ids") != 0) continue;
+
+			vector<SimkaCount::JointBank> banks = SimkaCount::readJointJournal(this->_outputDirTemp, strtoull(filename.c_str() + 6, NULL, 10));
+			vector<size_t> group;
+			for(size_t j=0; j<banks.size(); j++){
+				if(banks[j].index >= this->_bankNames.size() || this->_bankNames[banks[j].index] != banks[j].name || isGrouped[banks[j].index]) break;
+				group.push_back(banks[j].index);
+			}
+			//Datasets of another input file
+			if(group.size() != banks.size()) continue;
 
+			for(size_t j=0; j<group.size(); j++) isGrouped[group[j]] = true;
+			_jointGroups[group[0]] = group;
+		}
+
+		vector<size_t> group;
+		u_int64_t groupSize = 0;
+		for(size_t i=0; i<=this->_bankNames.size(); i++){
 
-	    while(nbJobs > 0){
-			bool isJobAvailbale = false;
+			bool isLast = i == this->_bankNames.size();
+			if(!isLast){
+				if(isGrouped[i] || _datasetSizes[i] >= maxGroupSize || System::file().doesExist(synchroDir + this->_bankNames[i] + ".ok")) continue;
+				group.push_back(i);
+				groupSize += _datasetSizes[i];
+			}
 
-			for(size_t j=0; j<filenameQueue.size(); j++){
+			if(!isLast && groupSize < maxGroupSize && group.size() < SUPERKC_MAX_BANKS) continue;
 
-				string finishFilename2 = this->_outputDirTemp + "/count_synchro/" + filenameQueue[j] + ".ok";
-				if(System::file().doesExist(finishFilename2)){
-					filenameQueueToRemove.push_back(filenameQueue[j]);
-					isJobAvailbale = true;
-					nbJobs -= 1;
-					_progress->inc(1);
+			if(group.size() > 1){
+				vector<SimkaCount::JointBank> banks;
+				for(size_t j=0; j<group.size(); j++){
+					banks.push_back(SimkaCount::JointBank(group[j], this->_bankNames[group[j]], this->_nbBankPerDataset[group[j]]));
 				}
+				SimkaCount::writeJointJournal(this->_outputDirTemp, banks);
+				_jointGroups[group[0]] = group;
 			}
+			group.clear();
+			groupSize = 0;
+		}
+
+		if(!_jointGroups.empty()) cout << "\t" << _jointGroups.size() << " joint count jobs for the small datasets" << endl;
+	}
+
+	/** Number of datasets counted by the job of dataset i. */
+	size_t getNbJobDatasets(size_t i){
+		map<size_t, vector<size_t> >::iterator it = _jointGroups.find(i);
+		return it == _jointGroups.end() ? 1 : it->second.size();
+	}
+
+	/** Cores and memory of a starting count job: its share of the global budget is its size
+	 * over the size of the jobs it will run alongside (running ones, and the next ones to
+	 * start in the free slots), bounded by what is still free and by the resources of a node
+	 * in cluster mode. Waits until the least a job runs with is free (see canReserveCountResources). */
+	void reserveCountResources(size_t i, size_t& nbCores, size_t& memory){
+
+		std::unique_lock<std::mutex> lock(_countResourcesMutex);
+		_countResourcesReleased.wait(lock, [this]{ return hasFreeCountResources(); });
+
+		_countNotStarted.erase(_countRank[i]);
+
+		long double sizeSum = _datasetSizes[i] + _countSizeInUse;
+		size_t nbAlongside = _countResources.size() + 1;
+		for(set<size_t>::iterator it=_countNotStarted.begin(); it!=_countNotStarted.end() && nbAlongside < _countController->getLimit(); ++it, ++nbAlongside){
+			sizeSum += _datasetSizes[_countOrder[*it]];
+		}
+
+		long double share = _datasetSizes[i] / sizeSum;
+		size_t maxCores = this->_nbCores;
+		size_t maxMemory = this->_maxMemory;
+
+		//In cluster mode, -nb-cores and -max-memory are the resources of the whole cluster, and a job runs on a single node
+		size_t maxJobCores = maxCores;
+		size_t maxJobMemory = maxMemory;
+		if(_isClusterMode){
+			maxJobCores = _nodeCores > 0 ? _nodeCores : _coresPerJob;
+			maxJobMemory = _nodeMemory > 0 ? _nodeMemory : _memoryPerJob;
+		}
+
+		size_t freeCores = min(maxCores - min(_countCoresInUse, maxCores), maxJobCores);
+		nbCores = (size_t) (maxCores * share);
+		nbCores = max(min(max(nbCores, (size_t)1), freeCores), (size_t)1);
+
+		size_t freeMemory = min(maxMemory - min(_countMemoryInUse, maxMemory), maxJobMemory);
+		memory = (size_t) (maxMemory * share);
+		memory = min(max(memory, (size_t)SIMKA_COUNT_MIN_MEMORY_MB), freeMemory);
+
+		_countCoresInUse += nbCores;
+		_countMemoryInUse += memory;
+		_countSizeInUse += _datasetSizes[i];
+		_countResources[i] = make_pair(nbCores, memory);
+	}
+
+	/** A count job starts once a core and SIMKA_COUNT_MIN_MEMORY_MB are free, or when no other
+	 * one is running: the budget is never overcommitted, except by a job alone. */
+	bool canReserveCountResources(){
+		std::unique_lock<std::mutex> lock(_countResourcesMutex);
+		return hasFreeCountResources();
+	}
+
+	bool hasFreeCountResources(){
+		if(_countResources.empty()) return true;
+		return _countCoresInUse + 1 <= this->_nbCores && _countMemoryInUse + SIMKA_COUNT_MIN_MEMORY_MB <= this->_maxMemory;
+	}
+
+	void releaseCountResources(size_t i){
+
+		std::unique_lock<std::mutex> lock(_countResourcesMutex);
+
+		map<size_t, pair<size_t, size_t> >::iterator it = _countResources.find(i);
+		if(it == _countResources.end()) return;
 
-			if(isJobAvailbale){
-				for(size_t j=0; j<filenameQueueToRemove.size(); j++){
-					filenameQueue.erase(std::remove(filenameQueue.begin(), filenameQueue.end(), filenameQueueToRemove[j]), filenameQueue.end());
+		_countCoresInUse -= it->second.first;
+		_countMemoryInUse -= it->second.second;
+		_countSizeInUse -= _datasetSizes[i];
+		_countResources.erase(it);
+		_countResourcesReleased.notify_all();
+	}
+
+	void waitCountJobs(SimkaJobMonitor& monitor){
+
+		vector<string> finished;
+		waitJobs(monitor, "count", finished);
+
+		if(!_isArrayMode) _countController->update(monitor.nbRunning() - _nbRunningPreMerges + finished.size());
+
+		for(size_t i=0; i<finished.size(); i++){
+			if(finished[i].compare(0, 9, "premerge_") == 0){
+				_nbRunningPreMerges -= 1;
+				finishPreMergeDisk(strtoull(finished[i].c_str() + 9, NULL, 10));
+				continue;
+			}
+			size_t bankIndex = _bankIndexes[finished[i]];
+			_progress->inc(getNbJobDatasets(bankIndex));
+			releaseCountResources(bankIndex);
+			finishCountDisk(bankIndex);
+			if(_countCache) _countCache->store(bankIndex, finished[i], getPackFilename(bankIndex));
+			if(isPreMergeEnabled(bankIndex)) _preMergeCandidates.push_back(bankIndex);
+		}
+	}
+
+	/** Block until at least one running job of the phase is finished, then release its slot.
+	 * A job that exits without writing its synchro file stops simka (see its log file). */
+	void waitJobs(SimkaJobMonitor& monitor, const string& phase){
+		vector<string> finished;
+		waitJobs(monitor, phase, finished);
+		_progress->inc(finished.size());
+	}
+
+	void waitJobs(SimkaJobMonitor& monitor, const string& phase, vector<string>& finished){
+
+		vector<string> failed;
+		monitor.waitFinished(finished, failed);
+
+		if(!failed.empty()){
+			for(size_t i=0; i<failed.size(); i++){
+				cerr << "ERROR: " << phase << " job " << failed[i] << " failed (see " << this->_outputDirTemp << "/log/" << phase << "_" << failed[i] << ".txt)" << endl;
+			}
+			exit(1);
+		}
+	}
+
+	void countInProcess(){
+
+		resumePreMerges();
+		createDiskBudget();
+
+		SimkaWorkStealingPool pool(_maxJobCount);
+		pool.setMaxActive(_countController->getLimit());
+		bool hasJob = false;
+		_preMergeCandidates.clear();
+
+		//Workers pop their own tasks from the back: submit the smallest datasets first
+		//so that the largest ones are started first
+	    for (size_t k=_countOrder.size(); k-- > 0; ){
+
+	    	size_t i = _countOrder[k];
+
+			string finishFilename = this->_outputDirTemp + "/count_synchro/" +  this->_bankNames[i] + ".ok";
+			if(System::file().doesExist(finishFilename)){
+				_progress->inc(getNbJobDatasets(i));
+				cout << "\t" << this->_bankNames[i] << " already counted (remove file " << finishFilename << " to count again)" << endl;
+				continue;
+			}
+
+			if(!hasJob){
+				removeMergeSynchro();
+				hasJob = true;
+			}
+
+			//A failed count is neither cached nor pre-merged, its resources are released
+			pool.submit([this, i, &pool](){
+				bool isCounted = restoreCount(i);
+				if(!isCounted){
+					if(_diskBudget) _diskBudget->waitStart(i, _datasetSizes[i]);
+					size_t nbCores, memory;
+					reserveCountResources(i, nbCores, memory);
+					isCounted = runCountJob(i, nbCores, memory);
+					releaseCountResources(i);
+					finishCountDisk(i);
+					if(isCounted && _countCache) _countCache->store(i, this->_bankNames[i], getPackFilename(i));
 				}
-				filenameQueueToRemove.clear();
-				//break;
+				_progress->inc(getNbJobDatasets(i));
+				if(isCounted && isPreMergeEnabled(i)) addPreMergeCandidateInProcess(pool, i);
+			});
+	    }
+
+	    while(!pool.join(SIMKA_CONTROLLER_PERIOD_SEC)){
+	    	std::unique_lock<std::mutex> lock(_countResourcesMutex);
+	    	pool.setMaxActive(_countController->update(pool.nbActive()));
+	    }
+	    checkJobErrors(pool);
+	}
+
+	/** Queue a pre-merge on the pool as soon as enough datasets are counted.
+	 * It is picked by the worker that counted the last dataset of the group. */
+	void addPreMergeCandidateInProcess(SimkaWorkStealingPool& pool, size_t bankIndex){
+
+		vector<size_t> group;
+		{
+			std::unique_lock<std::mutex> lock(_preMergeMutex);
+			_preMergeCandidates.push_back(bankIndex);
+			if(_preMergeCandidates.size() < SIMKA_MERGE_MAX_FILE_USED) return;
+			group.swap(_preMergeCandidates);
+		}
+
+		size_t mergeId = createPreMerge(group);
+
+		pool.submit([this, mergeId](){
+			runPreMerge(mergeId);
+			finishPreMergeDisk(mergeId);
+		});
+	}
+
+	//Pre-merging only pays off when the final merge would have to cascade. Dense partition
+	//files (small k-mers) are merged without cascade, pre-merging would make them sparse.
+	//The pack of a joint count already holds several datasets, it goes to the final merge.
+	bool isPreMergeEnabled(size_t i){
+		return this->_bankNames.size() > SIMKA_MERGE_MAX_FILE_USED && !SimkaDenseRanges::isEnabled(this->_kmerSize) && getNbJobDatasets(i) == 1;
+	}
+
+	/** Pre-merge groups of counted datasets while counting goes on. One pre-merge
+	 * may run next to the count jobs (it is mostly I/O), others only take free slots.
+	 * \param[in] countLaunched : every count job is already launched */
+	void launchPreMerges(SimkaJobMonitor& monitor, bool countLaunched){
+
+		vector<string> arrayNames;
+		vector<string> arrayCommands;
+
+		while(_preMergeCandidates.size() >= SIMKA_MERGE_MAX_FILE_USED){
+
+			if(_nbRunningPreMerges > 0 && (!countLaunched || monitor.nbRunning() >= _countController->getLimit())) break;
+
+			vector<size_t> group(_preMergeCandidates.begin(), _preMergeCandidates.begin() + SIMKA_MERGE_MAX_FILE_USED);
+			_preMergeCandidates.erase(_preMergeCandidates.begin(), _preMergeCandidates.begin() + SIMKA_MERGE_MAX_FILE_USED);
+
+			size_t mergeId = createPreMerge(group);
+			string name = "premerge_" + SimkaAlgorithm<>::toString(mergeId);
+			string logFilename = this->_outputDirTemp + "/log/count_" + name + ".txt";
+
+			string command = "nohup " + _execDir + "/simkaMerge ";
+			command += " " + string(STR_KMER_SIZE) + " " + SimkaAlgorithm<>::toString(this->_kmerSize);
+			command += " " + string(STR_URI_INPUT) + " " + this->_inputFilename;
+			command += " " + string("-out-tmp-simka") + " " + this->_outputDirTemp;
+			command += " -partition-id 0";
+			command += " " + string(STR_MAX_MEMORY) + " " + SimkaAlgorithm<>::toString(_memoryPerJob);
+			command += " " + string(STR_NB_CORES) + " 1";
+			command += " " + string(STR_SIMKA_MIN_KMER_SHANNON_INDEX) + " " + Stringify::format("%f", this->_minKmerShannonIndex);
+			command += " -matrix " + this->_output_m;
+			command += " -premerge-id " + SimkaAlgorithm<>::toString(mergeId);
+			command += " -nb-partitions " + SimkaAlgorithm<>::toString(_nbPartitions);
+			command += " " + STR_SIMKA_CODEC + " " + _codecs.toString();
+			command += " >> " + logFilename + " 2>&1";
+
+			string str = "Pre-merging datasets into " + name + "\n";
+			str += "\t" + command + "\n\n\n";
+			system(("echo \"" + str + "\" > " + logFilename).c_str());
+
+			if(_isArrayMode){
+				arrayNames.push_back(name);
+				arrayCommands.push_back(command);
+			}
+			else if(_isClusterMode){
+				string jobFilename = this->_outputDirTemp + "/job_merge/job_" + name + ".bash";
+				submitJob(monitor, name, command, jobFilename, _jobMergeContents, _jobMergeCommand);
 			}
 			else{
-				sleep(1);
+				monitor.launchLocal(name, command);
 			}
+
+			_nbRunningPreMerges += 1;
+		}
+
+		if(!arrayNames.empty()){
+			submitArrayJob(monitor, arrayNames, arrayCommands, "job_merge", "premerge", _jobMergeContents, _jobMergeCommand, arrayNames.size());
+		}
+	}
+
+	/** Write the job file of a cluster job and submit it. */
+	void submitJob(SimkaJobMonitor& monitor, const string& name, const string& command, const string& jobFilename, const string& jobContents, const string& submitCommand){
+
+		IFile* jobFile = System::file().newFile(jobFilename.c_str(), "w");
+		system(("chmod 755 " + jobFilename).c_str());
+		string jobCommand = jobContents + '\n' + '\n';
+		jobCommand += command;
+
+		jobFile->fwrite(jobCommand.c_str(), jobCommand.size(), 1);
+		jobFile->flush();
+		string submit = submitCommand + " " + jobFile->getPath();
+		delete jobFile;
+		system(submit.c_str());
+		monitor.watch(name);
+	}
+
+	/** Submit jobs as a single array job of the scheduler. Line i of the manifest is
+	 * "<i> <name> <command>" (tab separated); the array job file runs the command of
+	 * the line given by the task index (-array-index). In the submission command,
+	 * {nb_tasks} and {max_tasks} are replaced by the number of tasks and the number
+	 * of tasks allowed to run at the same time.
+	 * \param[in] jobDir : "job_count" or "job_merge"
+	 * \param[in] phase : prefix of the array job files */
+	void submitArrayJob(SimkaJobMonitor& monitor, const vector<string>& names, const vector<string>& commands, const string& jobDir,
+			const string& phase, const string& jobContents, const string& submitCommand, size_t maxTasks){
+
+		string prefix = this->_outputDirTemp + "/" + jobDir + "/array_" + phase + "_" + SimkaAlgorithm<>::toString(_nbArrayJobs);
+		string manifestFilename = prefix + ".manifest";
+		string jobFilename = prefix + ".bash";
+		_nbArrayJobs += 1;
+
+		IFile* manifestFile = System::file().newFile(manifestFilename.c_str(), "w");
+		for(size_t i=0; i<names.size(); i++){
+			string line = SimkaAlgorithm<>::toString(i+1) + "\t" + names[i] + "\t" + commands[i] + "\n";
+			manifestFile->fwrite(line.c_str(), line.size(), 1);
+		}
+		manifestFile->flush();
+		delete manifestFile;
+
+		IFile* jobFile = System::file().newFile(jobFilename.c_str(), "w");
+		system(("chmod 755 " + jobFilename).c_str());
+		string jobCommand = jobContents + '\n' + '\n';
+		jobCommand += "SIMKA_TASK_INDEX=" + _arrayIndex + "\n";
+		jobCommand += "eval \"$(sed -n \"${SIMKA_TASK_INDEX}p\" " + manifestFilename + " | cut -f3-)\"\n";
+
+		jobFile->fwrite(jobCommand.c_str(), jobCommand.size(), 1);
+		jobFile->flush();
+		delete jobFile;
+
+		string submit = submitCommand;
+		replaceAll(submit, "{nb_tasks}", SimkaAlgorithm<>::toString(names.size()));
+		replaceAll(submit, "{max_tasks}", SimkaAlgorithm<>::toString(max(min(maxTasks, names.size()), (size_t)1)));
+		submit += " " + jobFilename;
+
+		cout << "\tsubmitting " << names.size() << " " << phase << " tasks as one array job (manifest: " << manifestFilename << ")" << endl;
+		system(submit.c_str());
+
+		for(size_t i=0; i<names.size(); i++){
+			monitor.watch(names[i]);
+		}
+	}
+
+	static void replaceAll(string& str, const string& from, const string& to){
+		for(size_t pos = str.find(from); pos != string::npos; pos = str.find(from, pos + to.size())){
+			str.replace(pos, from.size(), to);
+		}
+	}
+
+	/** Write the journal of a pre-merge group. Its output id is not a dataset id,
+	 * so that an interrupted pre-merge can always be told apart from its inputs. */
+	size_t createPreMerge(const vector<size_t>& group){
+		size_t mergeId = this->_bankNames.size() + *min_element(group.begin(), group.end());
+		SimkaPreMergeAlgorithm<span>::writeJournal(this->_outputDirTemp, mergeId, group);
+		{
+			std::unique_lock<std::mutex> lock(_preMergeMutex);
+			_preMergeGroups[mergeId] = group;
+		}
+		return mergeId;
+	}
+
+	void runPreMerge(size_t mergeId){
+
+		try{
+			SimkaPreMergeAlgorithm<span>(this->_outputDirTemp, mergeId, _nbPartitions, _codecs.get(SIMKA_STAGE_CASCADE)).execute();
+		}
+		catch (Exception& e){
+			addJobError("premerge " + SimkaAlgorithm<>::toString(mergeId) + ": " + e.getMessage());
+		}
+		catch (std::exception& e){
+			addJobError("premerge " + SimkaAlgorithm<>::toString(mergeId) + ": " + e.what());
+		}
+	}
+
+	/** Complete the pre-merges of a previous run that were interrupted. */
+	void resumePreMerges(){
+
+		vector<string> filenames = System::file().listdir(this->_outputDirTemp + "/count_synchro/");
+
+		for(size_t i=0; i<filenames.size(); i++){
+
+			const string& filename = filenames[i];
+			if(filename.compare(0, 9, "premerge_") != 0 || filename.size() <= 4 || filename.compare(filename.size()-4, 4, ".ids") != 0) continue;
+
+			size_t mergeId = strtoull(filename.c_str() + 9, NULL, 10);
+			if(System::file().doesExist(SimkaPreMergeAlgorithm<span>::getFinishFilename(this->_outputDirTemp, mergeId))) continue;
+
+			cout << "\tcompleting interrupted pre-merge " << mergeId << endl;
+			runPreMerge(mergeId);
+		}
+
+		checkJobErrors();
+	}
+
+	/** Body of a simkaCount process, run on a thread of simka.
+	 * \return false if the job failed, its error is kept for checkJobErrors */
+	bool runCountJob(size_t i, size_t nbCores, size_t memory){
+
+		try{
+			string tempDir = _countTempDirs[i];
+			System::file().mkdir(tempDir, -1);
+
+			IProperties* props = this->_options->clone();
+			LOCAL(props);
+			props->setInt(STR_VERBOSE, 0);
+			props->setInt(STR_MAX_MEMORY, memory);
+			props->setInt(STR_NB_CORES, nbCores);
+			props->setStr(STR_URI_OUTPUT_TMP, tempDir);
+
+			SimkaCount::Parameter p(props, this->_kmerSize, this->_outputDirTemp, this->_bankNames[i], this->_minReadSize, this->_minReadShannonIndex,
+					this->_maxNbReads, this->_nbBankPerDataset[i], _nbPartitions, this->_abundanceThreshold.first, this->_abundanceThreshold.second, i, _countStripes[i]);
+			if(getNbJobDatasets(i) > 1) p.banks = SimkaCount::readJointJournal(this->_outputDirTemp, i);
+
+			SimkaCount::Functor<span>().count(p, _config, _repartitor);
+			return true;
+		}
+		catch (Exception& e){
+			addJobError("count " + this->_bankNames[i] + ": " + e.getMessage());
+		}
+		catch (std::exception& e){
+			addJobError("count " + this->_bankNames[i] + ": " + e.what());
+		}
+		return false;
+	}
+
+	void mergeInProcess(){
+
+		SimkaWorkStealingPool pool(_maxJobMerge);
+		pool.setMaxActive(_mergeController->getLimit());
+
+	    for (size_t i=0; i<_nbPartitions; i++){
+
+	    	string datasetId = SimkaAlgorithm<>::toString(i);
+			string finishFilename = this->_outputDirTemp + "/merge_synchro/" +  datasetId + ".ok";
+
+			if(System::file().doesExist(finishFilename)){
+				_progress->inc(1);
+				cout << "\t" << datasetId << " already merged (remove file " << finishFilename << " to merge again)" << endl;
+				continue;
+			}
+
+			pool.submit([this, i](){
+				runMergeJob(i);
+				_progress->inc(1);
+			});
 	    }
 
-	    _progress->finish();
-	    delete _progress;
+	    while(!pool.join(SIMKA_CONTROLLER_PERIOD_SEC)){
+	    	pool.setMaxActive(_mergeController->update(pool.nbActive()));
+	    }
+	    checkJobErrors(pool);
+	}
+
+	/** Body of a simkaMerge process, run on a thread of simka. */
+	void runMergeJob(size_t i){
+
+		try{
+			IProperties* props = this->_options->clone();
+			LOCAL(props);
+			props->setInt(STR_VERBOSE, 0);
+			props->setInt(STR_MAX_MEMORY, this->_maxMemory / this->_nbCores);
+			props->setInt(STR_NB_CORES, _coresPerMergeJob);
+
+			SimkaMergeParameter p(props, this->_inputFilename, this->_outputDirTemp, i, this->_kmerSize, this->_minKmerShannonIndex,
+					this->_computeSimpleDistances, this->_computeComplexDistances, _coresPerMergeJob, this->_output_m, this->_outputDir, this->_pipe, this->_json_path, this->_keepTmpFiles, !this->_keepTmpFiles);
+
+			SimkaMergeAlgorithm<span>(p).execute();
+		}
+		catch (Exception& e){
+			addJobError("merge " + SimkaAlgorithm<>::toString(i) + ": " + e.getMessage());
+		}
+		catch (std::exception& e){
+			addJobError("merge " + SimkaAlgorithm<>::toString(i) + ": " + e.what());
+		}
+	}
+
+	void addJobError(const string& message){
+		std::unique_lock<std::mutex> lock(_jobErrorsMutex);
+		_jobErrors.push_back(message);
+	}
+
+	//The errors that escaped the tasks of the pool, then the errors of the jobs
+	void checkJobErrors(SimkaWorkStealingPool& pool){
+		vector<string> errors = pool.getErrors();
+		for(size_t i=0; i<errors.size(); i++) addJobError("task: " + errors[i]);
+		checkJobErrors();
+	}
+
+	void checkJobErrors(){
+
+		if(_jobErrors.empty()) return;
+
+		for(size_t i=0; i<_jobErrors.size(); i++){
+			cerr << "ERROR: job failed (" << _jobErrors[i] << ")" << endl;
+		}
+		exit(1);
 	}
 
 	void merge(){
@@ -720,9 +1906,16 @@ public:
 			System::thread().newSynchronizer());
 		_progress->init ();
 
-		vector<string> filenameQueue;
-		vector<string> filenameQueueToRemove;
-		size_t nbJobs = 0;
+		if(_isInProcess){
+			mergeInProcess();
+			_progress->finish();
+			delete _progress;
+			return;
+		}
+
+		SimkaJobMonitor monitor(this->_outputDirTemp + "/merge_synchro/");
+		vector<string> arrayNames;
+		vector<string> arrayCommands;
 
 	    for (size_t i=0; i<_nbPartitions; i++){
 
@@ -738,8 +1931,6 @@ public:
 				cout << "\t" << datasetId << " already merged (remove file " << finishFilename << " to merge again)" << endl;
 			}
 			else{
-				filenameQueue.push_back(datasetId);
-
 				string command = "nohup " + _execDir + "/simkaMerge ";
 				command += " " + string(STR_KMER_SIZE) + " " + SimkaAlgorithm<>::toString(this->_kmerSize);
 				command += " " + string(STR_URI_INPUT) + " " + this->_inputFilename;
@@ -752,7 +1943,10 @@ public:
                 command += " -dir-matrix " + this->_outputDir;
                 command += " -matrix " + this->_output_m;
                 command += " -groups " + this->_json_path;
+                command += " " + STR_SIMKA_CODEC + " " + _codecs.toString();
                 if(this->_pipe) command += " -pipe true";
+                if(this->_keepTmpFiles) command += " -keep-merged";
+                else command += " -remove-inputs";
 				if(this->_computeSimpleDistances) command += " " + string(STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES);
 				if(this->_computeComplexDistances) command += " " + string(STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES);
 				command += " >> " + logFilename + " 2>&1";
@@ -762,84 +1956,33 @@ public:
 				system(("echo \"" + str + "\" > " + logFilename).c_str());
 
 
-				if(_isClusterMode){
+				if(_isArrayMode){
+					arrayNames.push_back(datasetId);
+					arrayCommands.push_back(command);
+				}
+				else if(_isClusterMode){
 					string jobFilename = this->_outputDirTemp + "/job_merge/job_merge_" + SimkaAlgorithm<>::toString(i) + ".bash";
-					IFile* jobFile = System::file().newFile(jobFilename.c_str(), "w");
-					system(("chmod 755 " + jobFilename).c_str());
-					string jobCommand = _jobMergeContents + '\n' + '\n';
-					jobCommand += command;
-
-
-					jobFile->fwrite(jobCommand.c_str(), jobCommand.size(), 1);
-					jobFile->flush();
-					string submitCommand = _jobMergeCommand + " " + jobFile->getPath();
-					delete jobFile;
-					system(submitCommand.c_str());
+					submitJob(monitor, datasetId, command, jobFilename, _jobMergeContents, _jobMergeCommand);
 				}
 				else{
-					command += " &";
-					system(command.c_str());
+					monitor.launchLocal(datasetId, command);
 				}
-
-				nbJobs += 1;
 			}
 
-			if(nbJobs >= _maxJobMerge){
-				while(true){
-					bool isJobAvailbale = false;
-
-					for(size_t j=0; j<filenameQueue.size(); j++){
-
-						string finishFilename2 = this->_outputDirTemp + "/merge_synchro/" + filenameQueue[j] + ".ok";
-						if(System::file().doesExist(finishFilename2)){
-							filenameQueueToRemove.push_back(filenameQueue[j]);
-							isJobAvailbale = true;
-							nbJobs -= 1;
-							_progress->inc(1);
-						}
-					}
-
-					if(isJobAvailbale){
-						for(size_t j=0; j<filenameQueueToRemove.size(); j++){
-							filenameQueue.erase(std::remove(filenameQueue.begin(), filenameQueue.end(), filenameQueueToRemove[j]), filenameQueue.end());
-						}
-						filenameQueueToRemove.clear();
-						break;
-					}
-					else{
-						sleep(1);
-					}
-
-					if(i >= this->_bankNames.size()) break;
-				}
+			while(monitor.nbRunning() >= _mergeController->getLimit()){
+				size_t nbRunning = monitor.nbRunning();
+				waitJobs(monitor, "merge");
+				_mergeController->update(nbRunning);
 			}
 	    }
 
-	    while(nbJobs > 0){
-			bool isJobAvailbale = false;
-
-			for(size_t j=0; j<filenameQueue.size(); j++){
-
-				string finishFilename2 = this->_outputDirTemp + "/merge_synchro/" + filenameQueue[j] + ".ok";
-				if(System::file().doesExist(finishFilename2)){
-					filenameQueueToRemove.push_back(filenameQueue[j]);
-					isJobAvailbale = true;
-					nbJobs -= 1;
-					_progress->inc(1);
-				}
-			}
+	    if(!arrayNames.empty()){
+	    	submitArrayJob(monitor, arrayNames, arrayCommands, "job_merge", "merge", _jobMergeContents, _jobMergeCommand, _mergeController->getLimit());
+	    }
 
-			if(isJobAvailbale){
-				for(size_t j=0; j<filenameQueueToRemove.size(); j++){
-					filenameQueue.erase(std::remove(filenameQueue.begin(), filenameQueue.end(), filenameQueueToRemove[j]), filenameQueue.end());
-				}
-				filenameQueueToRemove.clear();
-				//break;
-			}
-			else{
-				sleep(1);
-			}
-		}
+	    while(monitor.nbRunning() > 0){
+	    	waitJobs(monitor, "merge");
+	    }
 
 	    _progress->finish();
 	    delete _progress;
@@ -875,6 +2018,42 @@ public:
 
     string _execDir;
     bool _isClusterMode;
+    bool _isArrayMode;
+    string _arrayIndex;
+    size_t _nbArrayJobs;
+    bool _isInProcess;
+    Configuration _config;
+    Repartitor* _repartitor;
+    SimkaConcurrencyController* _countController;
+    SimkaConcurrencyController* _mergeController;
+    SimkaCountCache<span>* _countCache;
+    SimkaDiskBudget* _diskBudget;
+    SimkaCodecConfig _codecs;
+    bool _singletonFilter;
+    vector<u_int64_t> _datasetDiskBytes;
+    map<size_t, vector<size_t> > _preMergeGroups;
+    vector<string> _jobErrors;
+    std::mutex _jobErrorsMutex;
+    map<string, size_t> _bankIndexes;
+    vector<size_t> _preMergeCandidates;
+    size_t _nbRunningPreMerges;
+    std::mutex _preMergeMutex;
+    vector<u_int64_t> _datasetSizes;
+    vector<string> _countTempDirs;
+    vector<size_t> _countStripes;
+    vector<DatasetEstimate> _datasetEstimates;
+    vector<size_t> _countOrder;
+    vector<size_t> _countRank;
+    map<size_t, vector<size_t> > _jointGroups;
+    set<size_t> _countNotStarted;
+    map<size_t, pair<size_t, size_t> > _countResources;
+    size_t _countCoresInUse;
+    size_t _countMemoryInUse;
+    u_int64_t _countSizeInUse;
+    std::mutex _countResourcesMutex;
+    std::condition_variable _countResourcesReleased;
+    size_t _nodeCores;
+    size_t _nodeMemory;
 	size_t _maxJobCount;
 	size_t _maxJobMerge;
 	string _jobCountFilename;
@@ -0,0 +1,142 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <gatb/gatb_core.hpp>
+#include <SimkaCommons.hpp>
+#include <chrono>
+
+/*********************************************************************
+* Read throughput of the input of simka-count, for one dataset:
+*
+*   copy: the reads copied by SimkaInputIterator and filtered with a
+*         vector allocated per read, as before the read views
+*   view: the same iterator on views of the reads, filtered with
+*         SimkaSequenceFilter
+*   read-ahead: the reads of SimkaPotaraBankFiltered, read ahead on their
+*         own threads and filtered on views, as counted by simka-count
+*
+* copy and view run on the calling thread only, so that they compare the
+* copies and filters alone.
+*
+* The input is a GATB album (one file per line, as in <tmp>/input/) or a
+* read file. Put the files in the page cache first (cat them to
+* /dev/null) so that both runs read them at the same speed.
+*********************************************************************/
+
+struct BenchCopyFilter
+{
+	BenchCopyFilter(size_t minReadSize, double minShannonIndex) : _minReadSize(minReadSize), _minShannonIndex(minShannonIndex) {}
+
+	bool operator() (Sequence& seq){
+		if(_minReadSize != 0 && seq.getDataSize() < _minReadSize) return false;
+		if(_minShannonIndex != 0 && getShannonIndex(seq) < _minShannonIndex) return false;
+		return true;
+	}
+
+	float getShannonIndex(Sequence& seq){
+
+		vector<float> freqs(5, 0);
+		char* seqStr = seq.getDataBuffer();
+
+		for(size_t i=0; i < seq.getDataSize(); i++){
+			switch(seqStr[i]){
+				case 'C': freqs[1] += 1.0; break;
+				case 'T': freqs[2] += 1.0; break;
+				case 'G': freqs[3] += 1.0; break;
+				case 'N': freqs[4] += 1.0; break;
+				default: freqs[0] += 1.0; break;
+			}
+		}
+
+		float index = 0;
+		for (size_t i=0; i<freqs.size(); i++){
+			freqs[i] /= (float) seq.getDataSize();
+			if (freqs[i] != 0)
+				index += freqs[i] * log (freqs[i]) / log(2);
+		}
+		return abs(index);
+	}
+
+	size_t _minReadSize;
+	double _minShannonIndex;
+};
+
+static void runBench(const string& name, Iterator<Sequence>* it){
+
+	LOCAL(it);
+
+	u_int64_t nbReads = 0;
+	u_int64_t nbNucleotides = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(it->first(); !it->isDone(); it->next()){
+		nbReads += 1;
+		nbNucleotides += it->item().getDataSize();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	cout << name << ": " << nbReads << " reads, " << nbNucleotides << " nt, " << seconds << " s, "
+		 << nbReads / seconds / 1e6 << " Mreads/s, " << nbNucleotides / seconds / 1e6 << " Mnt/s" << endl;
+}
+
+int main (int argc, char* argv[])
+{
+	if(argc < 2){
+		cerr << "usage: " << argv[0] << " <album or read file> [nb paired parts=1] [min-read-size=0] [min-shannon-index=0] [max-reads=0] [nb-cores=4]" << endl;
+		return EXIT_FAILURE;
+	}
+
+	string inputFilename = argv[1];
+	size_t nbDatasets = argc > 2 ? atoi(argv[2]) : 1;
+	size_t minReadSize = argc > 3 ? atoi(argv[3]) : 0;
+	double minShannonIndex = argc > 4 ? atof(argv[4]) : 0;
+	u_int64_t maxReads = argc > 5 ? strtoull(argv[5], NULL, 10) : 0;
+	size_t nbCores = argc > 6 ? atoi(argv[6]) : 4;
+
+    try
+    {
+		{
+			IBank* bank = Bank::open(inputFilename);
+			LOCAL(bank);
+			runBench("copy", new SimkaInputIterator<Sequence, BenchCopyFilter>(bank->iterator(), nbDatasets, maxReads, BenchCopyFilter(minReadSize, minShannonIndex)));
+		}
+
+		{
+			IBank* bank = Bank::open(inputFilename);
+			LOCAL(bank);
+			Iterator<Sequence>* it = bank->iterator();
+			LOCAL(it);
+			runBench("view", new SimkaInputIterator<Sequence, SimkaSequenceFilter>(it->getComposition(), nbDatasets, maxReads, SimkaSequenceFilter(minReadSize, minShannonIndex), true));
+		}
+
+		{
+			IBank* bank = Bank::open(inputFilename);
+			SimkaSequenceFilter sequenceFilter(minReadSize, minShannonIndex);
+			IBank* filteredBank = new SimkaPotaraBankFiltered<SimkaSequenceFilter>(bank, sequenceFilter, maxReads, nbDatasets, inputFilename, nbCores);
+			LOCAL(filteredBank);
+			runBench("read-ahead", filteredBank->iterator());
+		}
+    }
+    catch (Exception& e)
+    {
+        std::cout << "EXCEPTION: " << e.getMessage() << std::endl;
+        return EXIT_FAILURE;
+    }
+}
@@ -29,7 +29,7 @@ IOptionsParser* Simka::createOptionsParser (IOptionsParser* parent)
 	//Main parser
     parser->push_front (new OptionNoParam (STR_SIMKA_COMPUTE_DATA_INFO, "compute (and display) information before running Simka, such as the number of reads per dataset", false));
     parser->push_front (new OptionNoParam (STR_SIMKA_KEEP_TMP_FILES, "keep temporary files", false));
-    parser->push_front (new OptionOneParam (STR_URI_OUTPUT_TMP, "output directory for temporary files", true));
+    parser->push_front (new OptionOneParam (STR_URI_OUTPUT_TMP, "output directory for temporary files (several dirs separated by commas: k-mer count partitions are striped over them)", true));
     parser->push_front (new OptionOneParam (STR_URI_OUTPUT, "output directory for result files (distance matrices)", false, "./simka_results"));
     parser->push_front (new OptionOneParam (STR_URI_INPUT, "input file of samples. One sample per line: id1: filename1...", true));
 
@@ -54,6 +54,7 @@ IOptionsParser* Simka::createOptionsParser (IOptionsParser* parent)
     //kmerParser->getParser (STR_SOLIDITY_KIND)->setHelp("TODO");
     //kmerParser->push_back (new OptionNoParam (STR_SIMKA_SOLIDITY_PER_DATASET.c_str(), "do not take into consideration multi-counting when determining solid kmers", false ));
     kmerParser->push_back (new OptionOneParam (STR_SIMKA_MIN_KMER_SHANNON_INDEX.c_str(), "minimal Shannon index a kmer should have to be kept. Float in [0,2]", false, "0" ));
+    kmerParser->push_back (new OptionNoParam (STR_SIMKA_SINGLETON_FILTER.c_str(), "drop the first occurrence of each kmer with a Bloom filter while counting (k > 15 and abundance-min >= 2). Counts may be overestimated by 1 with a small probability", false));
 
 
     //Read filter parser
@@ -70,6 +70,18 @@ void SimkaAlgorithm<span>::parseArgs() {
 	_inputFilename = _options->getStr(STR_URI_INPUT);
 	_outputDir = _options->get(STR_URI_OUTPUT) ? _options->getStr(STR_URI_OUTPUT) : "./";
 	_outputDirTemp = _options->get(STR_URI_OUTPUT_TMP) ? _options->getStr(STR_URI_OUTPUT_TMP) : "./";
+
+	//-out-tmp dir1,dir2,...: the first dir holds the temporary files, count files are striped over all of them
+	_outputDirTempStripes.clear();
+	{
+		stringstream dirStream(_outputDirTemp);
+		string dir;
+		while(getline(dirStream, dir, ',')){
+			if(dir != "") _outputDirTempStripes.push_back(dir);
+		}
+		if(_outputDirTempStripes.empty()) _outputDirTempStripes.push_back("./");
+		_outputDirTemp = _outputDirTempStripes[0];
+	}
 	_kmerSize = _options->getInt(STR_KMER_SIZE);
 	_abundanceThreshold.first = _options->getInt(STR_KMER_ABUNDANCE_MIN);
 	_abundanceThreshold.second = min((u_int64_t)_options->getInt(STR_KMER_ABUNDANCE_MAX), (u_int64_t)(999999999));
@@ -109,19 +121,27 @@ bool SimkaAlgorithm<span>::createDirs(){
 		}
 	}
 
-	_outputDirTemp = _outputDirTemp;
+	if(_outputDirTempStripes.empty()) _outputDirTempStripes.push_back(_outputDirTemp);
 
-	if(!System::file().doesExist(_outputDirTemp)){
-		int ok = System::file().mkdir(_outputDirTemp, -1);
-		if(ok != 0){
-	        std::cout << "Error: can't create output temp directory (" << _outputDirTemp << ")" << std::endl;
-	        return false;
+	for(size_t i=0; i<_outputDirTempStripes.size(); i++){
+
+		string dir = _outputDirTempStripes[i];
+
+		if(!System::file().doesExist(dir)){
+			int ok = System::file().mkdir(dir, -1);
+			if(ok != 0){
+		        std::cout << "Error: can't create output temp directory (" << dir << ")" << std::endl;
+		        return false;
+			}
 		}
+
+		dir = System::file().getRealPath(dir);
+		dir += "/simka_output_temp/";
+		System::file().mkdir(dir, -1);
+		_outputDirTempStripes[i] = dir;
 	}
 
-	_outputDirTemp = System::file().getRealPath(_outputDirTemp);
-	_outputDirTemp += "/simka_output_temp/";
-	System::file().mkdir(_outputDirTemp, -1);
+	_outputDirTemp = _outputDirTempStripes[0];
 
 	_options->setStr(STR_URI_OUTPUT_TMP, _outputDirTemp);
 	System::file().mkdir(_outputDirTemp + "/input/", -1);
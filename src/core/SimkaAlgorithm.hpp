@@ -229,6 +229,7 @@ protected:
 	size_t _nbCores;
 	string _outputDir;
 	string _outputDirTemp;
+	vector<string> _outputDirTempStripes;
 	size_t _nbBanks;
 	string _inputFilename;
 	size_t _kmerSize;
@@ -0,0 +1,515 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKACODEC_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKACODEC_HPP_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "SimkaError.hpp"
+
+#define SIMKA_CODEC_MAGIC "SKC1"
+//Uncompressed size of the blocks of a SimkaCodecWriter
+#define SIMKA_CODEC_BLOCK_SIZE (256*1024)
+
+
+enum SimkaCodecType{
+	SIMKA_CODEC_NONE = 0,
+	SIMKA_CODEC_ZLIB_FAST = 1,
+	SIMKA_CODEC_ZLIB = 2
+};
+
+/** Files written by simka, each with its own codec (-codec). */
+enum SimkaCodecStage{
+	SIMKA_STAGE_COUNT = 0,		//partition files written by the count jobs
+	SIMKA_STAGE_CASCADE = 1,	//partition files written by the pre-merges and intermediate merges
+	SIMKA_STAGE_MATRIX = 2,		//k-mer matrix of the merge (-dir-matrix)
+	SIMKA_STAGE_STATS = 3,		//statistics of each partition
+	SIMKA_NB_STAGES = 4
+};
+
+
+/*********************************************************************
+* ** SimkaCodec
+*
+* Block compression of the files written by simka: none, zlib at level 1
+* (fast) or zlib at its default level (default). Files record their codec,
+* so readers do not need to know how a file was written.
+*********************************************************************/
+class SimkaCodec
+{
+
+public:
+
+	static bool parse(const std::string& name, SimkaCodecType& codec){
+		if(name == "none") codec = SIMKA_CODEC_NONE;
+		else if(name == "fast") codec = SIMKA_CODEC_ZLIB_FAST;
+		else if(name == "default") codec = SIMKA_CODEC_ZLIB;
+		else return false;
+		return true;
+	}
+
+	static std::string toString(SimkaCodecType codec){
+		if(codec == SIMKA_CODEC_NONE) return "none";
+		if(codec == SIMKA_CODEC_ZLIB_FAST) return "fast";
+		return "default";
+	}
+
+	static bool isValid(int codec){
+		return codec == SIMKA_CODEC_NONE || codec == SIMKA_CODEC_ZLIB_FAST || codec == SIMKA_CODEC_ZLIB;
+	}
+
+	static int getZlibLevel(SimkaCodecType codec){
+		if(codec == SIMKA_CODEC_ZLIB_FAST) return 1;
+		return Z_DEFAULT_COMPRESSION;
+	}
+
+	/** Compress size bytes of src into dst (the raw bytes for SIMKA_CODEC_NONE). */
+	static void compress(SimkaCodecType codec, const u_int8_t* src, size_t size, std::vector<u_int8_t>& dst){
+
+		if(codec == SIMKA_CODEC_NONE){
+			dst.assign(src, src + size);
+			return;
+		}
+
+		uLongf storedSize = compressBound(size);
+		dst.resize(storedSize);
+		if(compress2(&dst[0], &storedSize, src, size, getZlibLevel(codec)) != Z_OK){
+			SimkaError::raise("zlib compression failed");
+		}
+		dst.resize(storedSize);
+	}
+
+	/** \return false if src does not decompress to exactly rawSize bytes */
+	static bool uncompress(SimkaCodecType codec, const u_int8_t* src, size_t size, u_int8_t* dst, size_t rawSize){
+
+		if(codec == SIMKA_CODEC_NONE){
+			if(size != rawSize) return false;
+			memcpy(dst, src, size);
+			return true;
+		}
+
+		uLongf outSize = rawSize;
+		if(::uncompress(dst, &outSize, src, size) != Z_OK) return false;
+		return outSize == rawSize;
+	}
+};
+
+
+/*********************************************************************
+* ** SimkaCodecConfig
+*
+* Codec of each stage, from the -codec option: a codec name for every
+* stage ("none"), or a comma separated list of <stage>=<codec> with stage
+* in count, cascade, matrix, stats ("count=none,cascade=none").
+* Unlisted stages keep their default: fast for the partition files,
+* default for the matrix and the statistics.
+*********************************************************************/
+class SimkaCodecConfig
+{
+
+public:
+
+	SimkaCodecConfig(){
+		_codecs[SIMKA_STAGE_COUNT] = SIMKA_CODEC_ZLIB_FAST;
+		_codecs[SIMKA_STAGE_CASCADE] = SIMKA_CODEC_ZLIB_FAST;
+		_codecs[SIMKA_STAGE_MATRIX] = SIMKA_CODEC_ZLIB;
+		_codecs[SIMKA_STAGE_STATS] = SIMKA_CODEC_ZLIB;
+	}
+
+	/** Exits with an error message if the spec is invalid. */
+	SimkaCodecConfig(const std::string& spec){
+
+		*this = SimkaCodecConfig();
+
+		if(!parse(spec)){
+			std::cerr << "ERROR: invalid -codec value \"" << spec << "\" (expected <codec> or <stage>=<codec>,... with codec in none, fast, default and stage in count, cascade, matrix, stats)" << std::endl;
+			exit(1);
+		}
+	}
+
+	SimkaCodecType get(SimkaCodecStage stage) const { return _codecs[stage]; }
+
+	/** Spec that gives back the same configuration, for the command line of the jobs. */
+	std::string toString() const {
+		std::string spec;
+		for(size_t i=0; i<SIMKA_NB_STAGES; i++){
+			if(i > 0) spec += ",";
+			spec += std::string(getStageName(i)) + "=" + SimkaCodec::toString(_codecs[i]);
+		}
+		return spec;
+	}
+
+private:
+
+	static const char* getStageName(size_t stage){
+		static const char* names[SIMKA_NB_STAGES] = {"count", "cascade", "matrix", "stats"};
+		return names[stage];
+	}
+
+	bool parse(const std::string& spec){
+
+		if(spec.empty()) return true;
+
+		SimkaCodecType codec;
+		if(SimkaCodec::parse(spec, codec)){
+			for(size_t i=0; i<SIMKA_NB_STAGES; i++) _codecs[i] = codec;
+			return true;
+		}
+
+		std::stringstream stream(spec);
+		std::string item;
+		while(getline(stream, item, ',')){
+
+			std::string::size_type pos = item.find('=');
+			if(pos == std::string::npos) return false;
+			if(!SimkaCodec::parse(item.substr(pos+1), codec)) return false;
+
+			std::string stageName = item.substr(0, pos);
+			size_t stage = 0;
+			while(stage < SIMKA_NB_STAGES && stageName != getStageName(stage)) stage += 1;
+			if(stage == SIMKA_NB_STAGES) return false;
+
+			_codecs[stage] = codec;
+		}
+
+		return true;
+	}
+
+	SimkaCodecType _codecs[SIMKA_NB_STAGES];
+};
+
+
+/*********************************************************************
+* ** SimkaMappedFile
+*
+* Read-only memory mapping of a whole file, or of a byte range of a file
+* (a partition inside a pack file).
+*********************************************************************/
+class SimkaMappedFile
+{
+
+public:
+
+	SimkaMappedFile(const std::string& filename){
+		map(filename, 0, (u_int64_t) -1);
+	}
+
+	/** \param[in] offset : first byte of the range
+	 * \param[in] length : number of bytes of the range */
+	SimkaMappedFile(const std::string& filename, u_int64_t offset, u_int64_t length){
+		map(filename, offset, length);
+	}
+
+	~SimkaMappedFile(){
+		if(_mapping) munmap(_mapping, _mappingSize);
+	}
+
+	const u_int8_t* data() const { return _data; }
+	size_t size() const { return _size; }
+
+private:
+
+	void map(const std::string& filename, u_int64_t offset, u_int64_t length){
+
+		_mapping = 0;
+		_mappingSize = 0;
+		_data = 0;
+		_size = 0;
+
+		int fd = open(filename.c_str(), O_RDONLY);
+		if(fd < 0){
+			SimkaError::raise(std::string("can't open ") + filename);
+		}
+
+		struct stat st;
+		if(fstat(fd, &st) != 0){
+			SimkaError::raise(std::string("can't read ") + filename);
+		}
+
+		u_int64_t fileSize = st.st_size;
+		if(length == (u_int64_t) -1) length = fileSize - offset;
+		if(offset > fileSize || length > fileSize - offset){
+			SimkaError::raise(std::string("range out of file ") + filename);
+		}
+		_size = length;
+
+		if(_size > 0){
+			//mmap offsets must be page aligned
+			u_int64_t pageSize = sysconf(_SC_PAGESIZE);
+			u_int64_t start = offset - offset % pageSize;
+			_mappingSize = _size + (offset - start);
+
+			void* data = mmap(NULL, _mappingSize, PROT_READ, MAP_PRIVATE, fd, start);
+			if(data == MAP_FAILED){
+				SimkaError::raise(std::string("can't map ") + filename);
+			}
+			madvise(data, _mappingSize, MADV_SEQUENTIAL);
+			_mapping = data;
+			_data = (const u_int8_t*) data + (offset - start);
+		}
+
+		close(fd);
+	}
+
+	void* _mapping;
+	size_t _mappingSize;
+	const u_int8_t* _data;
+	size_t _size;
+};
+
+
+/*********************************************************************
+* ** SimkaCodecWriter
+*
+* Stream of fixed size values compressed by blocks. Format: magic, codec,
+* then blocks of raw size and stored size (4 bytes each) followed by the
+* stored bytes, and an empty block at the end.
+*********************************************************************/
+class SimkaCodecWriter
+{
+
+public:
+
+	SimkaCodecWriter(const std::string& filename, SimkaCodecType codec){
+
+		_filename = filename;
+		_codec = codec;
+
+		_file = fopen(filename.c_str(), "wb");
+		if(_file == NULL){
+			SimkaError::raise(std::string("can't create ") + filename);
+		}
+
+		fwrite(SIMKA_CODEC_MAGIC, 1, 4, _file);
+		u_int8_t codecId = codec;
+		fwrite(&codecId, 1, 1, _file);
+	}
+
+	/** Errors are thrown by an explicit flush only: the destructor also runs while an error unwinds. */
+	~SimkaCodecWriter(){
+		SimkaError().run([this](){ flush(); });
+	}
+
+	template<typename T> void write(const T& value){
+		const u_int8_t* bytes = (const u_int8_t*) &value;
+		_buffer.insert(_buffer.end(), bytes, bytes + sizeof(T));
+		if(_buffer.size() >= SIMKA_CODEC_BLOCK_SIZE) writeBlock();
+	}
+
+	/** Write the last block and close the file. */
+	void flush(){
+
+		if(_file == NULL) return;
+
+		writeBlock();
+		writeU32(0);
+		writeU32(0);
+
+		bool isOk = !ferror(_file);
+		if(fclose(_file) != 0) isOk = false;
+		_file = NULL;
+
+		if(!isOk){
+			SimkaError::raise(std::string("can't write ") + _filename);
+		}
+	}
+
+private:
+
+	void writeBlock(){
+		if(_buffer.empty()) return;
+		SimkaCodec::compress(_codec, &_buffer[0], _buffer.size(), _stored);
+		writeU32(_buffer.size());
+		writeU32(_stored.size());
+		fwrite(&_stored[0], 1, _stored.size(), _file);
+		_buffer.clear();
+	}
+
+	void writeU32(u_int32_t value){
+		u_int8_t bytes[4];
+		for(size_t i=0; i<4; i++) bytes[i] = (u_int8_t)(value >> (8*i));
+		fwrite(bytes, 1, 4, _file);
+	}
+
+	std::string _filename;
+	FILE* _file;
+	SimkaCodecType _codec;
+	std::vector<u_int8_t> _buffer;
+	std::vector<u_int8_t> _stored;
+};
+
+
+/*********************************************************************
+* ** SimkaCodecReader
+*
+* Reader of a SimkaCodecWriter file. Values must be read with the types
+* they were written with.
+*********************************************************************/
+class SimkaCodecReader
+{
+
+public:
+
+	SimkaCodecReader(const std::string& filename) : _file(filename){
+
+		_filename = filename;
+		_offset = 5;
+		_pos = 0;
+
+		if(_file.size() < 5 || memcmp(_file.data(), SIMKA_CODEC_MAGIC, 4) != 0 || !SimkaCodec::isValid(_file.data()[4])) error("invalid");
+		_codec = (SimkaCodecType) _file.data()[4];
+	}
+
+	template<typename T> T read(){
+		T value;
+		u_int8_t* bytes = (u_int8_t*) &value;
+		for(size_t i=0; i<sizeof(T); i++){
+			if(_pos == _buffer.size()) loadBlock();
+			bytes[i] = _buffer[_pos++];
+		}
+		return value;
+	}
+
+private:
+
+	void error(const std::string& message){
+		SimkaError::raise(message + " file " + _filename);
+	}
+
+	u_int32_t readU32(){
+		if(_offset + 4 > _file.size()) error("truncated");
+		u_int32_t value = 0;
+		for(size_t i=0; i<4; i++) value |= (u_int32_t)_file.data()[_offset+i] << (8*i);
+		_offset += 4;
+		return value;
+	}
+
+	void loadBlock(){
+
+		u_int32_t rawSize = readU32();
+		u_int32_t storedSize = readU32();
+		if(rawSize == 0) error("unexpected end of");
+		if(_offset + storedSize > _file.size()) error("truncated");
+
+		_buffer.resize(rawSize);
+		if(!SimkaCodec::uncompress(_codec, _file.data() + _offset, storedSize, &_buffer[0], rawSize)) error("corrupted");
+
+		_offset += storedSize;
+		_pos = 0;
+	}
+
+	std::string _filename;
+	SimkaMappedFile _file;
+	SimkaCodecType _codec;
+	size_t _offset;
+	std::vector<u_int8_t> _buffer;
+	size_t _pos;
+};
+
+
+/*********************************************************************
+* ** SimkaCodecTextFile
+*
+* Text output: a plain file for SIMKA_CODEC_NONE, a gzip file at the
+* level of the codec otherwise.
+*********************************************************************/
+class SimkaCodecTextFile
+{
+
+public:
+
+	SimkaCodecTextFile(){
+		_file = NULL;
+		_gzFile = NULL;
+	}
+
+	~SimkaCodecTextFile(){
+		SimkaError().run([this](){ close(); });
+	}
+
+	/** Extension of the files written with a codec. */
+	static std::string getExtension(SimkaCodecType codec){
+		return codec == SIMKA_CODEC_NONE ? ".txt" : ".gz";
+	}
+
+	void open(const std::string& filename, SimkaCodecType codec){
+
+		_filename = filename;
+
+		if(codec == SIMKA_CODEC_NONE){
+			_file = fopen(filename.c_str(), "wb");
+		}
+		else{
+			std::string mode = codec == SIMKA_CODEC_ZLIB_FAST ? "wb1" : "wb";
+			_gzFile = gzopen(filename.c_str(), mode.c_str());
+			if(_gzFile != NULL) gzbuffer(_gzFile, SIMKA_CODEC_BLOCK_SIZE);
+		}
+
+		if(_file == NULL && _gzFile == NULL){
+			SimkaError::raise(std::string("can't create ") + filename);
+		}
+	}
+
+	SimkaCodecTextFile& operator<<(const std::string& text){
+		if(text.empty()) return *this;
+		if(_file) fwrite(text.c_str(), 1, text.size(), _file);
+		else if(_gzFile) gzwrite(_gzFile, text.c_str(), text.size());
+		return *this;
+	}
+
+	void close(){
+
+		bool isOk = true;
+
+		if(_file){
+			isOk = !ferror(_file) && fclose(_file) == 0;
+			_file = NULL;
+		}
+		if(_gzFile){
+			isOk = gzclose(_gzFile) == Z_OK;
+			_gzFile = NULL;
+		}
+
+		if(!isOk){
+			SimkaError::raise(std::string("can't write ") + _filename);
+		}
+	}
+
+private:
+
+	std::string _filename;
+	FILE* _file;
+	gzFile _gzFile;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKACODEC_HPP_ */
@@ -9,6 +9,9 @@
 #define SIMKA1_4_SRC_CORE_SIMKACOMMONS_HPP_
 
 #include <thread>
+#include "SimkaReadAhead.hpp"
+#include "SimkaComplexity.hpp"
+#include "SimkaCodec.hpp"
 
 const string STR_SIMKA_SOLIDITY_PER_DATASET = "-solidity-single";
 const string STR_SIMKA_MAX_READS = "-max-reads";
@@ -20,6 +23,8 @@ const string STR_SIMKA_COMPUTE_ALL_SIMPLE_DISTANCES= "-simple-dist";
 const string STR_SIMKA_COMPUTE_ALL_COMPLEX_DISTANCES = "-complex-dist";
 const string STR_SIMKA_KEEP_TMP_FILES = "-keep-tmp";
 const string STR_SIMKA_COMPUTE_DATA_INFO = "-data-info";
+const string STR_SIMKA_CODEC = "-codec";
+const string STR_SIMKA_SINGLETON_FILTER = "-singleton-filter";
 
 
 
@@ -28,6 +33,78 @@ public:
 	SimkaCommons();
 	virtual ~SimkaCommons();
 
+	/** Directory of the k-mer count files of a partition. With several temp dirs (-out-tmp dir1,dir2),
+	 * it is a link to the temp dir the partition is striped on, so it is the same path for every job. */
+	static string getPartitionDir(const string& outputDirTemp, size_t partitionId){
+		return outputDirTemp + "/solid/part_" + Stringify::format("%i", partitionId) + "/";
+	}
+
+	/** Count file of a dataset (or of a merge of datasets) in a partition, named after the codec it
+	 * is written with, as the text files (__p__<id>.txt or __p__<id>.gz). */
+	static string getPartitionFilename(const string& outputDirTemp, size_t partitionId, size_t datasetId, SimkaCodecType codec){
+		return getPartitionDir(outputDirTemp, partitionId) + "__p__" + Stringify::format("%i", datasetId) + SimkaCodecTextFile::getExtension(codec);
+	}
+
+	/** Existing count file of a dataset in a partition, whatever its codec, or "" if there is none. */
+	static string findPartitionFilename(const string& outputDirTemp, size_t partitionId, size_t datasetId){
+		string filename = getPartitionFilename(outputDirTemp, partitionId, datasetId, SIMKA_CODEC_ZLIB);
+		if(System::file().doesExist(filename)) return filename;
+		filename = getPartitionFilename(outputDirTemp, partitionId, datasetId, SIMKA_CODEC_NONE);
+		if(System::file().doesExist(filename)) return filename;
+		return "";
+	}
+
+	/** Whether a file of a partition dir is a complete count file, and not the .temp file of an
+	 * interrupted merge or the stream of a kept merge being swapped. */
+	static bool isPartitionFilename(const string& filename){
+		if(filename.compare(0, 5, "__p__") != 0) return false;
+		return hasSuffix(filename, SimkaCodecTextFile::getExtension(SIMKA_CODEC_ZLIB)) || hasSuffix(filename, SimkaCodecTextFile::getExtension(SIMKA_CODEC_NONE));
+	}
+
+	static bool hasSuffix(const string& s, const string& suffix){
+		return s.size() >= suffix.size() && s.compare(s.size()-suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	/** Directory of the pack files of the count jobs whose temp files are on a temp dir stripe.
+	 * Stripes other than the first one are links to <stripe>/solid/packs. */
+	static string getPackDir(const string& outputDirTemp, size_t stripe){
+		return outputDirTemp + "/solid/packs/" + Stringify::format("%i", stripe) + "/";
+	}
+
+	/** Pack file of a dataset: its count files of every partition in a single file. */
+	static string getPackFilename(const string& outputDirTemp, size_t stripe, size_t datasetId){
+		return getPackDir(outputDirTemp, stripe) + "__p__" + Stringify::format("%i", datasetId) + ".pack";
+	}
+
+	/** Value ranges of the partitions of the small k-mers (see SimkaDenseRanges). */
+	static string getDenseRangesFilename(const string& outputDirTemp){
+		return outputDirTemp + "/dense_ranges";
+	}
+
+	/** Pack files of every stripe, by dataset id. The unfinished ones (.pack.temp) are skipped. */
+	static map<size_t, string> listPackFilenames(const string& outputDirTemp){
+
+		map<size_t, string> packFilenames;
+
+		string packsDir = outputDirTemp + "/solid/packs/";
+		vector<string> stripes = System::file().listdir(packsDir);
+		for(size_t i=0; i<stripes.size(); i++){
+
+			if(stripes[i].empty() || stripes[i][0] == '.') continue;
+
+			string stripeDir = packsDir + stripes[i] + "/";
+			vector<string> filenames = System::file().listdir(stripeDir);
+			for(size_t j=0; j<filenames.size(); j++){
+				const string& filename = filenames[j];
+				if(filename.compare(0, 5, "__p__") != 0) continue;
+				if(filename.size() < 5 || filename.compare(filename.size()-5, 5, ".pack") != 0) continue;
+				packFilenames[strtoull(filename.c_str() + 5, NULL, 10)] = stripeDir + filename;
+			}
+		}
+
+		return packFilenames;
+	}
+
 
 	static void checkInputValidity(const string& outputDirTemp, const string& inputFilename, u_int64_t& nbDatasets){
 
@@ -168,10 +245,27 @@ public:
 	:  _filter(filter), _mainref(0) {
 
 		setMainref(refs);
-		_ref = _mainref->getComposition()[0];
+		init(_mainref->getComposition(), nbBanks, maxReads, false);
+	}
+
+	/** Constructor.
+	* \param[in] refs : iterators of the files of the datasets, in the order of the composite iterator
+	* \param[in] isView : item returns the read of the file iterator instead of a copy. It is valid until
+	* the next call to next, so the iterator can't be given to a dispatcher.
+	*/
+	SimkaInputIterator(const std::vector<Iterator<Item>*>& refs, size_t nbBanks, u_int64_t maxReads, Filter filter, bool isView)
+	:  _filter(filter), _mainref(0) {
+
+		init(refs, nbBanks, maxReads, isView);
+	}
+
+	void init(const std::vector<Iterator<Item>*>& refs, size_t nbBanks, u_int64_t maxReads, bool isView){
+		_refs = refs;
+		_isView = isView;
+		_ref = _refs[0];
 		_isDone = false;
 		_nbDatasets = nbBanks;
-		_nbBanks = _mainref->getComposition().size() / _nbDatasets;
+		_nbBanks = _refs.size() / _nbDatasets;
 		_maxReads = maxReads;
 		_nbReadProcessed = 0;
 		_currentBank = 0;
@@ -201,7 +295,7 @@ public:
 
 		if(isFinished()) return;
 
-		_ref = _mainref->getComposition()[_currentBank];
+		_ref = _refs[_currentBank];
 		_isDone = false;
 		first();
 		//nextBank();
@@ -217,7 +311,7 @@ public:
 		else{
 			_isDone = false;
 			_currentBank += 1;
-			_ref = _mainref->getComposition()[_currentBank];
+			_ref = _refs[_currentBank];
 			first();
 		}
 	}
@@ -232,7 +326,7 @@ public:
 
         _isDone = _ref->isDone();
 
-        if(!_isDone) *(this->_item) = _ref->item();
+        if(!_isDone && !_isView) *(this->_item) = _ref->item();
 
     }
 
@@ -275,7 +369,7 @@ public:
 			}
 		}
 		else{
-			*(this->_item) = _ref->item();
+			if(!_isView) *(this->_item) = _ref->item();
 			_nbReadProcessed += 1;
 		}
 
@@ -292,14 +386,15 @@ public:
     bool isDone()  {  return _isDone;  }
 
     /** \copydoc  Iterator::item */
-    Item& item ()  {  return *(this->_item);  }
+    Item& item ()  {  return _isView ? _ref->item() : *(this->_item);  }
 
 
 private:
 
     bool            _isDone;
+    bool _isView;
     size_t _currentBank;
-    //vector<Iterator<Item>* > _refs;
+    vector<Iterator<Item>* > _refs;
     Iterator<Item>* _ref;
     size_t _nbBanks;
     u_int64_t _maxReads;
@@ -372,63 +467,37 @@ struct SimkaSequenceFilter
 		//cout << bootstrapIndex << endl;
 #endif
 
-		if(!isReadSizeValid(seq))
-			return false;
+		return (*this)(seq.getDataBuffer(), seq.getDataSize());
+	}
 
-		if(!isShannonIndexValid(seq))
-			return false;
+	/** Filter on a view of the nucleotides of a read, without copying them. */
+	bool operator() (const char* data, size_t size){
 
+		if(!isReadSizeValid(size))
+			return false;
 
-		//cout << _nbReadProcessed << endl;
-		//_nbReadProcessed += 1;
+		if(!isShannonIndexValid(data, size))
+			return false;
 
 		return true;
 	}
 
-	bool isReadSizeValid(Sequence& seq){
+	bool isReadSizeValid(size_t size){
 		if(_minReadSize == 0) return true;
-		return seq.getDataSize() >= _minReadSize;
+		return size >= _minReadSize;
 	}
 
-	bool isShannonIndexValid(Sequence& seq){
+	bool isShannonIndexValid(const char* data, size_t size){
 		if(_minShannonIndex == 0) return true;
-		return getShannonIndex(seq) >= _minShannonIndex;
+		return getShannonIndex(data, size) >= _minShannonIndex;
 	}
 
 	float getShannonIndex(Sequence& seq){
+		return getShannonIndex(seq.getDataBuffer(), seq.getDataSize());
+	}
 
-		static char nt2binTab[128] = {
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 1, 0, 0, //69
-			0, 3, 0, 0, 0, 0, 0, 0, 4, 0, //79
-			0, 0, 0, 0, 2, 0, 0, 0, 0, 0,
-			0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-			};
-
-		float index = 0;
-		//float freq [5];
-
-		vector<float> _freqs(5, 0);
-
-		char* seqStr = seq.getDataBuffer();
-
-		// Frequency of each letter (A, C, G, T or N)
-		for(size_t i=0; i < seq.getDataSize(); i++)
-			_freqs[nt2binTab[(unsigned char)seqStr[i]]] += 1.0;
-
-		// Shannon index calculation
-		for (size_t i=0; i<_freqs.size(); i++){
-			_freqs[i] /= (float) seq.getDataSize();
-			if (_freqs[i] != 0)
-				index += _freqs[i] * log (_freqs[i]) / log(2);
-		}
-		return abs(index);
-
+	float getShannonIndex(const char* data, size_t size){
+		return SimkaComplexity::getShannonIndex(data, size);
 	}
 
 	size_t _minReadSize;
@@ -445,10 +514,26 @@ template<typename Filter> class SimkaPotaraBankFiltered : public BankDelegate
 public:
 
 
-	SimkaPotaraBankFiltered (IBank* ref, const Filter& filter, u_int64_t maxReads, size_t nbDatasets) : BankDelegate (ref), _ref2(0), _filter(filter)  {
+	/** \param[in] inputFilename : album (or file) opened as ref. Its BGZF files are inflated on
+	 * several threads instead of by the GATB banks.
+	 * \param[in] nbCores : cores of the job. At most nbCores files are read at the same time, and the
+	 * cores are shared between them for inflating BGZF files. */
+	SimkaPotaraBankFiltered (IBank* ref, const Filter& filter, u_int64_t maxReads, size_t nbDatasets, const string& inputFilename="", size_t nbCores=1) : BankDelegate (ref), _ref2(0), _filter(filter)  {
 		_maxReads = maxReads;
 		_nbDatasets = nbDatasets;
+		_nbCores = std::max(nbCores, (size_t)1);
 		setRef2(_ref->iterator ());
+
+		_refs = _ref2->getComposition();
+		vector<string> filenames = SimkaBgzfReader::getBankFiles(inputFilename);
+		if(filenames.size() == _refs.size()){
+			size_t nbInflateThreads = std::max(_nbCores / std::min(filenames.size(), _nbCores), (size_t)1);
+			for(size_t i=0; i<filenames.size(); i++){
+				if(!SimkaBgzfReader::isBgzf(filenames[i])) continue;
+				_refs[i] = new SimkaBgzfIterator(filenames[i], nbInflateThreads);
+				_bgzfRefs.push_back(_refs[i]);
+			}
+		}
 	}
 
 
@@ -459,24 +544,51 @@ public:
 	    for(size_t i=0; i<itBanks.size(); i++){
 	    	delete itBanks[i];
 	    }
+	    for(size_t i=0; i<_bgzfRefs.size(); i++){
+	    	delete _bgzfRefs[i];
+	    }
 
 	    //_ref2->
 		setRef2(0);
 	}
 
+	/** The reads are parsed and filtered on read-ahead threads (SimkaReadAheadIterator), with one
+	 * stream per file. The streams are views on the reads of the file iterators: a read is copied
+	 * once, into the batches, if it passes the filter. With max-reads, the reads of a paired part are counted from its files in
+	 * order, so each part is a single stream. */
     Iterator<Sequence>* iterator ()
     {
-        return new SimkaInputIterator<Sequence, Filter> (_ref2, _nbDatasets, _maxReads, _filter);
+        size_t nbFiles = _refs.size() / _nbDatasets;
+        vector<Iterator<Sequence>*> streams;
+
+        for(size_t d=0; d<_nbDatasets; d++){
+        	vector<Iterator<Sequence>*> refs(_refs.begin() + d*nbFiles, _refs.begin() + (d+1)*nbFiles);
+        	if(_maxReads){
+        		streams.push_back(new SimkaInputIterator<Sequence, Filter> (refs, 1, _maxReads, _filter, true));
+        	}
+        	else{
+        		for(size_t i=0; i<refs.size(); i++)
+        			streams.push_back(new SimkaInputIterator<Sequence, Filter> (vector<Iterator<Sequence>*>(1, refs[i]), 1, 0, _filter, true));
+        	}
+        }
 
+        return new SimkaReadAheadIterator(streams, _nbCores, _error);
     }
 
+    /** Throw the first error of the read-ahead threads, once the reads of the iterators are consumed. */
+    void checkErrors(){ _error.check(); }
+
 private:
 
 
     Iterator<Sequence>* _ref2;
     void setRef2 (Iterator<Sequence>* ref2)  { SP_SETATTR(ref2); }
+    vector<Iterator<Sequence>*> _refs;
+    vector<Iterator<Sequence>*> _bgzfRefs;
+    SimkaError _error;
 
     u_int64_t _maxReads;
+    size_t _nbCores;
     Filter _filter;
     u_int64_t _nbReadToProcess;
     size_t _datasetId;
@@ -0,0 +1,261 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKACOMPLEXITY_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKACOMPLEXITY_HPP_
+
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <sys/types.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SIMKA_COMPLEXITY_X86
+#endif
+
+//Counts whose c*log2(c) is tabulated, larger ones are computed
+#define SIMKA_COMPLEXITY_TABLE_SIZE 4096
+
+
+/*********************************************************************
+* ** SimkaComplexity
+*
+* Shannon index of reads: H = log2(n) - sum(c * log2(c)) / n over the
+* counts c of A, C, T, G and N (any other letter counts as A), between 0
+* and log2(5).
+*
+* The letters are counted 32 (AVX2) or 16 (SSE4.1) at a time with byte
+* compares, one by one on other CPUs. Both vector versions are built
+* whatever the compiler flags; the one the CPU supports is chosen at the
+* first call. The c*log2(c) terms come from a table for the counts of
+* usual reads.
+*********************************************************************/
+class SimkaComplexity
+{
+
+public:
+
+	/** \param[out] counts : A (and others), C, T, G, N */
+	static void countNucleotides(const char* data, size_t size, u_int64_t counts[5]){
+
+		counts[1] = counts[2] = counts[3] = counts[4] = 0;
+
+		//Letters counted by the vector version, the remaining ones are counted one by one
+		static const CountFunction countVector = getCountFunction();
+		size_t i = countVector(data, size, counts);
+
+		const char* tab = getLetterTable();
+		for(; i<size; i++) counts[(size_t)tab[(unsigned char)data[i]]] += 1;
+
+		counts[0] = size - counts[1] - counts[2] - counts[3] - counts[4];
+	}
+
+	static float getShannonIndex(const char* data, size_t size){
+		if(size == 0) return 0;
+		u_int64_t counts[5];
+		countNucleotides(data, size, counts);
+		return getShannonIndex(counts, 5, size);
+	}
+
+	/** \param[in] size : sum of the counts */
+	static float getShannonIndex(const u_int64_t* counts, size_t nbCounts, u_int64_t size){
+		double sum = 0;
+		for(size_t i=0; i<nbCounts; i++) sum += cLogC(counts[i]);
+		return std::max(std::log2((double) size) - sum / size, 0.0);
+	}
+
+	static inline double cLogC(u_int64_t count){
+		if(count < SIMKA_COMPLEXITY_TABLE_SIZE) return getCLogCTable()[count];
+		return count * std::log2((double) count);
+	}
+
+private:
+
+	/** Adds the C, T, G and N of the first letters of data to counts[1..4].
+	 * \return the number of letters counted */
+	typedef size_t (*CountFunction)(const char* data, size_t size, u_int64_t counts[5]);
+
+	static CountFunction getCountFunction(){
+#ifdef SIMKA_COMPLEXITY_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) return countAVX2;
+		if(__builtin_cpu_supports("sse4.1")) return countSSE41;
+#endif
+		return countNone;
+	}
+
+	static size_t countNone(const char* data, size_t size, u_int64_t counts[5]){
+		return 0;
+	}
+
+#ifdef SIMKA_COMPLEXITY_X86
+	__attribute__((target("avx2")))
+	static size_t countAVX2(const char* data, size_t size, u_int64_t counts[5]){
+
+		size_t i = 0;
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i letters[4] = {_mm256_set1_epi8('C'), _mm256_set1_epi8('T'), _mm256_set1_epi8('G'), _mm256_set1_epi8('N')};
+
+		while(i + 32 <= size){
+			//Byte counters, summed before they overflow
+			__m256i sums[4] = {zero, zero, zero, zero};
+			size_t end = std::min(size, i + 255*32);
+			for(; i + 32 <= end; i += 32){
+				__m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+				for(size_t l=0; l<4; l++) sums[l] = _mm256_sub_epi8(sums[l], _mm256_cmpeq_epi8(v, letters[l]));
+			}
+			for(size_t l=0; l<4; l++){
+				__m256i s = _mm256_sad_epu8(sums[l], zero);
+				counts[l+1] += _mm256_extract_epi64(s, 0) + _mm256_extract_epi64(s, 1) + _mm256_extract_epi64(s, 2) + _mm256_extract_epi64(s, 3);
+			}
+		}
+
+		return i;
+	}
+
+	__attribute__((target("sse4.1")))
+	static size_t countSSE41(const char* data, size_t size, u_int64_t counts[5]){
+
+		size_t i = 0;
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i letters[4] = {_mm_set1_epi8('C'), _mm_set1_epi8('T'), _mm_set1_epi8('G'), _mm_set1_epi8('N')};
+
+		while(i + 16 <= size){
+			__m128i sums[4] = {zero, zero, zero, zero};
+			size_t end = std::min(size, i + 255*16);
+			for(; i + 16 <= end; i += 16){
+				__m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+				for(size_t l=0; l<4; l++) sums[l] = _mm_sub_epi8(sums[l], _mm_cmpeq_epi8(v, letters[l]));
+			}
+			for(size_t l=0; l<4; l++){
+				__m128i s = _mm_sad_epu8(sums[l], zero);
+				counts[l+1] += _mm_extract_epi64(s, 0) + _mm_extract_epi64(s, 1);
+			}
+		}
+
+		return i;
+	}
+#endif
+
+	/** Counter of each letter in countNucleotides, 0 (A) for the ones not counted. */
+	static const char* getLetterTable(){
+		static const struct Table{
+			char _tab[256];
+			Table(){
+				memset(_tab, 0, sizeof(_tab));
+				_tab[(unsigned char)'C'] = 1;
+				_tab[(unsigned char)'T'] = 2;
+				_tab[(unsigned char)'G'] = 3;
+				_tab[(unsigned char)'N'] = 4;
+			}
+		} table;
+		return table._tab;
+	}
+
+	static const double* getCLogCTable(){
+		static const struct Table{
+			double _tab[SIMKA_COMPLEXITY_TABLE_SIZE];
+			Table(){
+				_tab[0] = 0;
+				for(size_t c=1; c<SIMKA_COMPLEXITY_TABLE_SIZE; c++) _tab[c] = c * std::log2((double) c);
+			}
+		} table;
+		return table._tab;
+	}
+};
+
+
+/*********************************************************************
+* ** SimkaKmerComplexityFilter
+*
+* Drops the k-mers whose Shannon index is below -kmer-shannon-index. The
+* nucleotides are counted on the 2-bit encoded k-mer, 32 at a time: a
+* nucleotide equals a code when both bits of their xor are zero, and a
+* popcount gives the number of such nucleotides. As the counts sum to k,
+* the test is sum(c * log2(c)) <= k * (log2(k) - min), from a table of
+* the k+1 possible terms.
+*********************************************************************/
+class SimkaKmerComplexityFilter
+{
+
+public:
+
+	SimkaKmerComplexityFilter(){
+		_kmerSize = 0;
+		_minShannonIndex = 0;
+		_maxSum = 0;
+	}
+
+	SimkaKmerComplexityFilter(size_t kmerSize, double minShannonIndex){
+
+		_kmerSize = kmerSize;
+		_minShannonIndex = minShannonIndex;
+
+		_cLogC.resize(kmerSize+1);
+		for(size_t c=0; c<=kmerSize; c++) _cLogC[c] = SimkaComplexity::cLogC(c);
+
+		//Tolerance for the rounding of the terms
+		_maxSum = kmerSize * (std::log2((double) kmerSize) - minShannonIndex) + 1e-9;
+	}
+
+	bool isEnabled() const { return _minShannonIndex > 0; }
+
+	template<typename Type>
+	bool isValid(const Type& kmer) const {
+
+		u_int64_t counts[4];
+		countNucleotides(kmer, counts);
+		return _cLogC[counts[0]] + _cLogC[counts[1]] + _cLogC[counts[2]] + _cLogC[counts[3]] <= _maxSum;
+	}
+
+	/** \param[out] counts : number of nucleotides of each code (A=0 C=1 T=2 G=3) */
+	template<typename Type>
+	void countNucleotides(const Type& kmer, u_int64_t counts[4]) const {
+
+		counts[0] = counts[1] = counts[2] = 0;
+
+		for(size_t start=0; start<_kmerSize; start+=32){
+
+			u_int64_t word = (kmer >> (2*start)).getVal();
+			size_t nbNucleotides = std::min(_kmerSize - start, (size_t)32);
+			u_int64_t lowBits = 0x5555555555555555ULL;
+			if(nbNucleotides < 32) lowBits &= ((u_int64_t)1 << (2*nbNucleotides)) - 1;
+
+			for(u_int64_t code=0; code<3; code++){
+				u_int64_t x = word ^ (code * 0x5555555555555555ULL);
+				counts[code] += __builtin_popcountll(~(x | (x >> 1)) & lowBits);
+			}
+		}
+
+		counts[3] = _kmerSize - counts[0] - counts[1] - counts[2];
+	}
+
+private:
+
+	size_t _kmerSize;
+	double _minShannonIndex;
+	std::vector<double> _cLogC;
+	double _maxSum;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKACOMPLEXITY_HPP_ */
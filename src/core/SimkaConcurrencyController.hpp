@@ -0,0 +1,347 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKACONCURRENCYCONTROLLER_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKACONCURRENCYCONTROLLER_HPP_
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <ctime>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+//Minimum delay between two decisions: PSI averages and disk counters need time to reflect a change
+#define SIMKA_CONTROLLER_PERIOD_SEC 10
+
+//Thresholds on the PSI avg10 values (percentage of time stalled)
+#define SIMKA_CONTROLLER_MEMORY_FULL_MAX 10.0
+#define SIMKA_CONTROLLER_IO_FULL_MAX 30.0
+#define SIMKA_CONTROLLER_IO_SOME_MAX 10.0
+#define SIMKA_CONTROLLER_CPU_SOME_MAX 20.0
+
+
+/*********************************************************************
+* ** SimkaCgroupLimits
+*
+* Resource limits and pressure of the cgroup (v2) simka runs in. Values
+* are 0 when the limit is not set or the file can't be read (cgroup v1,
+* no PSI support, not Linux). Pressures fall back to /proc/pressure.
+*********************************************************************/
+class SimkaCgroupLimits
+{
+
+public:
+
+	SimkaCgroupLimits(){
+
+		_cgroupDir = "/sys/fs/cgroup";
+
+		std::ifstream file("/proc/self/cgroup");
+		std::string line;
+		while(std::getline(file, line)){
+			//cgroup v2 entry is "0::<path>"
+			if(line.compare(0, 3, "0::") == 0){
+				std::string path = line.substr(3);
+				if(path != "/" && fileExists(_cgroupDir + path + "/cgroup.controllers")) _cgroupDir += path;
+				break;
+			}
+		}
+	}
+
+	/** Number of cores allowed by cpu.max, 0 if unlimited. */
+	double getCpuLimit(){
+		std::string quota;
+		double period = 0;
+		std::ifstream file((_cgroupDir + "/cpu.max").c_str());
+		if(!(file >> quota >> period) || quota == "max" || period <= 0) return 0;
+		return atof(quota.c_str()) / period;
+	}
+
+	/** memory.max in MB, 0 if unlimited. */
+	u_int64_t getMemoryLimitMB(){
+		std::string value = readFirstWord(_cgroupDir + "/memory.max");
+		if(value == "" || value == "max") return 0;
+		return strtoull(value.c_str(), NULL, 10) / (1024*1024);
+	}
+
+	/** memory.current in MB, 0 if unknown. */
+	u_int64_t getMemoryUsageMB(){
+		std::string value = readFirstWord(_cgroupDir + "/memory.current");
+		if(value == "") return 0;
+		return strtoull(value.c_str(), NULL, 10) / (1024*1024);
+	}
+
+	/** avg10 of a PSI file ("cpu", "memory" or "io"), kind is "some" or "full". */
+	double getPressure(const std::string& resource, const std::string& kind){
+		double value;
+		if(readPressure(_cgroupDir + "/" + resource + ".pressure", kind, value)) return value;
+		if(readPressure("/proc/pressure/" + resource, kind, value)) return value;
+		return 0;
+	}
+
+private:
+
+	static bool fileExists(const std::string& filename){
+		struct stat st;
+		return stat(filename.c_str(), &st) == 0;
+	}
+
+	static std::string readFirstWord(const std::string& filename){
+		std::string value;
+		std::ifstream file(filename.c_str());
+		file >> value;
+		return value;
+	}
+
+	static bool readPressure(const std::string& filename, const std::string& kind, double& value){
+
+		std::ifstream file(filename.c_str());
+		std::string line;
+
+		while(std::getline(file, line)){
+			//some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+			if(line.compare(0, kind.size(), kind) != 0) continue;
+			std::string::size_type pos = line.find("avg10=");
+			if(pos == std::string::npos) return false;
+			value = atof(line.c_str() + pos + 6);
+			return true;
+		}
+
+		return false;
+	}
+
+	std::string _cgroupDir;
+};
+
+
+/*********************************************************************
+* ** SimkaConcurrencyController
+*
+* Adjusts the number of concurrent jobs of a phase (count or merge) at
+* runtime, between 1 and the static maximum computed at startup. That
+* maximum is what the memory and cores given to simka can hold; the
+* cgroup limits (memory.max, cpu.max) can only lower it.
+*
+* The limit is lowered on memory pressure, when the cgroup memory usage
+* gets close to memory.max, on I/O thrashing, or when the last raise did
+* not increase the throughput of the temp dir device. It is raised by one
+* when every slot is busy and CPU, memory and I/O have headroom.
+* Every decision is appended to the log file with the values it was
+* based on.
+*********************************************************************/
+class SimkaConcurrencyController
+{
+
+public:
+
+	/** \param[in] phase : name printed in the log
+	 * \param[in] limit : initial number of concurrent jobs
+	 * \param[in] maxJobs : the limit is never raised above this value
+	 * \param[in] memoryPerJobMB : memory used by one job
+	 * \param[in] coresPerJob : cores used by one job
+	 * \param[in] tempDir : directory whose device throughput is monitored
+	 * \param[in] logFilename : decisions are appended to this file */
+	SimkaConcurrencyController(const std::string& phase, size_t limit, size_t maxJobs, size_t memoryPerJobMB, size_t coresPerJob, const std::string& tempDir, const std::string& logFilename){
+
+		_phase = phase;
+		_maxJobs = std::max(maxJobs, (size_t)1);
+		_memoryPerJobMB = memoryPerJobMB;
+		_coresPerJob = coresPerJob;
+		_logFilename = logFilename;
+
+		_lastUpdate = time(0);
+		_lastSectors = 0;
+		_lastThroughput = 0;
+		_hasRaised = false;
+		_saturationLimit = 0;
+
+		_hasDevice = false;
+#ifdef __linux__
+		struct stat st;
+		if(stat(tempDir.c_str(), &st) == 0){
+			_major = major(st.st_dev);
+			_minor = minor(st.st_dev);
+			_hasDevice = readSectors(_lastSectors);
+		}
+#endif
+
+		//Never start above what the cgroup allows
+		_limit = std::min(std::max(limit, (size_t)1), getCap());
+
+		log("start with " + toString(_limit) + " jobs (max " + toString(_maxJobs) + ")");
+	}
+
+	size_t getLimit() const { return _limit; }
+
+	/** Re-evaluate the limit, at most once per period.
+	 * \param[in] nbRunning : number of jobs of the phase currently running
+	 * \return the new limit */
+	size_t update(size_t nbRunning){
+
+		time_t now = time(0);
+		double elapsed = difftime(now, _lastUpdate);
+		if(elapsed < SIMKA_CONTROLLER_PERIOD_SEC) return _limit;
+		_lastUpdate = now;
+
+		double throughput = 0;
+		u_int64_t sectors = 0;
+		if(_hasDevice && readSectors(sectors)){
+			throughput = (sectors - _lastSectors) * 512.0 / (1024*1024) / elapsed;
+			_lastSectors = sectors;
+		}
+
+		double memoryFull = _cgroup.getPressure("memory", "full");
+		double ioFull = _cgroup.getPressure("io", "full");
+		double ioSome = _cgroup.getPressure("io", "some");
+		double cpuSome = _cgroup.getPressure("cpu", "some");
+		u_int64_t memoryMax = _cgroup.getMemoryLimitMB();
+		u_int64_t memoryUsage = _cgroup.getMemoryUsageMB();
+
+		std::ostringstream values;
+		values.precision(3);
+		values << "running=" << nbRunning << " throughput=" << throughput << "MB/s"
+			   << " psi(cpu some=" << cpuSome << ", memory full=" << memoryFull << ", io some=" << ioSome << ", io full=" << ioFull << ")";
+		if(memoryMax > 0) values << " memory=" << memoryUsage << "/" << memoryMax << "MB";
+
+		size_t limit = _limit;
+		std::string reason;
+
+		if(memoryFull >= SIMKA_CONTROLLER_MEMORY_FULL_MAX){
+			limit = std::max(_limit/2, (size_t)1);
+			reason = "memory pressure";
+		}
+		else if(memoryMax > 0 && memoryUsage > memoryMax * 0.9){
+			limit = _limit - 1;
+			reason = "memory usage close to memory.max";
+		}
+		else if(ioFull >= SIMKA_CONTROLLER_IO_FULL_MAX){
+			limit = _limit - 1;
+			reason = "I/O thrashing";
+		}
+		else if(_hasRaised && _hasDevice && throughput < _lastThroughput * 1.05){
+			limit = _limit - 1;
+			_saturationLimit = limit;
+			reason = "last raise did not increase the temp dir throughput";
+		}
+		else if(nbRunning >= _limit && ioSome < SIMKA_CONTROLLER_IO_SOME_MAX && cpuSome < SIMKA_CONTROLLER_CPU_SOME_MAX
+				&& (_saturationLimit == 0 || _limit < _saturationLimit)){
+			limit = _limit + 1;
+			reason = "headroom";
+		}
+
+		limit = std::max(limit, (size_t)1);
+		limit = std::min(limit, getCap());
+
+		_hasRaised = limit > _limit;
+		_lastThroughput = throughput;
+
+		if(limit != _limit){
+			log(toString(_limit) + " -> " + toString(limit) + " jobs (" + reason + ") " + values.str());
+			_limit = limit;
+		}
+
+		return _limit;
+	}
+
+private:
+
+	/** _maxJobs, lowered by the memory and cores of the cgroup */
+	size_t getCap(){
+
+		size_t cap = _maxJobs;
+
+		u_int64_t memoryMax = _cgroup.getMemoryLimitMB();
+		if(memoryMax > 0 && _memoryPerJobMB > 0) cap = std::min(cap, (size_t) (memoryMax * 0.9 / _memoryPerJobMB));
+
+		double cpuMax = _cgroup.getCpuLimit();
+		if(cpuMax > 0 && _coresPerJob > 0) cap = std::min(cap, (size_t) (cpuMax / _coresPerJob));
+
+		return std::max(cap, (size_t)1);
+	}
+
+	/** Sectors read and written on the device of the temp dir, from /proc/diskstats.
+	 * Not available for network filesystems, which only rely on PSI. */
+	bool readSectors(u_int64_t& sectors){
+
+		std::ifstream file("/proc/diskstats");
+		std::string line;
+
+		while(std::getline(file, line)){
+
+			std::istringstream fields(line);
+			unsigned int major, minor;
+			std::string name;
+			u_int64_t value, sectorsRead, sectorsWritten;
+
+			//major minor name reads merged sectors_read ms writes merged sectors_written ...
+			if(!(fields >> major >> minor >> name)) continue;
+			if(major != _major || minor != _minor) continue;
+			if(!(fields >> value >> value >> sectorsRead >> value >> value >> value >> sectorsWritten)) return false;
+
+			sectors = sectorsRead + sectorsWritten;
+			return true;
+		}
+
+		return false;
+	}
+
+	void log(const std::string& message){
+
+		char date[32];
+		time_t now = time(0);
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+		std::ofstream file(_logFilename.c_str(), std::ios::app);
+		file << date << " [" << _phase << "] " << message << std::endl;
+	}
+
+	static std::string toString(size_t value){
+		std::ostringstream str;
+		str << value;
+		return str.str();
+	}
+
+	SimkaCgroupLimits _cgroup;
+	std::string _phase;
+	std::string _logFilename;
+	size_t _limit;
+	size_t _maxJobs;
+	size_t _memoryPerJobMB;
+	size_t _coresPerJob;
+
+	bool _hasDevice;
+	unsigned int _major;
+	unsigned int _minor;
+	time_t _lastUpdate;
+	u_int64_t _lastSectors;
+	double _lastThroughput;
+	bool _hasRaised;
+	size_t _saturationLimit;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKACONCURRENCYCONTROLLER_HPP_ */
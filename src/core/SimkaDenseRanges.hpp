@@ -0,0 +1,137 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKADENSERANGES_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKADENSERANGES_HPP_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <sys/types.h>
+
+//Largest k-mer size counted in a dense array (MiniKC) and stored in dense partition files
+#define SIMKA_DENSE_MAX_KMER_SIZE 15
+
+
+/*********************************************************************
+* ** SimkaDenseRanges
+*
+* Partitions of the small k-mers (k <= SIMKA_DENSE_MAX_KMER_SIZE): each
+* partition is a range of k-mer values instead of a set of minimizers,
+* so the counts of every dataset cover the same range and can be stored
+* as dense windows (see SimkaPartitionFile). The ranges hold the same
+* number of canonical k-mers.
+*
+* Computed once by simka and saved in <tmp>/dense_ranges: the kmer size,
+* the number of partitions and the end of each range, one per line.
+*********************************************************************/
+class SimkaDenseRanges
+{
+
+public:
+
+	SimkaDenseRanges(){
+		_kmerSize = 0;
+	}
+
+	static bool isEnabled(size_t kmerSize){
+		return kmerSize <= SIMKA_DENSE_MAX_KMER_SIZE;
+	}
+
+	/** \param[in] kmerSize : size of the k-mers, at most SIMKA_DENSE_MAX_KMER_SIZE
+	 * \param[in] nbPartitions : number of ranges */
+	void compute(size_t kmerSize, size_t nbPartitions){
+
+		_kmerSize = kmerSize;
+		_ends.clear();
+
+		u_int64_t nbValues = (u_int64_t)1 << (2*kmerSize);
+		//Even k-mers may be their own reverse complement
+		u_int64_t nbCanonicals = (kmerSize % 2 == 1) ? nbValues / 2 : (nbValues + ((u_int64_t)1 << kmerSize)) / 2;
+
+		u_int64_t nbSeen = 0;
+		u_int64_t value = 0;
+		for(size_t p=0; p+1<nbPartitions; p++){
+			u_int64_t target = nbCanonicals * (p+1) / nbPartitions;
+			while(nbSeen < target){
+				if(value <= revcomp(value)) nbSeen += 1;
+				value += 1;
+			}
+			_ends.push_back(value);
+		}
+		_ends.push_back(nbValues);
+	}
+
+	void save(const std::string& filename) const {
+		std::ofstream file(filename.c_str());
+		file << _kmerSize << std::endl << _ends.size() << std::endl;
+		for(size_t i=0; i<_ends.size(); i++) file << _ends[i] << std::endl;
+		file.close();
+	}
+
+	/** \return false if the file is missing or was computed for other parameters */
+	bool load(const std::string& filename, size_t kmerSize, size_t nbPartitions){
+
+		std::ifstream file(filename.c_str());
+		size_t fileKmerSize, fileNbPartitions;
+		if(!(file >> fileKmerSize >> fileNbPartitions)) return false;
+		if(fileKmerSize != kmerSize || fileNbPartitions != nbPartitions) return false;
+
+		_kmerSize = kmerSize;
+		_ends.resize(nbPartitions);
+		for(size_t i=0; i<nbPartitions; i++){
+			if(!(file >> _ends[i])) return false;
+		}
+
+		return !_ends.empty() && _ends.back() == (u_int64_t)1 << (2*kmerSize);
+	}
+
+	size_t size() const { return _ends.size(); }
+
+	/** First k-mer value of a partition. */
+	u_int64_t getStart(size_t partitionId) const { return partitionId == 0 ? 0 : _ends[partitionId-1]; }
+
+	/** End (excluded) of the k-mer values of a partition. */
+	u_int64_t getEnd(size_t partitionId) const { return _ends[partitionId]; }
+
+	size_t getPartition(u_int64_t kmer) const {
+		return std::upper_bound(_ends.begin(), _ends.end(), kmer) - _ends.begin();
+	}
+
+private:
+
+	u_int64_t revcomp(u_int64_t kmer) const {
+		u_int64_t x = kmer;
+		x = ((x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2);
+		x = ((x >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+		x = ((x >> 8 & 0x00FF00FF00FF00FFULL) | (x & 0x00FF00FF00FF00FFULL) << 8);
+		x = ((x >> 16 & 0x0000FFFF0000FFFFULL) | (x & 0x0000FFFF0000FFFFULL) << 16);
+		x = ((x >> 32 & 0x00000000FFFFFFFFULL) | (x & 0x00000000FFFFFFFFULL) << 32);
+		//A=0 C=1 T=2 G=3: the complement flips the high bit of each nucleotide
+		return (x ^ 0xAAAAAAAAAAAAAAAAULL) >> (64 - 2*_kmerSize);
+	}
+
+	size_t _kmerSize;
+	std::vector<u_int64_t> _ends;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKADENSERANGES_HPP_ */
@@ -0,0 +1,154 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKADISKBUDGET_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKADISKBUDGET_HPP_
+
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+
+/*********************************************************************
+* ** SimkaDiskBudget
+*
+* Admission of count jobs under a temporary disk budget (-max-disk).
+*
+* The bytes written by the finished jobs are tracked, and give the
+* number of bytes written per read. A job starting reserves the bytes
+* it is projected to write (its estimated number of reads times that
+* ratio) until it finishes. The projection includes the temporary files
+* of the jobs (SuperKC super-k-mers), which are removed once the job is
+* finished: only its pack file is left on disk. A job may start if the bytes on disk plus
+* the reservations fit in the budget. One job can always start when
+* no other is running, so that simka never stalls; until the first job
+* is finished the ratio is unknown and jobs run one at a time.
+*********************************************************************/
+class SimkaDiskBudget
+{
+
+public:
+
+	/** \param[in] maxBytes : the budget */
+	SimkaDiskBudget(u_int64_t maxBytes){
+		_maxBytes = maxBytes;
+		_usedBytes = 0;
+		_reservedBytes = 0;
+		_learnedBytes = 0;
+		_learnedTempBytes = 0;
+		_learnedSize = 0;
+	}
+
+	u_int64_t getMaxBytes() const { return _maxBytes; }
+
+	u_int64_t getUsedBytes(){
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _usedBytes;
+	}
+
+	/** Bytes that were on disk before the tracked jobs (previous run). */
+	void addUsed(u_int64_t bytes){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_usedBytes += bytes;
+	}
+
+	/** Bytes removed from the disk (pre-merged inputs). */
+	void removeUsed(u_int64_t bytes){
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_usedBytes -= std::min(bytes, _usedBytes);
+		}
+		_cond.notify_all();
+	}
+
+	/** \param[in] size : estimated number of reads of the job */
+	bool canStart(u_int64_t size){
+		std::unique_lock<std::mutex> lock(_mutex);
+		return fits(size);
+	}
+
+	/** Reserve the projected bytes of a starting job. */
+	void start(size_t id, u_int64_t size){
+		std::unique_lock<std::mutex> lock(_mutex);
+		reserve(id, size);
+	}
+
+	/** Block until the job fits in the budget, then reserve its projected bytes. */
+	void waitStart(size_t id, u_int64_t size){
+		std::unique_lock<std::mutex> lock(_mutex);
+		while(!fits(size)) _cond.wait(lock);
+		reserve(id, size);
+	}
+
+	/** Replace the reservation of a job by the bytes it actually wrote.
+	 * Also used for jobs that did not reserve anything (restored counts).
+	 * \param[in] tempBytes : bytes of the temporary files of the job, removed by now */
+	void finish(size_t id, u_int64_t size, u_int64_t bytesWritten, u_int64_t tempBytes){
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			std::map<size_t, u_int64_t>::iterator it = _reservations.find(id);
+			if(it != _reservations.end()){
+				_reservedBytes -= it->second;
+				_reservations.erase(it);
+			}
+
+			_usedBytes += bytesWritten;
+			_learnedBytes += bytesWritten;
+			_learnedTempBytes += tempBytes;
+			_learnedSize += size;
+		}
+		_cond.notify_all();
+	}
+
+private:
+
+	bool fits(u_int64_t size){
+		if(_reservations.empty()) return true;
+		if(_learnedSize == 0) return false;
+		return _usedBytes + _reservedBytes + projected(size) <= _maxBytes;
+	}
+
+	void reserve(size_t id, u_int64_t size){
+		u_int64_t bytes = projected(size);
+		_reservations[id] = bytes;
+		_reservedBytes += bytes;
+	}
+
+	u_int64_t projected(u_int64_t size){
+		if(_learnedSize == 0) return 0;
+		return (u_int64_t) ((long double) (_learnedBytes + _learnedTempBytes) / _learnedSize * size);
+	}
+
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	u_int64_t _maxBytes;
+	u_int64_t _usedBytes;
+	u_int64_t _reservedBytes;
+	u_int64_t _learnedBytes;
+	u_int64_t _learnedTempBytes;
+	u_int64_t _learnedSize;
+	std::map<size_t, u_int64_t> _reservations;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKADISKBUDGET_HPP_ */
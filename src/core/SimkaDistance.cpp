@@ -325,57 +325,54 @@ void SimkaStatistics::print(){
 void SimkaStatistics::load(const string& filename){
 
 
-	IterableGzFile<long double>* file = new IterableGzFile<long double>(filename);
-	Iterator<long double>* it = file->iterator();
-	LOCAL(it);
-	it->first();
-
-	//_nbBanks = it->item(); it->next();
-	_computeSimpleDistances = it->item(); it->next();
-	_computeComplexDistances = it->item(); it->next();
+	SimkaCodecReader* file = new SimkaCodecReader(filename);
+
+	//_nbBanks = file->read<long double>();
+	_computeSimpleDistances = file->read<long double>();
+	_computeComplexDistances = file->read<long double>();
 	//cout << _computeSimpleDistances << "   " << _computeComplexDistances << endl;
-	_nbKmers = it->item(); it->next();
-	_nbErroneousKmers = it->item(); it->next();
-	_nbDistinctKmers = it->item(); it->next();
-	_nbSolidKmers = it->item(); it->next();
-	_nbSharedKmers = it->item(); it->next();
+	_nbKmers = file->read<long double>();
+	_nbErroneousKmers = file->read<long double>();
+	_nbDistinctKmers = file->read<long double>();
+	_nbSolidKmers = file->read<long double>();
+	_nbSharedKmers = file->read<long double>();
 
-    for(size_t i=0; i<_nbBanks; i++){ _nbSolidDistinctKmersPerBank[i] = it->item(); it->next();}
-    for(size_t i=0; i<_nbBanks; i++){ _nbKmersPerBank[i] = it->item(); it->next();}
-    for(size_t i=0; i<_nbBanks; i++){ _nbSolidKmersPerBank[i] = it->item(); it->next();}
-    //for(size_t i=0; i<_nbBanks; i++){ _nbDistinctKmersSharedByBanksThreshold[i] = it->item(); it->next();}
-    //for(size_t i=0; i<_nbBanks; i++){ _nbKmersSharedByBanksThreshold[i] = it->item(); it->next();}
+    for(size_t i=0; i<_nbBanks; i++){ _nbSolidDistinctKmersPerBank[i] = file->read<long double>();}
+    for(size_t i=0; i<_nbBanks; i++){ _nbKmersPerBank[i] = file->read<long double>();}
+    for(size_t i=0; i<_nbBanks; i++){ _nbSolidKmersPerBank[i] = file->read<long double>();}
+    //for(size_t i=0; i<_nbBanks; i++){ _nbDistinctKmersSharedByBanksThreshold[i] = file->read<long double>();}
+    //for(size_t i=0; i<_nbBanks; i++){ _nbKmersSharedByBanksThreshold[i] = file->read<long double>();}
 
 
     for(size_t i=0; i<_nbBanks; i++){
     	//cout << i << endl;
     	//cout << _nbBanks << endl;
     	//cout << _matrixNbDistinctSharedKmers[i].size() << endl;
-            for(size_t j=0; j<_nbBanks; j++){ _matrixNbSharedKmers[i][j] = it->item(); it->next();}
+            for(size_t j=0; j<_nbBanks; j++){ _matrixNbSharedKmers[i][j] = file->read<long double>();}
 
-            //for(size_t j=0; j<_nbBanks; j++){ _abundance_jaccard_intersection[i][j] = it->item(); it->next();}
+            //for(size_t j=0; j<_nbBanks; j++){ _abundance_jaccard_intersection[i][j] = file->read<long double>();}
     }
 
     for(size_t i=0; i<_symetricDistanceMatrixSize; i++){
-        _matrixNbDistinctSharedKmers[i] = it->item(); it->next();
-        _brayCurtisNumerator[i] = it->item(); it->next();
+        _matrixNbDistinctSharedKmers[i] = file->read<long double>();
+        _brayCurtisNumerator[i] = file->read<long double>();
     }
 
 	if(_computeSimpleDistances){
-	    for(size_t i=0; i<_nbBanks; i++){ _chord_sqrt_N2[i] = it->item(); it->next();}
+	    for(size_t i=0; i<_nbBanks; i++){ _chord_sqrt_N2[i] = file->read<long double>();}
 	    for(size_t i=0; i<_nbBanks; i++){
-			for(size_t j=0; j<_nbBanks; j++){ _chord_NiNj[i][j] = it->item(); it->next();}
-			for(size_t j=0; j<_nbBanks; j++){ _hellinger_SqrtNiNj[i][j] = it->item(); it->next();}
-			for(size_t j=0; j<_nbBanks; j++){ _kulczynski_minNiNj[i][j] = it->item(); it->next();}
+			for(size_t j=0; j<_nbBanks; j++){ _chord_NiNj[i][j] = file->read<long double>();}
+			for(size_t j=0; j<_nbBanks; j++){ _hellinger_SqrtNiNj[i][j] = file->read<long double>();}
+			for(size_t j=0; j<_nbBanks; j++){ _kulczynski_minNiNj[i][j] = file->read<long double>();}
 	    }
 	}
 
 
 	if(_computeComplexDistances){
 	    for(size_t i=0; i<_nbBanks; i++){
-			for(size_t j=0; j<_nbBanks; j++){ _canberra[i][j] = it->item(); it->next();}
-			for(size_t j=0; j<_nbBanks; j++){ _whittaker_minNiNj[i][j] = it->item(); it->next();}
-			for(size_t j=0; j<_nbBanks; j++){ _kullbackLeibler[i][j] = it->item(); it->next();}
+			for(size_t j=0; j<_nbBanks; j++){ _canberra[i][j] = file->read<long double>();}
+			for(size_t j=0; j<_nbBanks; j++){ _whittaker_minNiNj[i][j] = file->read<long double>();}
+			for(size_t j=0; j<_nbBanks; j++){ _kullbackLeibler[i][j] = file->read<long double>();}
 	    }
 	}
 
@@ -384,58 +381,58 @@ void SimkaStatistics::load(const string& filename){
 	
 }
 
-void SimkaStatistics::save (const string& filename){
+void SimkaStatistics::save (const string& filename, SimkaCodecType codec){
 
 
-	BagGzFile<long double>* file = new BagGzFile<long double>(filename);
+	SimkaCodecWriter* file = new SimkaCodecWriter(filename, codec);
 
 
 	//file->insert(_nbBanks);
-	file->insert((long double)_computeSimpleDistances);
-	file->insert((long double)_computeComplexDistances);
-	file->insert((long double)_nbKmers);
-	file->insert((long double)_nbErroneousKmers);
-	file->insert((long double)_nbDistinctKmers);
-	file->insert((long double)_nbSolidKmers);
-	file->insert((long double)_nbSharedKmers);
+	file->write((long double)_computeSimpleDistances);
+	file->write((long double)_computeComplexDistances);
+	file->write((long double)_nbKmers);
+	file->write((long double)_nbErroneousKmers);
+	file->write((long double)_nbDistinctKmers);
+	file->write((long double)_nbSolidKmers);
+	file->write((long double)_nbSharedKmers);
 
-    for(size_t i=0; i<_nbBanks; i++){ file->insert((long double)_nbSolidDistinctKmersPerBank[i]);}
-    for(size_t i=0; i<_nbBanks; i++){ file->insert((long double)_nbKmersPerBank[i]);}
-    for(size_t i=0; i<_nbBanks; i++){ file->insert((long double)_nbSolidKmersPerBank[i]);}
-    //for(size_t i=0; i<_nbBanks; i++){ file->insert((long double)_nbDistinctKmersSharedByBanksThreshold[i]);}
-    //for(size_t i=0; i<_nbBanks; i++){ file->insert((long double)_nbKmersSharedByBanksThreshold[i]);}
+    for(size_t i=0; i<_nbBanks; i++){ file->write((long double)_nbSolidDistinctKmersPerBank[i]);}
+    for(size_t i=0; i<_nbBanks; i++){ file->write((long double)_nbKmersPerBank[i]);}
+    for(size_t i=0; i<_nbBanks; i++){ file->write((long double)_nbSolidKmersPerBank[i]);}
+    //for(size_t i=0; i<_nbBanks; i++){ file->write((long double)_nbDistinctKmersSharedByBanksThreshold[i]);}
+    //for(size_t i=0; i<_nbBanks; i++){ file->write((long double)_nbKmersSharedByBanksThreshold[i]);}
 
 
     for(size_t i=0; i<_nbBanks; i++){
     	//cout << i << endl;
     	//cout << _nbBanks << endl;
     	//cout << _matrixNbDistinctSharedKmers[i].size() << endl;
-            for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_matrixNbSharedKmers[i][j]);}
+            for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_matrixNbSharedKmers[i][j]);}
 
-            //for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_abundance_jaccard_intersection[i][j]);}
+            //for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_abundance_jaccard_intersection[i][j]);}
     }
 
 
     for(size_t i=0; i<_symetricDistanceMatrixSize; i++){
-        file->insert((long double)_matrixNbDistinctSharedKmers[i]);
-    	file->insert((long double)_brayCurtisNumerator[i]);
+        file->write((long double)_matrixNbDistinctSharedKmers[i]);
+    	file->write((long double)_brayCurtisNumerator[i]);
     }
 
 	if(_computeSimpleDistances){
-	    for(size_t i=0; i<_nbBanks; i++){ file->insert((long double)_chord_sqrt_N2[i]);}
+	    for(size_t i=0; i<_nbBanks; i++){ file->write((long double)_chord_sqrt_N2[i]);}
 	    for(size_t i=0; i<_nbBanks; i++){
-			for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_chord_NiNj[i][j]);}
-			for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_hellinger_SqrtNiNj[i][j]);}
-			for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_kulczynski_minNiNj[i][j]);}
+			for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_chord_NiNj[i][j]);}
+			for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_hellinger_SqrtNiNj[i][j]);}
+			for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_kulczynski_minNiNj[i][j]);}
 	    }
 	}
 
 
 	if(_computeComplexDistances){
 	    for(size_t i=0; i<_nbBanks; i++){
-			for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_canberra[i][j]);}
-			for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_whittaker_minNiNj[i][j]);}
-			for(size_t j=0; j<_nbBanks; j++){ file->insert((long double)_kullbackLeibler[i][j]);}
+			for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_canberra[i][j]);}
+			for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_whittaker_minNiNj[i][j]);}
+			for(size_t j=0; j<_nbBanks; j++){ file->write((long double)_kullbackLeibler[i][j]);}
 	    }
 	}
 	
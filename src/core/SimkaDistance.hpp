@@ -22,6 +22,7 @@
 #define TOOLS_SIMKA_SRC_SIMKADISTANCE_HPP_
 
 #include <gatb/gatb_core.hpp>
+#include "SimkaCodec.hpp"
 
 const string STR_SIMKA_DISTANCE_BRAYCURTIS = "-bray-curtis";
 const string STR_SIMKA_DISTANCE_CHORD = "-chord";
@@ -73,7 +74,7 @@ public:
 	SimkaStatistics& operator+=  (const SimkaStatistics& other);
 	void print();
 	void load(const string& filename);
-	void save(const string& filename);
+	void save(const string& filename, SimkaCodecType codec);
 	void outputMatrix(const string& outputDir, const vector<string>& _bankNames);
 
     size_t _nbBanks;
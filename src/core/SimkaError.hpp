@@ -0,0 +1,105 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKAERROR_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKAERROR_HPP_
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+
+
+/*********************************************************************
+* ** SimkaError
+*
+* Errors of the count and merge jobs are thrown as exceptions rather
+* than ending the process: with -in-process, the jobs run on threads of
+* simka, which reports the failed jobs and stops once the others are
+* done. simkaCount and simkaMerge catch them in main.
+*
+* A SimkaError keeps the first error of the helper threads of a job
+* (writer, readers, sort threads), where an exception can't leave the
+* thread. The thread body runs through run(), then the job calls check()
+* on its own thread to rethrow the error.
+*********************************************************************/
+class SimkaError
+{
+
+public:
+
+	SimkaError() : _isSet(false) {}
+
+	/** Throw the error of a job. */
+	static void raise(const std::string& message){
+		throw std::runtime_error(message);
+	}
+
+	/** Run f, keeping its exception if it throws.
+	 * \return false if f threw */
+	template<typename Function>
+	bool run(Function f){
+		try{
+			f();
+			return true;
+		}
+		catch(...){
+			set(std::current_exception());
+			return false;
+		}
+	}
+
+	void set(std::exception_ptr error){
+		std::unique_lock<std::mutex> lock(_mutex);
+		if(!_error) _error = error;
+		_isSet = true;
+	}
+
+	bool isSet() const { return _isSet.load(); }
+
+	/** Rethrow the first error, if any. */
+	void check(){
+		std::unique_lock<std::mutex> lock(_mutex);
+		if(_error) std::rethrow_exception(_error);
+	}
+
+	/** Message of an error caught with catch(...). */
+	static std::string getMessage(std::exception_ptr error){
+		try{
+			std::rethrow_exception(error);
+		}
+		catch(std::exception& e){
+			return e.what();
+		}
+		catch(...){
+			return "unknown error";
+		}
+	}
+
+private:
+
+	std::mutex _mutex;
+	std::exception_ptr _error;
+	std::atomic<bool> _isSet;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKAERROR_HPP_ */
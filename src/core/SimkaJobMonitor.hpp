@@ -0,0 +1,275 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKAJOBMONITOR_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKAJOBMONITOR_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/vfs.h>
+#endif
+
+//With inotify, pending jobs are still rescanned this often, for the network filesystems not detected
+#define SIMKA_JOB_MONITOR_RESCAN_SEC 5
+//Without inotify, or when the synchro directory is on a network filesystem, pending jobs are polled this often
+#define SIMKA_JOB_MONITOR_SLEEP_SEC 1
+
+
+/*********************************************************************
+* ** SimkaJobMonitor
+*
+* Tracks the running count or merge jobs of one phase and blocks until
+* at least one of them finishes, so that a job slot is refilled as soon
+* as it is released.
+*
+* A job is finished when its "<name>.ok" file exists in the synchro
+* directory. Local jobs are children of simka: their exit is observed
+* with waitpid (SIGCHLD), without any polling. Cluster jobs are observed
+* with inotify on the synchro directory, with a periodic rescan as a
+* fallback. On network filesystems (NFS, Lustre, GPFS...), which do not
+* notify the writes of other nodes, they are polled every second.
+*********************************************************************/
+class SimkaJobMonitor
+{
+
+public:
+
+	SimkaJobMonitor(const std::string& synchroDir){
+
+		_synchroDir = synchroDir;
+		if(!_synchroDir.empty() && _synchroDir[_synchroDir.size()-1] != '/') _synchroDir += "/";
+
+		_inotifyFd = -1;
+#ifdef __linux__
+		if(isNetworkFilesystem(_synchroDir)) return;
+
+		_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if(_inotifyFd >= 0){
+			if(inotify_add_watch(_inotifyFd, _synchroDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+				close(_inotifyFd);
+				_inotifyFd = -1;
+			}
+		}
+#endif
+	}
+
+	~SimkaJobMonitor(){
+		if(_inotifyFd >= 0) close(_inotifyFd);
+	}
+
+	size_t nbRunning() const { return _localJobs.size() + _remoteJobs.size(); }
+
+	/** Run a shell command as a child of simka. */
+	void launchLocal(const std::string& name, const std::string& command){
+
+		std::cout.flush();
+		std::cerr.flush();
+		fflush(NULL);
+
+		pid_t pid = fork();
+
+		if(pid == 0){
+			execl("/bin/sh", "sh", "-c", command.c_str(), (char*) 0);
+			_exit(127);
+		}
+
+		if(pid < 0){
+			std::cerr << "ERROR: can't start job " << name << " (" << strerror(errno) << ")" << std::endl;
+			_failedJobs.push_back(name);
+			return;
+		}
+
+		_localJobs[pid] = name;
+	}
+
+	/** Track a job started elsewhere (submitted to a cluster scheduler). */
+	void watch(const std::string& name){
+		_remoteJobs.insert(name);
+	}
+
+	/** Block until at least one job is finished (or failed).
+	 * \param[out] finished : names of the jobs that completed successfully
+	 * \param[out] failed : names of the jobs that exited without writing their synchro file */
+	void waitFinished(std::vector<std::string>& finished, std::vector<std::string>& failed){
+
+		finished.clear();
+		failed.swap(_failedJobs);
+		_failedJobs.clear();
+
+		if(!failed.empty()) return;
+
+		while(finished.empty() && failed.empty() && nbRunning() > 0){
+
+			if(!_localJobs.empty()){
+				waitLocal(finished, failed);
+			}
+			else{
+				waitRemote(finished);
+			}
+		}
+	}
+
+private:
+
+	bool isFinished(const std::string& name){
+		return access((_synchroDir + name + ".ok").c_str(), F_OK) == 0;
+	}
+
+	void reap(pid_t pid, int status, std::vector<std::string>& finished, std::vector<std::string>& failed){
+
+		std::map<pid_t, std::string>::iterator it = _localJobs.find(pid);
+		if(it == _localJobs.end()) return;
+
+		std::string name = it->second;
+		_localJobs.erase(it);
+
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0 && isFinished(name)){
+			finished.push_back(name);
+		}
+		else{
+			failed.push_back(name);
+		}
+	}
+
+	void waitLocal(std::vector<std::string>& finished, std::vector<std::string>& failed){
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if(pid < 0){
+			if(errno == EINTR) return;
+			//No child left: every tracked local job has been reaped elsewhere
+			for(std::map<pid_t, std::string>::iterator it=_localJobs.begin(); it!=_localJobs.end(); ++it){
+				if(isFinished(it->second)) finished.push_back(it->second);
+				else failed.push_back(it->second);
+			}
+			_localJobs.clear();
+			return;
+		}
+
+		reap(pid, status, finished, failed);
+
+		//Collect the other children that exited meanwhile
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+			reap(pid, status, finished, failed);
+		}
+	}
+
+	void waitRemote(std::vector<std::string>& finished){
+
+		if(_inotifyFd < 0){
+			sleep(SIMKA_JOB_MONITOR_SLEEP_SEC);
+			rescan(finished);
+			return;
+		}
+
+#ifdef __linux__
+		struct pollfd pfd;
+		pfd.fd = _inotifyFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		int ret = poll(&pfd, 1, SIMKA_JOB_MONITOR_RESCAN_SEC * 1000);
+
+		if(ret <= 0){
+			rescan(finished);
+			return;
+		}
+
+		char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		ssize_t len;
+
+		while((len = read(_inotifyFd, buffer, sizeof(buffer))) > 0){
+
+			for(char* ptr = buffer; ptr < buffer + len; ){
+
+				const struct inotify_event* event = (const struct inotify_event*) ptr;
+				ptr += sizeof(struct inotify_event) + event->len;
+
+				if(event->len == 0) continue;
+
+				std::string filename(event->name);
+				if(filename.size() <= 3 || filename.compare(filename.size()-3, 3, ".ok") != 0) continue;
+
+				std::string name = filename.substr(0, filename.size()-3);
+				if(_remoteJobs.erase(name) > 0){
+					finished.push_back(name);
+				}
+			}
+		}
+#endif
+	}
+
+	static bool isNetworkFilesystem(const std::string& dir){
+#ifdef __linux__
+		struct statfs st;
+		if(statfs(dir.c_str(), &st) != 0) return false;
+
+		switch((unsigned long) st.f_type){
+			case 0x6969:		//NFS
+			case 0xFF534D42:	//CIFS
+			case 0xFE534D42:	//SMB2
+			case 0x517B:		//SMB
+			case 0x0BD00BD0:	//Lustre
+			case 0x47504653:	//GPFS
+			case 0x19830326:	//BeeGFS
+			case 0x00C36400:	//CephFS
+			case 0x65735546:	//FUSE
+				return true;
+		}
+#endif
+		return false;
+	}
+
+	void rescan(std::vector<std::string>& finished){
+
+		for(std::set<std::string>::iterator it=_remoteJobs.begin(); it!=_remoteJobs.end(); ){
+			if(isFinished(*it)){
+				finished.push_back(*it);
+				_remoteJobs.erase(it++);
+			}
+			else{
+				++it;
+			}
+		}
+	}
+
+	std::string _synchroDir;
+	int _inotifyFd;
+	std::map<pid_t, std::string> _localJobs;
+	std::set<std::string> _remoteJobs;
+	std::vector<std::string> _failedJobs;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKAJOBMONITOR_HPP_ */
@@ -0,0 +1,948 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKAPARTITIONFILE_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKAPARTITIONFILE_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+#include "SimkaCodec.hpp"
+
+#define SIMKA_PARTITION_MAGIC "SKP1"
+#define SIMKA_PARTITION_INDEX_MAGIC "SKPI"
+//Payload size after which a block is closed
+#define SIMKA_PARTITION_BLOCK_SIZE (64*1024)
+//Index offset (8 bytes) and index magic (4 bytes) at the end of the file
+#define SIMKA_PARTITION_TRAILER_SIZE 12
+//Zeros after a decompressed block payload, so that decoding a varint never reads past the buffer
+#define SIMKA_PARTITION_PADDING 16
+#define SIMKA_PACK_MAGIC "SKPK"
+//Number of partitions (8 bytes) and pack magic (4 bytes) at the end of a pack file
+#define SIMKA_PACK_FOOTER_SIZE 12
+//K-mer values per block of a dense partition file
+#define SIMKA_DENSE_WINDOW_SIZE (1 << 16)
+
+
+/*********************************************************************
+* ** SimkaPartitionVarint
+*
+* LEB128 encoding of the counts, bank ids and k-mer deltas. K-mers wider
+* than 64 bits are encoded as a single varint over their 64-bit words.
+*********************************************************************/
+class SimkaPartitionVarint
+{
+
+public:
+
+	static inline void put(std::vector<u_int8_t>& buffer, u_int64_t value){
+		while(value >= 0x80){
+			buffer.push_back((u_int8_t)(value | 0x80));
+			value >>= 7;
+		}
+		buffer.push_back((u_int8_t)value);
+	}
+
+	static inline const u_int8_t* get(const u_int8_t* ptr, u_int64_t& value){
+		u_int64_t result = *ptr & 0x7F;
+		if(*ptr++ < 0x80){
+			value = result;
+			return ptr;
+		}
+		int shift = 7;
+		while(true){
+			u_int8_t byte = *ptr++;
+			result |= (u_int64_t)(byte & 0x7F) << shift;
+			if(byte < 0x80 || shift >= 63) break;
+			shift += 7;
+		}
+		value = result;
+		return ptr;
+	}
+
+	static void putWords(std::vector<u_int8_t>& buffer, const u_int64_t* words, size_t nbWords){
+
+		size_t top = nbWords;
+		while(top > 1 && words[top-1] == 0) top -= 1;
+		if(top == 1){
+			put(buffer, words[0]);
+			return;
+		}
+
+		size_t nbBits = (top-1)*64 + (64 - __builtin_clzll(words[top-1]));
+		for(size_t bit=0; bit<nbBits; bit+=7){
+			size_t word = bit / 64;
+			size_t offset = bit % 64;
+			u_int64_t chunk = words[word] >> offset;
+			if(offset > 57 && word+1 < nbWords) chunk |= words[word+1] << (64-offset);
+			chunk &= 0x7F;
+			if(bit+7 < nbBits) chunk |= 0x80;
+			buffer.push_back((u_int8_t)chunk);
+		}
+	}
+
+	static const u_int8_t* getWords(const u_int8_t* ptr, u_int64_t* words, size_t nbWords){
+
+		memset(words, 0, nbWords*sizeof(u_int64_t));
+
+		for(size_t bit=0; ; bit+=7){
+			u_int8_t byte = *ptr++;
+			u_int64_t chunk = byte & 0x7F;
+			size_t word = bit / 64;
+			size_t offset = bit % 64;
+			if(word < nbWords){
+				words[word] |= chunk << offset;
+				if(offset > 57 && word+1 < nbWords) words[word+1] |= chunk >> (64-offset);
+			}
+			if(byte < 0x80) break;
+		}
+
+		return ptr;
+	}
+};
+
+
+/*********************************************************************
+* ** SimkaPartitionFile
+*
+* Format of the partition files (solid/part_<p>/__p__<id>.gz, or .txt
+* when written with -codec none) written by simkaCount and the merges.
+*
+* header: magic, flags, codec, then the bank id (single bank files) or
+*         the number and the ids of the datasets merged in the file
+*         (multi bank files), the range of k-mer values (dense files),
+*         then the number of 64-bit words of a k-mer, all varints
+* blocks: number of records, raw and stored payload sizes (varints), then
+*         the payload compressed with the codec of the file. The payload
+*         holds the records: k-mer delta to the previous record of the
+*         block, bank id (multi bank files only) and count, all varints.
+*         The first k-mer of a block is stored as a delta to 0, so a block
+*         decodes on its own.
+* index:  number of blocks, then the offset delta, number of records
+*         and, in dense files, window of each block (varints)
+* trailer: offset of the index (8 bytes, little endian) and index magic
+*
+* Records are sorted by k-mer. A file without its trailer was not
+* finished and is rejected by the reader.
+*
+* Dense files are single bank files of small k-mers (see
+* SimkaDenseRanges) covering a range of k-mer values. A block is a window
+* of SIMKA_DENSE_WINDOW_SIZE values of the range: its payload is a bitmap
+* of the values with a count (8-byte words, little endian), then the
+* counts of these values in order (varints). Windows without k-mers have
+* no block. The reader gives their records like the ones of other files.
+*********************************************************************/
+template<typename Type>
+class SimkaPartitionFile
+{
+
+public:
+
+	static const u_int32_t MULTI_BANK = (u_int32_t) -1;
+	static const u_int8_t FLAG_MULTI_BANK = 1;
+	static const u_int8_t FLAG_DENSE = 2;
+	static const size_t DENSE_BITMAP_SIZE = SIMKA_DENSE_WINDOW_SIZE / 8;
+	static const size_t NB_WORDS = sizeof(Type) / sizeof(u_int64_t);
+
+	/** Split a k-mer into its 64-bit words, low word first. */
+	static void toWords(Type value, u_int64_t* words){
+		for(size_t i=0; i<NB_WORDS; i++){
+			words[i] = value.getVal();
+			if(i+1 < NB_WORDS) value = (value >> 32) >> 32;
+		}
+	}
+
+	static void fromWords(const u_int64_t* words, Type& value){
+		value.setVal(words[NB_WORDS-1]);
+		for(size_t i=NB_WORDS-1; i>0; i--){
+			Type word;
+			word.setVal(words[i-1]);
+			value = ((value << 32) << 32) + word;
+		}
+	}
+
+	static u_int64_t readU64(const u_int8_t* bytes){
+		u_int64_t value = 0;
+		for(size_t i=0; i<8; i++) value |= (u_int64_t)bytes[i] << (8*i);
+		return value;
+	}
+
+	/** Bounded varint read, for the headers and the index. */
+	static bool readVarint(const u_int8_t*& ptr, const u_int8_t* end, u_int64_t& value){
+		value = 0;
+		for(int shift=0; shift<64 && ptr<end; shift+=7){
+			u_int8_t byte = *ptr++;
+			value |= (u_int64_t)(byte & 0x7F) << shift;
+			if(byte < 0x80) return true;
+		}
+		return false;
+	}
+};
+
+
+/*********************************************************************
+* ** SimkaPackFile
+*
+* Format of the pack files (solid/packs/<stripe>/__p__<id>.pack) written
+* by simkaCount: one file per dataset instead of one partition file per
+* partition and per dataset.
+*
+* segments: the partition files of the dataset, one after the other
+* table:    offset and length of the segment of each partition (8 bytes
+*           each, little endian); a partition without segment has a
+*           length of 0
+* footer:   number of partitions (8 bytes, little endian) and pack magic
+*
+* A segment is a complete partition file, read through
+* SimkaPartitionReader(filename, offset, length).
+*********************************************************************/
+class SimkaPackFile
+{
+
+public:
+
+	/** Byte range of a partition in a pack file.
+	 * \return false if the pack has no segment for the partition */
+	static bool getRange(const std::string& filename, size_t partitionId, u_int64_t& offset, u_int64_t& length){
+
+		FILE* file = fopen(filename.c_str(), "rb");
+		if(file == NULL){
+			SimkaError::raise(std::string("can't open pack file ") + filename);
+		}
+
+		u_int8_t footer[SIMKA_PACK_FOOTER_SIZE];
+		if(fseeko(file, -SIMKA_PACK_FOOTER_SIZE, SEEK_END) != 0 || fread(footer, 1, SIMKA_PACK_FOOTER_SIZE, file) != SIMKA_PACK_FOOTER_SIZE || memcmp(footer + 8, SIMKA_PACK_MAGIC, 4) != 0){
+			SimkaError::raise(std::string("incomplete pack file ") + filename);
+		}
+
+		u_int64_t nbPartitions = readU64(footer);
+		if(partitionId >= nbPartitions){
+			SimkaError::raise(std::string("partition ") + std::to_string(partitionId) + " out of pack file " + filename);
+		}
+
+		u_int8_t entry[16];
+		off_t entryOffset = -(off_t)(SIMKA_PACK_FOOTER_SIZE + (nbPartitions - partitionId) * 16);
+		if(fseeko(file, entryOffset, SEEK_END) != 0 || fread(entry, 1, 16, file) != 16){
+			SimkaError::raise(std::string("invalid pack file ") + filename);
+		}
+		fclose(file);
+
+		offset = readU64(entry);
+		length = readU64(entry + 8);
+		return length > 0;
+	}
+
+	/** Give the blocks of a merged partition back to the file system (hole punching). The pack keeps
+	 * its size and index, the range reads as zeros. A pack linked elsewhere (count cache) is left as is.
+	 * \return false if nothing was released: linked pack, or no hole punching on this file system */
+	static bool release(const std::string& filename, size_t partitionId){
+
+		u_int64_t offset, length;
+		if(!getRange(filename, partitionId, offset, length)) return false;
+
+		bool isReleased = false;
+#ifdef __linux__
+		int fd = open(filename.c_str(), O_RDWR);
+		if(fd < 0) return false;
+
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_nlink == 1){
+			//Only the blocks within the range: the ones at its ends are shared with the next partitions
+			u_int64_t blockSize = st.st_blksize > 0 ? st.st_blksize : 4096;
+			u_int64_t start = (offset + blockSize - 1) / blockSize * blockSize;
+			u_int64_t end = (offset + length) / blockSize * blockSize;
+			isReleased = end > start && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == 0;
+		}
+		close(fd);
+#endif
+		return isReleased;
+	}
+
+private:
+
+	static u_int64_t readU64(const u_int8_t* bytes){
+		u_int64_t value = 0;
+		for(size_t i=0; i<8; i++) value |= (u_int64_t)bytes[i] << (8*i);
+		return value;
+	}
+};
+
+
+/*********************************************************************
+* ** SimkaPackWriter
+*
+* Writes the partition files of a dataset to a pack file, as their
+* SimkaPartitionWriter are flushed. The pack is complete once close has
+* been called.
+*********************************************************************/
+class SimkaPackWriter
+{
+
+public:
+
+	SimkaPackWriter(const std::string& filename, size_t nbPartitions){
+
+		_filename = filename;
+		_offset = 0;
+		_offsets.resize(nbPartitions, 0);
+		_lengths.resize(nbPartitions, 0);
+
+		_file = fopen(filename.c_str(), "wb");
+		if(_file == NULL){
+			SimkaError::raise(std::string("can't create pack file ") + filename);
+		}
+	}
+
+	/** Errors are thrown by an explicit close only: the destructor also runs while an error unwinds. */
+	~SimkaPackWriter(){
+		SimkaError().run([this](){ close(); });
+	}
+
+	const std::string& getFilename() const { return _filename; }
+	u_int64_t getSize() const { return _offset; }
+
+	/** Write a complete partition file at the end of the pack, from one thread at a time. */
+	void append(size_t partitionId, const u_int8_t* data, u_int64_t length){
+
+		fwrite(data, 1, length, _file);
+
+		_offsets[partitionId] = _offset;
+		_lengths[partitionId] = length;
+		_offset += length;
+	}
+
+	/** Write the table and the footer, and close the file. */
+	void close(){
+
+		if(_file == NULL) return;
+
+		for(size_t i=0; i<_offsets.size(); i++){
+			writeU64(_offsets[i]);
+			writeU64(_lengths[i]);
+		}
+		writeU64(_offsets.size());
+		fwrite(SIMKA_PACK_MAGIC, 1, 4, _file);
+
+		bool isOk = !ferror(_file);
+		if(fclose(_file) != 0) isOk = false;
+		_file = NULL;
+
+		if(!isOk){
+			SimkaError::raise(std::string("can't write pack file ") + _filename);
+		}
+	}
+
+private:
+
+	void writeU64(u_int64_t value){
+		u_int8_t bytes[8];
+		for(size_t i=0; i<8; i++) bytes[i] = (u_int8_t)(value >> (8*i));
+		fwrite(bytes, 1, 8, _file);
+	}
+
+	std::string _filename;
+	FILE* _file;
+	u_int64_t _offset;
+	std::vector<u_int64_t> _offsets;
+	std::vector<u_int64_t> _lengths;
+};
+
+
+/*********************************************************************
+* ** SimkaPartitionWriter
+*
+* Writes sorted (k-mer, bank id, count) records to a partition file.
+* The file is complete once flush has been called.
+*
+* The constructors taking a pack write the file as a segment of the pack
+* instead: it is kept in memory, then written to the pack by flush.
+*********************************************************************/
+template<typename Type>
+class SimkaPartitionWriter
+{
+
+public:
+
+	typedef SimkaPartitionFile<Type> File;
+
+	/** Single bank file.
+	 * \param[in] filename : file to create
+	 * \param[in] codec : compression of the blocks
+	 * \param[in] bankId : bank of every record of the file */
+	SimkaPartitionWriter(const std::string& filename, SimkaCodecType codec, u_int32_t bankId){
+		init(filename, NULL, 0, codec, bankId, std::vector<u_int32_t>(), false, 0, 0);
+	}
+
+	/** Dense file, the k-mers of [rangeStart, rangeEnd) must be inserted in increasing order.
+	 * \param[in] rangeStart : first k-mer value of the file
+	 * \param[in] rangeEnd : end (excluded) of the k-mer values of the file */
+	SimkaPartitionWriter(const std::string& filename, SimkaCodecType codec, u_int32_t bankId, u_int64_t rangeStart, u_int64_t rangeEnd){
+		init(filename, NULL, 0, codec, bankId, std::vector<u_int32_t>(), true, rangeStart, rangeEnd);
+	}
+
+	/** Multi bank file, the bank id of each record is stored.
+	 * \param[in] sources : ids of the datasets merged in the file */
+	SimkaPartitionWriter(const std::string& filename, SimkaCodecType codec, const std::vector<u_int32_t>& sources){
+		init(filename, NULL, 0, codec, File::MULTI_BANK, sources, false, 0, 0);
+	}
+
+	/** Single bank segment of a pack.
+	 * \param[in] pack : pack written by flush, which must not be called by two writers at the same time
+	 * \param[in] partitionId : partition of the segment in the pack */
+	SimkaPartitionWriter(SimkaPackWriter& pack, size_t partitionId, SimkaCodecType codec, u_int32_t bankId){
+		init("", &pack, partitionId, codec, bankId, std::vector<u_int32_t>(), false, 0, 0);
+	}
+
+	/** Dense segment of a pack. */
+	SimkaPartitionWriter(SimkaPackWriter& pack, size_t partitionId, SimkaCodecType codec, u_int32_t bankId, u_int64_t rangeStart, u_int64_t rangeEnd){
+		init("", &pack, partitionId, codec, bankId, std::vector<u_int32_t>(), true, rangeStart, rangeEnd);
+	}
+
+	/** Multi bank segment of a pack. */
+	SimkaPartitionWriter(SimkaPackWriter& pack, size_t partitionId, SimkaCodecType codec, const std::vector<u_int32_t>& sources){
+		init("", &pack, partitionId, codec, File::MULTI_BANK, sources, false, 0, 0);
+	}
+
+	/** Errors are thrown by an explicit flush only: the destructor also runs while an error unwinds. */
+	~SimkaPartitionWriter(){
+		SimkaError().run([this](){ flush(); });
+	}
+
+	const std::string& getFilename() const { return _filename; }
+	u_int64_t getNbRecords() const { return _nbRecords; }
+
+	void insert(const Type& kmer, u_int32_t bankId, u_int64_t count){
+
+		if(_isDense){
+			insertDense(kmer.getVal(), count);
+			return;
+		}
+
+		//The k-mers are stored as deltas: they must come in increasing order, the records of a k-mer
+		//following each other only in multi bank files
+		if(_nbRecords > 0 && (kmer < _lastKmer || (kmer == _lastKmer && !isMultiBank()))){
+			SimkaError::raise(std::string("k-mer out of order in partition file ") + _filename);
+		}
+
+		Type delta = kmer - _previous;
+		if(File::NB_WORDS == 1){
+			SimkaPartitionVarint::put(_payload, delta.getVal());
+		}
+		else{
+			u_int64_t words[File::NB_WORDS];
+			File::toWords(delta, words);
+			SimkaPartitionVarint::putWords(_payload, words, File::NB_WORDS);
+		}
+
+		if(isMultiBank()) SimkaPartitionVarint::put(_payload, bankId);
+		SimkaPartitionVarint::put(_payload, count);
+
+		_previous = kmer;
+		_lastKmer = kmer;
+		_nbBlockRecords += 1;
+		_nbRecords += 1;
+
+		if(_payload.size() >= SIMKA_PARTITION_BLOCK_SIZE) writeBlock();
+	}
+
+	/** Write the last block, the index and the trailer, and close the file. */
+	void flush(){
+
+		if(!_isOpen) return;
+		_isOpen = false;
+
+		writeBlock();
+
+		u_int64_t indexOffset = _offset;
+		std::vector<u_int8_t> index;
+		SimkaPartitionVarint::put(index, _blockRecords.size());
+		u_int64_t previousOffset = 0;
+		for(size_t i=0; i<_blockRecords.size(); i++){
+			SimkaPartitionVarint::put(index, _blockOffsets[i] - previousOffset);
+			SimkaPartitionVarint::put(index, _blockRecords[i]);
+			if(_isDense) SimkaPartitionVarint::put(index, _blockWindows[i]);
+			previousOffset = _blockOffsets[i];
+		}
+		for(size_t i=0; i<8; i++) index.push_back((u_int8_t)(indexOffset >> (8*i)));
+		index.insert(index.end(), SIMKA_PARTITION_INDEX_MAGIC, SIMKA_PARTITION_INDEX_MAGIC + 4);
+		write(&index[0], index.size());
+
+		if(_pack != NULL){
+			_pack->append(_partitionId, &_segment[0], _segment.size());
+			std::vector<u_int8_t>().swap(_segment);
+			return;
+		}
+
+		bool isOk = !ferror(_file);
+		if(fclose(_file) != 0) isOk = false;
+		_file = NULL;
+
+		if(!isOk){
+			SimkaError::raise(std::string("can't write partition file ") + _filename);
+		}
+	}
+
+private:
+
+	void init(const std::string& filename, SimkaPackWriter* pack, size_t partitionId, SimkaCodecType codec, u_int32_t bankId, const std::vector<u_int32_t>& sources, bool isDense, u_int64_t rangeStart, u_int64_t rangeEnd){
+
+		_filename = filename;
+		_pack = pack;
+		_partitionId = partitionId;
+		_file = NULL;
+		_isOpen = true;
+		_codec = codec;
+		_bankId = bankId;
+		_isDense = isDense;
+		_rangeStart = rangeStart;
+		_rangeEnd = rangeEnd;
+		_window = 0;
+		_previousValue = 0;
+		_nbRecords = 0;
+		_nbBlockRecords = 0;
+		_previous.setVal(0);
+		_lastKmer.setVal(0);
+
+		if(_pack != NULL){
+			_filename = _pack->getFilename();
+		}
+		else{
+			_file = fopen(filename.c_str(), "wb");
+			if(_file == NULL){
+				SimkaError::raise(std::string("can't create partition file ") + filename);
+			}
+		}
+
+		std::vector<u_int8_t> header;
+		header.insert(header.end(), SIMKA_PARTITION_MAGIC, SIMKA_PARTITION_MAGIC + 4);
+		header.push_back((isMultiBank() ? File::FLAG_MULTI_BANK : 0) | (_isDense ? File::FLAG_DENSE : 0));
+		header.push_back(_codec);
+		if(isMultiBank()){
+			SimkaPartitionVarint::put(header, sources.size());
+			for(size_t i=0; i<sources.size(); i++) SimkaPartitionVarint::put(header, sources[i]);
+		}
+		else{
+			SimkaPartitionVarint::put(header, _bankId);
+		}
+		if(_isDense){
+			SimkaPartitionVarint::put(header, _rangeStart);
+			SimkaPartitionVarint::put(header, _rangeEnd);
+			_bitmap.assign(File::DENSE_BITMAP_SIZE, 0);
+		}
+		SimkaPartitionVarint::put(header, File::NB_WORDS);
+		write(&header[0], header.size());
+
+		_offset = header.size();
+		_payload.reserve(SIMKA_PARTITION_BLOCK_SIZE + 64);
+	}
+
+	bool isMultiBank() const { return _bankId == File::MULTI_BANK; }
+
+	void write(const u_int8_t* data, size_t size){
+		if(_pack != NULL) _segment.insert(_segment.end(), data, data + size);
+		else fwrite(data, 1, size, _file);
+	}
+
+	void insertDense(u_int64_t value, u_int64_t count){
+
+		if(value < _rangeStart || value >= _rangeEnd || (_nbRecords > 0 && value <= _previousValue)){
+			SimkaError::raise(std::string("k-mer out of order or out of range in dense partition file ") + _filename);
+		}
+
+		u_int64_t offset = value - _rangeStart;
+		u_int64_t window = offset / SIMKA_DENSE_WINDOW_SIZE;
+		if(window != _window) writeBlock();
+		_window = window;
+
+		offset %= SIMKA_DENSE_WINDOW_SIZE;
+		_bitmap[offset / 8] |= (u_int8_t)(1 << (offset % 8));
+		SimkaPartitionVarint::put(_payload, count);
+
+		_previousValue = value;
+		_nbBlockRecords += 1;
+		_nbRecords += 1;
+	}
+
+	void writeBlock(){
+
+		if(_nbBlockRecords == 0) return;
+
+		//Dense blocks: the bitmap of the window, then the counts
+		const std::vector<u_int8_t>* raw = &_payload;
+		if(_isDense){
+			_raw.assign(_bitmap.begin(), _bitmap.end());
+			_raw.insert(_raw.end(), _payload.begin(), _payload.end());
+			raw = &_raw;
+			std::fill(_bitmap.begin(), _bitmap.end(), 0);
+			_blockWindows.push_back(_window);
+		}
+
+		const std::vector<u_int8_t>* stored = raw;
+		if(_codec != SIMKA_CODEC_NONE){
+			SimkaCodec::compress(_codec, &(*raw)[0], raw->size(), _stored);
+			stored = &_stored;
+		}
+
+		std::vector<u_int8_t> header;
+		SimkaPartitionVarint::put(header, _nbBlockRecords);
+		SimkaPartitionVarint::put(header, raw->size());
+		SimkaPartitionVarint::put(header, stored->size());
+		write(&header[0], header.size());
+		write(&(*stored)[0], stored->size());
+
+		_blockOffsets.push_back(_offset);
+		_blockRecords.push_back(_nbBlockRecords);
+		_offset += header.size() + stored->size();
+
+		_payload.clear();
+		_nbBlockRecords = 0;
+		_previous.setVal(0);
+	}
+
+	std::string _filename;
+	FILE* _file;
+	SimkaPackWriter* _pack;
+	size_t _partitionId;
+	std::vector<u_int8_t> _segment;
+	bool _isOpen;
+	SimkaCodecType _codec;
+	u_int32_t _bankId;
+	//Last k-mer of the block, reset by writeBlock, and last k-mer of the file
+	Type _previous;
+	Type _lastKmer;
+	std::vector<u_int8_t> _payload;
+	std::vector<u_int8_t> _raw;
+	std::vector<u_int8_t> _stored;
+	u_int64_t _nbBlockRecords;
+	u_int64_t _nbRecords;
+	u_int64_t _offset;
+	std::vector<u_int64_t> _blockOffsets;
+	std::vector<u_int64_t> _blockRecords;
+
+	bool _isDense;
+	u_int64_t _rangeStart;
+	u_int64_t _rangeEnd;
+	u_int64_t _window;
+	u_int64_t _previousValue;
+	std::vector<u_int8_t> _bitmap;
+	std::vector<u_int64_t> _blockWindows;
+};
+
+
+/*********************************************************************
+* ** SimkaPartitionReader
+*
+* Sequential reader of a partition file, through a memory mapping. The
+* records of uncompressed files are decoded in place, the blocks of
+* compressed files are decompressed one at a time.
+* Usage: for(reader.first(); !reader.isDone(); reader.next()) ...
+*********************************************************************/
+template<typename Type>
+class SimkaPartitionReader
+{
+
+public:
+
+	typedef SimkaPartitionFile<Type> File;
+
+	SimkaPartitionReader(const std::string& filename) : _file(filename){
+		init(filename);
+	}
+
+	/** Partition file stored in a byte range of a pack file. */
+	SimkaPartitionReader(const std::string& filename, u_int64_t offset, u_int64_t length) : _file(filename, offset, length){
+		init(filename);
+	}
+
+	u_int64_t getNbRecords() const { return _nbRecords; }
+	size_t getNbBlocks() const { return _blockOffsets.size(); }
+	SimkaCodecType getCodec() const { return _codec; }
+
+	/** Ids of the datasets whose records are in the file. */
+	const std::vector<u_int32_t>& getSources() const { return _sources; }
+
+	bool isDense() const { return _isDense; }
+	u_int64_t getRangeStart() const { return _rangeStart; }
+	u_int64_t getRangeEnd() const { return _rangeEnd; }
+
+	void first(){
+		_blockIndex = 0;
+		_nbBlockRecordsLeft = 0;
+		_isDone = !loadBlock();
+		if(!_isDone) decode();
+	}
+
+	void next(){
+		if(_nbBlockRecordsLeft == 0 && !loadBlock()){
+			_isDone = true;
+			return;
+		}
+		decode();
+	}
+
+	bool isDone() const { return _isDone; }
+
+	Type& kmer(){ return _kmer; }
+	u_int32_t bankId() const { return _bankId; }
+	u_int64_t& count(){ return _count; }
+
+	/** Window by window reading of a dense file, instead of record by record.
+	 * Usage: for(reader.firstWindow(); !reader.isDone(); reader.nextWindow()) ...
+	 * then, for each set bit of the bitmap words of the window, in order, nextCount(). */
+	void firstWindow(){
+		_blockIndex = 0;
+		_isDone = !loadBlock();
+	}
+
+	void nextWindow(){
+		_isDone = !loadBlock();
+	}
+
+	/** Index of the current window in the range of the file. */
+	u_int64_t window() const { return _window; }
+
+	inline u_int64_t bitmapWord(size_t i) const { return File::readU64(_bitmap + 8*i); }
+
+	inline u_int64_t nextCount(){
+		u_int64_t count;
+		_ptr = SimkaPartitionVarint::get(_ptr, count);
+		return count;
+	}
+
+private:
+
+	void init(const std::string& filename){
+
+		_filename = filename;
+		_nbRecords = 0;
+		_isDone = true;
+		_bankId = 0;
+		_count = 0;
+		_kmer.setVal(0);
+		_rangeStart = 0;
+		_rangeEnd = 0;
+		_window = 0;
+
+		readHeader();
+		readIndex();
+	}
+
+	void error(const std::string& message){
+		SimkaError::raise(message + " partition file " + _filename);
+	}
+
+	void readHeader(){
+
+		const u_int8_t* ptr = _file.data();
+		const u_int8_t* end = ptr + _file.size();
+
+		if(_file.size() < 6 || memcmp(ptr, SIMKA_PARTITION_MAGIC, 4) != 0) error("invalid");
+		_isMultiBank = (ptr[4] & File::FLAG_MULTI_BANK) != 0;
+		_isDense = (ptr[4] & File::FLAG_DENSE) != 0;
+		if(_isDense && _isMultiBank) error("invalid");
+		if(!SimkaCodec::isValid(ptr[5])) error("unknown codec in");
+		_codec = (SimkaCodecType) ptr[5];
+		ptr += 6;
+
+		u_int64_t value;
+		if(!_isMultiBank){
+			if(!File::readVarint(ptr, end, value)) error("invalid");
+			_bankId = value;
+			_sources.push_back(_bankId);
+		}
+		else{
+			u_int64_t nbSources;
+			if(!File::readVarint(ptr, end, nbSources)) error("invalid");
+			for(u_int64_t i=0; i<nbSources; i++){
+				if(!File::readVarint(ptr, end, value)) error("invalid");
+				_sources.push_back(value);
+			}
+		}
+
+		if(_isDense){
+			if(!File::readVarint(ptr, end, _rangeStart) || !File::readVarint(ptr, end, _rangeEnd)) error("invalid");
+		}
+
+		if(!File::readVarint(ptr, end, value) || value != File::NB_WORDS) error("k-mer size mismatch in");
+
+		_dataOffset = ptr - _file.data();
+	}
+
+	void readIndex(){
+
+		if(_file.size() < _dataOffset + SIMKA_PARTITION_TRAILER_SIZE) error("incomplete");
+
+		const u_int8_t* trailer = _file.data() + _file.size() - SIMKA_PARTITION_TRAILER_SIZE;
+		if(memcmp(trailer + 8, SIMKA_PARTITION_INDEX_MAGIC, 4) != 0) error("incomplete");
+
+		u_int64_t indexOffset = File::readU64(trailer);
+		if(indexOffset < _dataOffset || indexOffset > _file.size() - SIMKA_PARTITION_TRAILER_SIZE) error("invalid");
+		_dataEnd = indexOffset;
+
+		const u_int8_t* ptr = _file.data() + indexOffset;
+		u_int64_t nbBlocks, offset = 0, delta, nbRecords, window;
+		if(!File::readVarint(ptr, trailer, nbBlocks)) error("invalid");
+		for(u_int64_t i=0; i<nbBlocks; i++){
+			if(!File::readVarint(ptr, trailer, delta) || !File::readVarint(ptr, trailer, nbRecords)) error("invalid");
+			offset += delta;
+			if(offset < _dataOffset || offset >= _dataEnd) error("invalid");
+			_blockOffsets.push_back(offset);
+			_nbRecords += nbRecords;
+			if(_isDense){
+				if(!File::readVarint(ptr, trailer, window)) error("invalid");
+				_blockWindows.push_back(window);
+			}
+		}
+	}
+
+	bool loadBlock(){
+
+		while(_blockIndex < _blockOffsets.size()){
+
+			const u_int8_t* ptr = _file.data() + _blockOffsets[_blockIndex];
+			const u_int8_t* end = _file.data() + _dataEnd;
+			_blockIndex += 1;
+
+			u_int64_t rawSize, storedSize;
+			if(!File::readVarint(ptr, end, _nbBlockRecordsLeft) || !File::readVarint(ptr, end, rawSize) || !File::readVarint(ptr, end, storedSize)) error("invalid");
+			if(storedSize > (u_int64_t)(end - ptr)) error("truncated");
+
+			if(_codec == SIMKA_CODEC_NONE){
+				//The index and the trailer follow the last block: a varint never runs past the mapping
+				_ptr = ptr;
+			}
+			else{
+				_payload.resize(rawSize + SIMKA_PARTITION_PADDING);
+				if(!SimkaCodec::uncompress(_codec, ptr, storedSize, &_payload[0], rawSize)) error("corrupted");
+				memset(&_payload[rawSize], 0, SIMKA_PARTITION_PADDING);
+				_ptr = &_payload[0];
+			}
+
+			_word = 0;
+			_kmer.setVal(0);
+
+			if(_isDense){
+				if(rawSize < File::DENSE_BITMAP_SIZE) error("invalid");
+				_window = _blockWindows[_blockIndex-1];
+				_bitmap = _ptr;
+				_ptr += File::DENSE_BITMAP_SIZE;
+				_bitmapIndex = 0;
+				_bits = bitmapWord(0);
+			}
+
+			if(_nbBlockRecordsLeft > 0) return true;
+		}
+
+		return false;
+	}
+
+	inline void decode(){
+
+		u_int64_t value;
+
+		if(_isDense){
+			decodeDense();
+			return;
+		}
+
+		if(File::NB_WORDS == 1){
+			_ptr = SimkaPartitionVarint::get(_ptr, value);
+			_word += value;
+			_kmer.setVal(_word);
+		}
+		else{
+			u_int64_t words[File::NB_WORDS];
+			_ptr = SimkaPartitionVarint::getWords(_ptr, words, File::NB_WORDS);
+			Type delta;
+			File::fromWords(words, delta);
+			_kmer = _kmer + delta;
+		}
+
+		if(_isMultiBank){
+			_ptr = SimkaPartitionVarint::get(_ptr, value);
+			_bankId = value;
+		}
+
+		_ptr = SimkaPartitionVarint::get(_ptr, _count);
+		_nbBlockRecordsLeft -= 1;
+	}
+
+	/** The k-mer of a record of a dense file is given by the next set bit of the window bitmap. */
+	inline void decodeDense(){
+
+		while(_bits == 0){
+			_bitmapIndex += 1;
+			if(_bitmapIndex >= File::DENSE_BITMAP_SIZE / 8) error("corrupted");
+			_bits = bitmapWord(_bitmapIndex);
+		}
+
+		size_t bit = __builtin_ctzll(_bits);
+		_bits &= _bits - 1;
+
+		_word = _rangeStart + _window * SIMKA_DENSE_WINDOW_SIZE + _bitmapIndex * 64 + bit;
+		_kmer.setVal(_word);
+
+		_ptr = SimkaPartitionVarint::get(_ptr, _count);
+		_nbBlockRecordsLeft -= 1;
+	}
+
+	std::string _filename;
+	SimkaMappedFile _file;
+	bool _isMultiBank;
+	bool _isDense;
+	u_int64_t _rangeStart;
+	u_int64_t _rangeEnd;
+	std::vector<u_int64_t> _blockWindows;
+	SimkaCodecType _codec;
+	std::vector<u_int32_t> _sources;
+	u_int64_t _dataOffset;
+	u_int64_t _dataEnd;
+	u_int64_t _nbRecords;
+	std::vector<u_int64_t> _blockOffsets;
+
+	size_t _blockIndex;
+	std::vector<u_int8_t> _payload;
+	const u_int8_t* _ptr;
+	u_int64_t _nbBlockRecordsLeft;
+	bool _isDone;
+
+	u_int64_t _window;
+	const u_int8_t* _bitmap;
+	size_t _bitmapIndex;
+	u_int64_t _bits;
+
+	u_int64_t _word;
+	Type _kmer;
+	u_int32_t _bankId;
+	u_int64_t _count;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKAPARTITIONFILE_HPP_ */
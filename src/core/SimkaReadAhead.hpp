@@ -0,0 +1,681 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKAREADAHEAD_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKAREADAHEAD_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <zlib.h>
+#include "SimkaError.hpp"
+
+//Reads handed at once by the read-ahead thread to the k-mer stage
+#define SIMKA_READ_AHEAD_BATCH_SIZE 4096
+//Batches of reads parsed ahead of the k-mer stage
+#define SIMKA_READ_AHEAD_NB_BATCHES 16
+//Blocks of a BGZF file read ahead of the parser (at most 64 KB compressed and 64 KB inflated each)
+#define SIMKA_BGZF_NB_BLOCKS 64
+
+
+/*********************************************************************
+* ** SimkaBgzfReader
+*
+* Text of a BGZF file (bgzip, samtools): a series of gzip members of at
+* most 64 KB, each giving its compressed size in a 'BC' extra field. A
+* thread reads the members ahead, nbThreads threads inflate them, and read returns their text in file order. An error of
+* these threads ends the file and is thrown by read.
+*
+* Plain gzip files can't be split without inflating them: they are read
+* by the GATB banks.
+*********************************************************************/
+class SimkaBgzfReader
+{
+
+public:
+
+	SimkaBgzfReader(const string& filename, size_t nbThreads) : _filename(filename){
+		_nbThreads = std::max(nbThreads, (size_t)1);
+		_file = NULL;
+		_current = 0;
+		_isStopped = false;
+		_isEof = false;
+	}
+
+	~SimkaBgzfReader(){
+		close();
+		for(size_t i=0; i<_freeBlocks.size(); i++) delete _freeBlocks[i];
+	}
+
+	/** \return true if the file starts with a BGZF member */
+	static bool isBgzf(const string& filename){
+
+		FILE* file = fopen(filename.c_str(), "rb");
+		if(file == NULL) return false;
+
+		u_int32_t blockSize;
+		bool isBgzf = readHeader(file, blockSize);
+		fclose(file);
+		return isBgzf;
+	}
+
+	/** Files read by a bank: the lines of a GATB album, or the file itself if it holds reads. */
+	static std::vector<string> getBankFiles(const string& filename){
+
+		std::vector<string> filenames;
+		if(filename.empty()) return filenames;
+
+		std::ifstream file(filename.c_str());
+		int c = file.peek();
+		if(c == '>' || c == '@' || c == 31){
+			filenames.push_back(filename);
+			return filenames;
+		}
+
+		string line;
+		while(getline(file, line)){
+			if(!line.empty() && line[line.size()-1] == '\r') line.resize(line.size()-1);
+			if(line != "") filenames.push_back(line);
+		}
+		return filenames;
+	}
+
+	/** Start reading the file from its beginning. */
+	void open(){
+
+		close();
+
+		_file = fopen(_filename.c_str(), "rb");
+		if(_file == NULL){
+			SimkaError::raise(std::string("can't open ") + _filename);
+		}
+
+		_isStopped = false;
+		_isEof = false;
+
+		_reader = std::thread(&SimkaBgzfReader::readBlocks, this);
+		for(size_t i=0; i<_nbThreads; i++) _inflaters.push_back(std::thread(&SimkaBgzfReader::inflateBlocks, this));
+	}
+
+	void close(){
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_isStopped = true;
+		}
+		_canRead.notify_all();
+		_canInflate.notify_all();
+
+		if(_reader.joinable()) _reader.join();
+		for(size_t i=0; i<_inflaters.size(); i++) _inflaters[i].join();
+		_inflaters.clear();
+
+		if(_current != 0) _freeBlocks.push_back(_current);
+		_current = 0;
+		for(size_t i=0; i<_blocks.size(); i++) _freeBlocks.push_back(_blocks[i]);
+		_blocks.clear();
+		_toInflate.clear();
+
+		if(_file != NULL) fclose(_file);
+		_file = NULL;
+	}
+
+	/** Text of the next member, valid until the next call.
+	 * \return false at the end of the file */
+	bool read(const char*& text, size_t& size){
+
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		if(_current != 0) _freeBlocks.push_back(_current);
+		_current = 0;
+
+		_canConsume.wait(lock, [this]{ return (!_blocks.empty() && _blocks.front()->_isInflated) || (_isEof && _blocks.empty()); });
+		_error.check();
+		if(_blocks.empty()) return false;
+
+		_current = _blocks.front();
+		_blocks.pop_front();
+		_canRead.notify_one();
+
+		text = _current->_text.data();
+		size = _current->_text.size();
+		return true;
+	}
+
+private:
+
+	struct Block{
+		std::vector<unsigned char> _data;
+		std::string _text;
+		bool _isInflated;
+	};
+
+	/** Read the gzip header of a member, up to the end of its extra field.
+	 * \param[out] blockSize : size of the member minus one ('BC' field)
+	 * \return false at the end of the file or if the member has no 'BC' field */
+	static bool readHeader(FILE* file, u_int32_t& blockSize){
+
+		unsigned char header[12];
+		if(fread(header, 1, 12, file) != 12) return false;
+
+		//Magic, deflate, FEXTRA
+		if(header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0) return false;
+
+		size_t extraSize = header[10] | (header[11] << 8);
+		std::vector<unsigned char> extra(extraSize);
+		if(fread(extra.data(), 1, extraSize, file) != extraSize) return false;
+
+		for(size_t i=0; i+4<=extraSize; ){
+			size_t fieldSize = extra[i+2] | (extra[i+3] << 8);
+			if(extra[i] == 'B' && extra[i+1] == 'C' && fieldSize == 2 && i+6 <= extraSize){
+				blockSize = extra[i+4] | (extra[i+5] << 8);
+				return blockSize + 1 >= 12 + extraSize + 8;
+			}
+			i += 4 + fieldSize;
+		}
+
+		return false;
+	}
+
+	void readBlocks(){
+
+		while(true){
+
+			Block* block;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_canRead.wait(lock, [this]{ return _isStopped || _blocks.size() < SIMKA_BGZF_NB_BLOCKS; });
+				if(_isStopped) return;
+
+				if(_freeBlocks.empty()){
+					block = new Block();
+				}
+				else{
+					block = _freeBlocks.back();
+					_freeBlocks.pop_back();
+				}
+			}
+
+			bool isRead = false;
+			_error.run([&](){ isRead = readBlock(block); });
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if(!isRead){
+					_freeBlocks.push_back(block);
+					_isEof = true;
+				}
+				else{
+					block->_isInflated = false;
+					_blocks.push_back(block);
+					_toInflate.push_back(block);
+				}
+			}
+
+			if(!isRead){
+				_canInflate.notify_all();
+				_canConsume.notify_all();
+				return;
+			}
+			_canInflate.notify_one();
+		}
+	}
+
+	/** \return false at the end of the file */
+	bool readBlock(Block* block){
+
+		long start = ftell(_file);
+		u_int32_t blockSize;
+
+		if(!readHeader(_file, blockSize)){
+			if(feof(_file) && ftell(_file) == start) return false;
+			SimkaError::raise(std::string("corrupted BGZF member at offset ") + std::to_string(start) + " of " + _filename);
+		}
+
+		//Deflate data, CRC32 and inflated size
+		size_t dataSize = blockSize + 1 - (ftell(_file) - start);
+		block->_data.resize(dataSize);
+		if(fread(block->_data.data(), 1, dataSize, _file) != dataSize){
+			SimkaError::raise(std::string("truncated BGZF member at offset ") + std::to_string(start) + " of " + _filename);
+		}
+
+		return true;
+	}
+
+	void inflateBlocks(){
+
+		while(true){
+
+			Block* block;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_canInflate.wait(lock, [this]{ return _isStopped || _isEof || !_toInflate.empty(); });
+				if(_isStopped || _toInflate.empty()) return;
+
+				block = _toInflate.front();
+				_toInflate.pop_front();
+			}
+
+			bool isInflated = _error.run([&](){ inflateBlock(block); });
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				block->_isInflated = true;
+				if(!isInflated) _isEof = true;
+			}
+			_canConsume.notify_one();
+		}
+	}
+
+	void inflateBlock(Block* block){
+
+		const unsigned char* trailer = block->_data.data() + block->_data.size() - 8;
+		u_int32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((u_int32_t)trailer[3] << 24);
+		u_int32_t textSize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((u_int32_t)trailer[7] << 24);
+
+		block->_text.resize(textSize);
+
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		inflateInit2(&stream, -15);
+		stream.next_in = block->_data.data();
+		stream.avail_in = block->_data.size() - 8;
+		stream.next_out = (Bytef*) &block->_text[0];
+		stream.avail_out = textSize;
+		int result = inflate(&stream, Z_FINISH);
+		u_int64_t nbInflated = stream.total_out;
+		inflateEnd(&stream);
+
+		if(result != Z_STREAM_END || nbInflated != textSize || crc32(0, (const Bytef*) block->_text.data(), textSize) != crc){
+			SimkaError::raise(std::string("corrupted BGZF member in ") + _filename);
+		}
+	}
+
+	string _filename;
+	size_t _nbThreads;
+	FILE* _file;
+
+	std::thread _reader;
+	std::vector<std::thread> _inflaters;
+
+	std::mutex _mutex;
+	std::condition_variable _canRead;
+	std::condition_variable _canInflate;
+	std::condition_variable _canConsume;
+
+	//Blocks in file order, the inflated ones first
+	std::deque<Block*> _blocks;
+	std::deque<Block*> _toInflate;
+	std::vector<Block*> _freeBlocks;
+	Block* _current;
+	bool _isStopped;
+	bool _isEof;
+	SimkaError _error;
+};
+
+
+/*********************************************************************
+* ** SimkaBgzfIterator
+*
+* Reads of a FASTA or FASTQ file compressed with BGZF, parsed from the
+* text of SimkaBgzfReader. FASTQ records are 4 lines, FASTA sequences
+* may span several lines.
+*********************************************************************/
+class SimkaBgzfIterator : public Iterator<Sequence>
+{
+
+public:
+
+	SimkaBgzfIterator(const string& filename, size_t nbThreads) : _reader(filename, nbThreads){
+		_isDone = true;
+		_index = 0;
+		_text = 0;
+		_size = 0;
+		_pos = 0;
+	}
+
+	void first(){
+
+		_reader.open();
+		_text = 0;
+		_size = 0;
+		_pos = 0;
+		_index = 0;
+		_isDone = false;
+
+		_header.clear();
+		while(_header.empty() && getLine(_header));
+
+		next();
+	}
+
+	void next(){
+
+		if(_header.empty() || (_header[0] != '>' && _header[0] != '@')){
+			_isDone = true;
+			_reader.close();
+			return;
+		}
+
+		_data.clear();
+		_comment.assign(_header, 1, string::npos);
+
+		if(_header[0] == '@'){
+			getLine(_data);
+			getLine(_line);
+			getLine(_quality);
+			this->_item->setQuality(_quality);
+
+			_header.clear();
+			while(_header.empty() && getLine(_header));
+		}
+		else{
+			_header.clear();
+			while(getLine(_line)){
+				if(!_line.empty() && _line[0] == '>'){
+					_header = _line;
+					break;
+				}
+				_data += _line;
+			}
+		}
+
+		this->_item->setComment(_comment);
+		this->_item->getData().setRef((char*) _data.data(), _data.size());
+		this->_item->setIndex(_index);
+		_index += 1;
+	}
+
+	bool isDone(){ return _isDone; }
+
+	Sequence& item(){ return *(this->_item); }
+
+private:
+
+	/** \return false at the end of the file */
+	bool getLine(string& line){
+
+		line.clear();
+
+		while(true){
+
+			if(_pos == _size){
+				if(!_reader.read(_text, _size)) return !line.empty();
+				_pos = 0;
+				continue;
+			}
+
+			const char* end = (const char*) memchr(_text + _pos, '\n', _size - _pos);
+			if(end == NULL){
+				line.append(_text + _pos, _size - _pos);
+				_pos = _size;
+				continue;
+			}
+
+			line.append(_text + _pos, end - (_text + _pos));
+			_pos = end - _text + 1;
+			if(!line.empty() && line[line.size()-1] == '\r') line.resize(line.size()-1);
+			return true;
+		}
+	}
+
+	SimkaBgzfReader _reader;
+	bool _isDone;
+	u_int64_t _index;
+
+	const char* _text;
+	size_t _size;
+	size_t _pos;
+
+	string _header;
+	string _comment;
+	string _line;
+	string _data;
+	string _quality;
+};
+
+
+/*********************************************************************
+* ** SimkaReadAheadIterator
+*
+* Runs iterators of reads on their own threads, SIMKA_READ_AHEAD_NB_BATCHES
+* batches ahead of the consumer: the parsing, the inflating of gzip files
+* and the read filters no longer take the time of the threads extracting
+* the k-mers. The batches are reused, so the queue is bounded.
+*
+* With several iterators (the files of a dataset), up to nbStreams of
+* them are read at the same time and their batches are interleaved: the
+* reads come in no particular order.
+*
+* item() is the read stored in the batch, not a copy: it stays valid
+* until the next call to next().
+*
+* The first error of the iterators ends the reads and is kept in the
+* SimkaError given by the owner, to be thrown once they are consumed.
+*********************************************************************/
+class SimkaReadAheadIterator : public Iterator<Sequence>
+{
+
+public:
+
+	/** \param[in] nbStreams : iterators read at the same time, one thread each */
+	SimkaReadAheadIterator(const std::vector<Iterator<Sequence>*>& refs, size_t nbStreams, SimkaError& error) : _refs(refs), _error(error){
+		_nbStreams = std::max(nbStreams, (size_t)1);
+		for(size_t i=0; i<_refs.size(); i++) _refs[i]->use();
+		_batch = 0;
+		_pos = 0;
+		_isDone = true;
+		_isStopped = false;
+		_isFinished = false;
+		_nextRef = 0;
+		_nbRunning = 0;
+		for(size_t i=0; i<SIMKA_READ_AHEAD_NB_BATCHES; i++) _freeBatches.push_back(new Batch());
+	}
+
+	~SimkaReadAheadIterator(){
+		stop();
+		for(size_t i=0; i<_freeBatches.size(); i++) delete _freeBatches[i];
+		for(size_t i=0; i<_refs.size(); i++) _refs[i]->forget();
+	}
+
+	void first(){
+
+		stop();
+
+		_isStopped = false;
+		_isDone = false;
+		_nextRef = 0;
+		_nbRunning = std::min(_refs.size(), _nbStreams);
+		_isFinished = _nbRunning == 0;
+		for(size_t i=0; i<_nbRunning; i++) _threads.push_back(std::thread(&SimkaReadAheadIterator::readAhead, this));
+
+		_pos = 0;
+		nextBatch();
+	}
+
+	void next(){
+
+		if(_batch == 0) return;
+
+		_pos += 1;
+		if(_pos < _batch->_size){
+			this->setItem(_batch->_reads[_pos]);
+			return;
+		}
+
+		_pos = 0;
+		nextBatch();
+	}
+
+	bool isDone(){ return _isDone; }
+
+	Sequence& item(){ return *(this->_item); }
+
+private:
+
+	struct Batch{
+		Batch() : _reads(SIMKA_READ_AHEAD_BATCH_SIZE), _size(0) {}
+		std::vector<Sequence> _reads;
+		size_t _size;
+	};
+
+	void nextBatch(){
+
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		if(_batch != 0){
+			_freeBatches.push_back(_batch);
+			_canRead.notify_one();
+		}
+
+		_canConsume.wait(lock, [this]{ return !_readyBatches.empty() || _isFinished; });
+
+		if(_readyBatches.empty()){
+			_batch = 0;
+			_isDone = true;
+			return;
+		}
+
+		_batch = _readyBatches.front();
+		_readyBatches.pop_front();
+		this->setItem(_batch->_reads[0]);
+	}
+
+	/** Read the iterators not taken yet by the other threads, one at a time. */
+	void readAhead(){
+
+		while(true){
+
+			Iterator<Sequence>* ref;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if(_isStopped) return;
+				if(_nextRef == _refs.size() || _error.isSet()) break;
+				ref = _refs[_nextRef];
+				_nextRef += 1;
+			}
+
+			bool isRead = true;
+			if(!_error.run([&](){ isRead = readStream(ref); })) break;
+			if(!isRead) return;
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_nbRunning -= 1;
+			_isFinished = _nbRunning == 0;
+		}
+		_canConsume.notify_all();
+	}
+
+	/** \return false if the iterator was stopped */
+	bool readStream(Iterator<Sequence>* ref){
+
+		Batch* batch = 0;
+
+		try{
+			for(ref->first(); !ref->isDone(); ref->next()){
+
+				if(batch == 0){
+					std::unique_lock<std::mutex> lock(_mutex);
+					_canRead.wait(lock, [this]{ return _isStopped || !_freeBatches.empty(); });
+					if(_isStopped) return false;
+
+					batch = _freeBatches.back();
+					_freeBatches.pop_back();
+					batch->_size = 0;
+				}
+
+				batch->_reads[batch->_size] = ref->item();
+				batch->_size += 1;
+
+				if(batch->_size == SIMKA_READ_AHEAD_BATCH_SIZE){
+					push(batch);
+					batch = 0;
+				}
+			}
+		}
+		catch(...){
+			if(batch != 0){
+				std::unique_lock<std::mutex> lock(_mutex);
+				_freeBatches.push_back(batch);
+			}
+			throw;
+		}
+
+		if(batch != 0) push(batch);
+		return true;
+	}
+
+	void push(Batch* batch){
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_readyBatches.push_back(batch);
+		}
+		_canConsume.notify_one();
+	}
+
+	void stop(){
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_isStopped = true;
+		}
+		_canRead.notify_all();
+		for(size_t i=0; i<_threads.size(); i++) _threads[i].join();
+		_threads.clear();
+
+		if(_batch != 0) _freeBatches.push_back(_batch);
+		_batch = 0;
+		for(size_t i=0; i<_readyBatches.size(); i++) _freeBatches.push_back(_readyBatches[i]);
+		_readyBatches.clear();
+	}
+
+	std::vector<Iterator<Sequence>*> _refs;
+	SimkaError& _error;
+	std::vector<std::thread> _threads;
+	size_t _nbStreams;
+	size_t _nextRef;
+	size_t _nbRunning;
+
+	std::mutex _mutex;
+	std::condition_variable _canRead;
+	std::condition_variable _canConsume;
+
+	std::deque<Batch*> _readyBatches;
+	std::vector<Batch*> _freeBatches;
+	Batch* _batch;
+	size_t _pos;
+	bool _isDone;
+	bool _isStopped;
+	bool _isFinished;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKAREADAHEAD_HPP_ */
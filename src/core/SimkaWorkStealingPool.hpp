@@ -0,0 +1,277 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TOOLS_SIMKA_SRC_CORE_SIMKAWORKSTEALINGPOOL_HPP_
+#define TOOLS_SIMKA_SRC_CORE_SIMKAWORKSTEALINGPOOL_HPP_
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include "SimkaError.hpp"
+
+
+/*********************************************************************
+* ** SimkaWorkStealingPool
+*
+* Fixed set of worker threads, each owning a deque of tasks.
+* A worker pops its own tasks from the back and, when it runs dry,
+* steals from the front of the other workers' deques. Tasks submitted
+* from inside a task go to the deque of the calling worker. The number
+* of workers running a task at the same time can be lowered at runtime.
+*
+* An exception escaping a task is caught by its worker and its message
+* kept for getErrors, so that a failed job never ends the process.
+*
+* Used by simka to run count and merge jobs in-process instead of
+* spawning one simkaCount/simkaMerge process per job.
+*********************************************************************/
+class SimkaWorkStealingPool
+{
+
+public:
+
+	typedef std::function<void()> Task;
+
+	SimkaWorkStealingPool(size_t nbWorkers){
+
+		if(nbWorkers == 0) nbWorkers = 1;
+
+		_nbQueued = 0;
+		_nbPending = 0;
+		_nbActive = 0;
+		_maxActive = nbWorkers;
+		_nextWorker = 0;
+		_stop = false;
+
+		for(size_t i=0; i<nbWorkers; i++){
+			_workers.push_back(new Worker());
+		}
+
+		for(size_t i=0; i<nbWorkers; i++){
+			_threads.push_back(std::thread(&SimkaWorkStealingPool::run, this, i));
+		}
+	}
+
+	~SimkaWorkStealingPool(){
+
+		join();
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_taskCond.notify_all();
+
+		for(size_t i=0; i<_threads.size(); i++){
+			_threads[i].join();
+		}
+
+		for(size_t i=0; i<_workers.size(); i++){
+			delete _workers[i];
+		}
+	}
+
+	size_t nbWorkers() const { return _workers.size(); }
+
+	/** Number of workers currently running a task. */
+	size_t nbActive(){
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _nbActive;
+	}
+
+	/** Let at most maxActive workers (at least 1) run tasks at the same time.
+	 * Running tasks are not interrupted when the value is lowered. */
+	void setMaxActive(size_t maxActive){
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_maxActive = std::max(maxActive, (size_t)1);
+		}
+		_taskCond.notify_all();
+	}
+
+	/** Queue a task. From a worker thread, the task goes to that worker's own deque,
+	 * otherwise tasks are spread round-robin over the workers. */
+	void submit(const Task& task){
+
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+
+			size_t workerId;
+			CurrentWorker& current = currentWorker();
+			if(current._pool == this){
+				workerId = current._id;
+			}
+			else{
+				workerId = _nextWorker;
+				_nextWorker = (_nextWorker + 1) % _workers.size();
+			}
+
+			{
+				std::unique_lock<std::mutex> workerLock(_workers[workerId]->_mutex);
+				_workers[workerId]->_tasks.push_back(task);
+			}
+
+			_nbQueued += 1;
+			_nbPending += 1;
+		}
+
+		_taskCond.notify_one();
+	}
+
+	/** Messages of the exceptions thrown by the tasks so far. */
+	std::vector<std::string> getErrors(){
+		std::unique_lock<std::mutex> lock(_mutex);
+		return _errors;
+	}
+
+	/** Block until every submitted task (including tasks submitted by tasks) is finished. */
+	void join(){
+		std::unique_lock<std::mutex> lock(_mutex);
+		while(_nbPending > 0){
+			_idleCond.wait(lock);
+		}
+	}
+
+	/** Same as join, but give up after timeoutSec seconds.
+	 * \return true if every task is finished */
+	bool join(unsigned int timeoutSec){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_idleCond.wait_for(lock, std::chrono::seconds(timeoutSec), [this](){ return _nbPending == 0; });
+		return _nbPending == 0;
+	}
+
+private:
+
+	struct Worker{
+		std::deque<Task> _tasks;
+		std::mutex _mutex;
+	};
+
+	struct CurrentWorker{
+		SimkaWorkStealingPool* _pool;
+		size_t _id;
+	};
+
+	static CurrentWorker& currentWorker(){
+		static thread_local CurrentWorker current = {0, 0};
+		return current;
+	}
+
+	bool popTask(size_t workerId, Task& task){
+
+		{
+			Worker* worker = _workers[workerId];
+			std::unique_lock<std::mutex> lock(worker->_mutex);
+			if(!worker->_tasks.empty()){
+				task = worker->_tasks.back();
+				worker->_tasks.pop_back();
+				return true;
+			}
+		}
+
+		for(size_t i=1; i<_workers.size(); i++){
+			Worker* victim = _workers[(workerId + i) % _workers.size()];
+			std::unique_lock<std::mutex> lock(victim->_mutex);
+			if(!victim->_tasks.empty()){
+				task = victim->_tasks.front();
+				victim->_tasks.pop_front();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void run(size_t workerId){
+
+		currentWorker()._pool = this;
+		currentWorker()._id = workerId;
+
+		while(true){
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				while(!_stop && (_nbQueued == 0 || _nbActive >= _maxActive)){
+					_taskCond.wait(lock);
+				}
+				if(_stop && _nbQueued == 0) return;
+				_nbActive += 1;
+			}
+
+			Task task;
+
+			if(popTask(workerId, task)){
+
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_nbQueued -= 1;
+				}
+
+				try{
+					task();
+				}
+				catch(...){
+					std::string message = SimkaError::getMessage(std::current_exception());
+					std::unique_lock<std::mutex> lock(_mutex);
+					_errors.push_back(message);
+				}
+
+				bool isIdle = false;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_nbPending -= 1;
+					_nbActive -= 1;
+					isIdle = (_nbPending == 0);
+				}
+				if(isIdle) _idleCond.notify_all();
+				_taskCond.notify_one();
+
+				continue;
+			}
+
+			//Another worker took the task meanwhile
+			std::unique_lock<std::mutex> lock(_mutex);
+			_nbActive -= 1;
+		}
+	}
+
+	std::vector<Worker*> _workers;
+	std::vector<std::thread> _threads;
+
+	std::mutex _mutex;
+	std::condition_variable _taskCond;
+	std::condition_variable _idleCond;
+	size_t _nbQueued;
+	size_t _nbPending;
+	size_t _nbActive;
+	size_t _maxActive;
+	size_t _nextWorker;
+	bool _stop;
+	std::vector<std::string> _errors;
+};
+
+
+#endif /* TOOLS_SIMKA_SRC_CORE_SIMKAWORKSTEALINGPOOL_HPP_ */
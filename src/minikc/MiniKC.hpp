@@ -9,86 +9,266 @@
 #define GATB_SIMKA_SRC_MINIKC_MINIKC_HPP_
 
 #include <gatb/gatb_core.hpp>
+#include <SimkaPartitionFile.hpp>
+#include <SimkaDenseRanges.hpp>
+#include <SimkaComplexity.hpp>
+#include "MiniKCCounts.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <limits>
 //#include "../SimkaCount.cpp"
 
 //typedef u_int16_t CountType;
 
+//Records of a partition given at once by a count thread to the writer thread
+#define SIMKA_COUNT_BUFFER_SIZE 4096
+//Buffers given to the writer thread and not written yet, above which the count threads wait
+#define SIMKA_COUNT_MAX_PENDING_BUFFERS 256
+
+/** Writes the counts of a count job to its partition files from a single thread. The count threads
+ * give it full buffers of records through a queue; the writer sleeps while the queue is empty, and the
+ * count threads while SIMKA_COUNT_MAX_PENDING_BUFFERS are not written yet. The bank of a record is its
+ * index in the datasets of the job (one dataset, or the group of a joint count). */
 template<size_t span>
-class SimkaCompressedProcessor : public CountProcessorAbstract<span>{
+class SimkaCountWriter{
 
 public:
 
     typedef typename Kmer<span>::Type  Type;
-    typedef typename Kmer<span>::Count Count;
 
-    struct Kmer_BankId_Count{
-		Type _type;
-		u_int32_t _bankId;
-		u_int64_t _count;
+	struct Record{
+		Record(const Type& kmer, u_int32_t bank, CountNumber count) : _kmer(kmer), _bank(bank), _count(count) {}
+		Type _kmer;
+		u_int32_t _bank;
+		CountNumber _count;
+	};
+
+	/** _isLast: the last buffer of the partition, its file is flushed once written */
+	struct Buffer{
+		Buffer(size_t partId) : _partId(partId), _isLast(false) { _records.reserve(SIMKA_COUNT_BUFFER_SIZE); }
+		size_t _partId;
+		bool _isLast;
+		vector<Record> _records;
+	};
+
+	/** \param[in] bankIds : id of each dataset of the job */
+	SimkaCountWriter(vector<SimkaPartitionWriter<Type>* >& bags, const vector<u_int32_t>& bankIds) : _bags(bags){
+		_bankIds = bankIds;
+		_nbPending = 0;
+		_isClosed = false;
+		_thread = std::thread(&SimkaCountWriter::run, this);
+	}
+
+	~SimkaCountWriter(){
+		stop();
+	}
+
+	size_t getNbPartitions() const { return _bags.size(); }
+	size_t getNbBanks() const { return _bankIds.size(); }
+
+	/** From any count thread. The buffer is deleted once written. */
+	void push(Buffer* buffer){
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_canPush.wait(lock, [this]{ return _nbPending < SIMKA_COUNT_MAX_PENDING_BUFFERS; });
+			_nbPending += 1;
+			_buffers.push_back(buffer);
+		}
+		_canWrite.notify_one();
+	}
+
+	/** Write the remaining buffers and stop the writer thread, once every count thread is done.
+	 * Throws the first write error of the writer thread. */
+	void close(){
+		stop();
+		_error.check();
+	}
 
-		Kmer_BankId_Count(){
+private:
 
+	void stop(){
+		if(!_thread.joinable()) return;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_isClosed = true;
 		}
+		_canWrite.notify_one();
+		_thread.join();
+	}
+
+	void run(){
+
+		while(true){
+
+			Buffer* buffer;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_canWrite.wait(lock, [this]{ return _isClosed || !_buffers.empty(); });
+				if(_buffers.empty()) return;
+				buffer = _buffers.front();
+				_buffers.pop_front();
+			}
 
-		Kmer_BankId_Count(Type type, u_int64_t bankId, u_int64_t count){
-			_type = type;
-			_bankId = bankId;
-			_count = count;
+			write(buffer);
+
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_nbPending -= 1;
+			}
+			_canPush.notify_one();
 		}
-	};
+	}
 
-    //SimkaCompressedProcessor(vector<BagGzFile<Count>* >& bags, vector<vector<Count> >& caches, vector<size_t>& cacheIndexes, CountNumber abundanceMin, CountNumber abundanceMax) : _bags(bags), _caches(caches), _cacheIndexes(cacheIndexes)
-    SimkaCompressedProcessor(vector<Bag<Kmer_BankId_Count>* >& bags, vector<u_int64_t>& nbKmerPerParts, vector<u_int64_t>& nbDistinctKmerPerParts, vector<u_int64_t>& chordPerParts, CountNumber abundanceMin, CountNumber abundanceMax, size_t bankIndex) :
-    	_bags(bags), _nbDistinctKmerPerParts(nbDistinctKmerPerParts), _nbKmerPerParts(nbKmerPerParts), _chordPerParts(chordPerParts)
+	/** After a write error, the buffers are only deleted so that the count threads never wait on the writer. */
+	void write(Buffer* buffer){
+		if(!_error.isSet()){
+			_error.run([&](){
+				SimkaPartitionWriter<Type>* bag = _bags[buffer->_partId];
+				for(size_t i=0; i<buffer->_records.size(); i++){
+					const Record& record = buffer->_records[i];
+					bag->insert(record._kmer, _bankIds[record._bank], record._count);
+				}
+				if(buffer->_isLast) bag->flush();
+			});
+		}
+		delete buffer;
+	}
+
+	vector<SimkaPartitionWriter<Type>* >& _bags;
+	vector<u_int32_t> _bankIds;
+	std::mutex _mutex;
+	std::condition_variable _canWrite;
+	std::condition_variable _canPush;
+	//Buffers pushed and not written yet, the ones in the queue and the one being written
+	std::deque<Buffer*> _buffers;
+	size_t _nbPending;
+	bool _isClosed;
+	SimkaError _error;
+	std::thread _thread;
+};
+
+
+/** Solid k-mers of a count job. Each clone (one per count thread) has its own partition buffers and
+ * its own k-mer counts per partition; the counts are added to the shared ones by flush, for the clones
+ * in finishClones, and for the processor itself once the counting is done.
+ *
+ * The count vector given to process has one count per dataset of the job, each one filtered on its
+ * own. The k-mer counts are per dataset and partition, at index bank * nbPartitions + partId. */
+template<size_t span>
+class SimkaCompressedProcessor : public CountProcessorAbstract<span>{
+
+public:
+
+    typedef typename Kmer<span>::Type  Type;
+    typedef typename Kmer<span>::Count Count;
+    typedef typename SimkaCountWriter<span>::Buffer Buffer;
+    typedef typename SimkaCountWriter<span>::Record Record;
+
+    /** \param[in] complexityFilter : the k-mers it rejects are not written (-kmer-shannon-index) */
+    SimkaCompressedProcessor(SimkaCountWriter<span>& writer, vector<u_int64_t>& nbKmerPerParts, vector<u_int64_t>& nbDistinctKmerPerParts, vector<u_int64_t>& chordPerParts, CountNumber abundanceMin, CountNumber abundanceMax, const SimkaKmerComplexityFilter& complexityFilter=SimkaKmerComplexityFilter()) :
+    	_writer(writer), _nbDistinctKmerPerParts(nbDistinctKmerPerParts), _nbKmerPerParts(nbKmerPerParts), _chordPerParts(chordPerParts), _complexityFilter(complexityFilter)
     {
     	_abundanceMin = abundanceMin;
     	_abundanceMax = abundanceMax;
-    	_bankIndex = bankIndex;
+
+    	_nbPartitions = _writer.getNbPartitions();
+    	size_t nbCounts = _nbPartitions * _writer.getNbBanks();
+    	_buffers.resize(_nbPartitions, 0);
+    	_localNbDistinctKmerPerParts.resize(nbCounts, 0);
+    	_localNbKmerPerParts.resize(nbCounts, 0);
+    	_localChordPerParts.resize(nbCounts, 0);
     }
 
-	~SimkaCompressedProcessor(){}
-    CountProcessorAbstract<span>* clone ()  {  return new SimkaCompressedProcessor (_bags, _nbKmerPerParts, _nbDistinctKmerPerParts, _chordPerParts, _abundanceMin, _abundanceMax, _bankIndex);  }
-    //CountProcessorAbstract<span>* clone ()  {  return new SimkaCompressedProcessor (_bags, _caches, _cacheIndexes, _abundanceMin, _abundanceMax);  }
-	void finishClones (vector<ICountProcessor<span>*>& clones){}
+	~SimkaCompressedProcessor(){
+		for(size_t i=0; i<_buffers.size(); i++) delete _buffers[i];
+	}
+
+    CountProcessorAbstract<span>* clone ()  {  return new SimkaCompressedProcessor (_writer, _nbKmerPerParts, _nbDistinctKmerPerParts, _chordPerParts, _abundanceMin, _abundanceMax, _complexityFilter);  }
+
+	void finishClones (vector<ICountProcessor<span>*>& clones){
+		for(size_t i=0; i<clones.size(); i++){
+			SimkaCompressedProcessor* clone = dynamic_cast<SimkaCompressedProcessor*>(clones[i]);
+			if(clone != 0 && clone != this) clone->flush();
+		}
+	}
+
+	/** A partition is counted by a single thread: its buffer can go as soon as it is done, and
+	 * its file can be flushed once the buffer is written. */
+	void endPart (size_t passId, size_t partId){
+		if(_buffers[partId] == 0) _buffers[partId] = new Buffer(partId);
+		_buffers[partId]->_isLast = true;
+		flushBuffer(partId);
+	}
 
 	bool process (size_t partId, const typename Kmer<span>::Type& kmer, const CountVector& count, CountNumber sum){
 
-		if(count[0] < _abundanceMin || count[0] > _abundanceMax) return false;
+		if(_complexityFilter.isEnabled() && !_complexityFilter.isValid(kmer)) return false;
 
-		Kmer_BankId_Count item(kmer, _bankIndex, count[0]);
-		_bags[partId]->insert(item);
-		_nbDistinctKmerPerParts[partId] += 1;
-		_nbKmerPerParts[partId] += count[0];
-		_chordPerParts[partId] += pow(count[0], 2);
+		bool isSolid = false;
 
-		/*
-		size_t index = _cacheIndexes[partId];
+		for(size_t bank=0; bank<count.size(); bank++){
 
-		_caches[partId][index] = item;
-		index += 1;
+			CountNumber abundance = count[bank];
+			if(abundance == 0 || abundance < _abundanceMin || abundance > _abundanceMax) continue;
 
-		if(index == NB_COUNT_CACHE){
-			_bags[partId]->insert(_caches[partId], index);
-			_cacheIndexes[partId] = 0;
+			Buffer* buffer = _buffers[partId];
+			if(buffer == 0){
+				buffer = new Buffer(partId);
+				_buffers[partId] = buffer;
+			}
+
+			buffer->_records.push_back(Record(kmer, bank, abundance));
+			if(buffer->_records.size() >= SIMKA_COUNT_BUFFER_SIZE) flushBuffer(partId);
+
+			size_t i = bank * _nbPartitions + partId;
+			_localNbDistinctKmerPerParts[i] += 1;
+			_localNbKmerPerParts[i] += abundance;
+			_localChordPerParts[i] += (u_int64_t)abundance * abundance;
+			isSolid = true;
 		}
-		else{
-			_cacheIndexes[partId] = index;
-		}*/
 
-		return true;
+		return isSolid;
 	}
 
+	/** Give the buffers to the writer and add the k-mer counts to the shared ones. */
+	void flush(){
 
-	vector<Bag<Kmer_BankId_Count>* >& _bags;
+		for(size_t i=0; i<_buffers.size(); i++) flushBuffer(i);
+
+		for(size_t i=0; i<_localNbKmerPerParts.size(); i++){
+			_nbDistinctKmerPerParts[i] += _localNbDistinctKmerPerParts[i];
+			_nbKmerPerParts[i] += _localNbKmerPerParts[i];
+			_chordPerParts[i] += _localChordPerParts[i];
+			_localNbDistinctKmerPerParts[i] = 0;
+			_localNbKmerPerParts[i] = 0;
+			_localChordPerParts[i] = 0;
+		}
+	}
+
+private:
+
+	void flushBuffer(size_t partId){
+		if(_buffers[partId] == 0) return;
+		_writer.push(_buffers[partId]);
+		_buffers[partId] = 0;
+	}
+
+	SimkaCountWriter<span>& _writer;
 	vector<u_int64_t>& _nbDistinctKmerPerParts;
 	vector<u_int64_t>& _nbKmerPerParts;
 	vector<u_int64_t>& _chordPerParts;
 	CountNumber _abundanceMin;
 	CountNumber _abundanceMax;
-	size_t _bankIndex;
-	//_stats->_chord_N2[i] += pow(abundanceI, 2);
-	//vector<vector<Count> >& _caches;
-	//vector<size_t>& _cacheIndexes;
+	SimkaKmerComplexityFilter _complexityFilter;
+
+	size_t _nbPartitions;
+	vector<Buffer*> _buffers;
+	vector<u_int64_t> _localNbDistinctKmerPerParts;
+	vector<u_int64_t> _localNbKmerPerParts;
+	vector<u_int64_t> _localChordPerParts;
 };
 
 
@@ -141,6 +321,58 @@ public:
 
 
 
+/** Counting of the k-mers of the sequences given by a dispatcher. Each thread works on its own copy,
+ * with its own k-mer iterator; the counters are shared. */
+template<size_t span>
+class MiniKCCountCommand
+{
+
+public:
+
+    typedef typename Kmer<span>::ModelCanonical                             Model;
+    typedef typename Kmer<span>::ModelCanonical::Iterator                             ModelIt;
+
+	size_t _kmerSize;
+	Model _model;
+	ModelIt _kmerIt;
+	MiniKCCounts& _counts;
+	u_int64_t& _nbReads;
+	u_int64_t _nbLocalReads;
+
+	MiniKCCountCommand(size_t kmerSize, MiniKCCounts& counts, u_int64_t& nbReads)
+	: _model(kmerSize), _kmerIt(_model), _counts(counts), _nbReads(nbReads)
+	{
+		_kmerSize = kmerSize;
+		_nbLocalReads = 0;
+	}
+
+	MiniKCCountCommand(const MiniKCCountCommand& copy)
+	: _model(copy._kmerSize), _kmerIt(_model), _counts(copy._counts), _nbReads(copy._nbReads)
+	{
+		_kmerSize = copy._kmerSize;
+		_nbLocalReads = 0;
+	}
+
+	~MiniKCCountCommand(){
+		if(_nbLocalReads > 0) __sync_fetch_and_add(&_nbReads, _nbLocalReads);
+	}
+
+	void operator()(Sequence& sequence){
+
+		_nbLocalReads += 1;
+
+		_kmerIt.setData (sequence.getData());
+
+		for (_kmerIt.first(); !_kmerIt.isDone(); _kmerIt.next()){
+			_counts.increment(_kmerIt->value().getVal());
+		}
+	}
+};
+
+
+//Number of k-mers scanned by a thread of MiniKC::dump at a time
+#define MINIKC_DUMP_CHUNK_SIZE (1 << 20)
+
 template<size_t span>
 class MiniKC : public Algorithm{
 
@@ -167,22 +399,25 @@ public:
 
 	IBank* _bank;
 	size_t _kmerSize;
-	CountVector* _counts;
-    Repartitor& _repartition;
+	MiniKCCounts* _counts;
+    const SimkaDenseRanges& _ranges;
     SimkaCompressedProcessor<span>* _proc;
     u_int64_t _nbReads;
 
-	MiniKC(IProperties* options, size_t kmerSize, IBank* bank, Repartitor& repartition, SimkaCompressedProcessor<span>* proc):
-		Algorithm("minikc", -1, options), _repartition(repartition)
+	MiniKC(IProperties* options, size_t kmerSize, IBank* bank, const SimkaDenseRanges& ranges, SimkaCompressedProcessor<span>* proc):
+		Algorithm("minikc", -1, options), _ranges(ranges)
 	{
 		_bank = bank;
 		_kmerSize = kmerSize;
 		_proc = proc;
 
 
-		u_int64_t nbCounts = pow(4, _kmerSize);
-		cout << "Nb distinct kmers (canonical): " << nbCounts << endl;
-		_counts = new CountVector(nbCounts, 0);
+		_counts = new MiniKCCounts(_kmerSize);
+		cout << "Nb k-mer counters (canonical): " << _counts->size() << " (" << _counts->getBytes()/(1024*1024) << " MB)" << endl;
+	}
+
+	~MiniKC(){
+		delete _counts;
 	}
 
 	void execute(){
@@ -196,66 +431,77 @@ public:
 
 		_nbReads = 0;
 		Iterator<Sequence>* itSeq = createIterator(_bank->iterator(), _bank->estimateNbItems(), "Counting");
+		LOCAL(itSeq);
 
-		//Model definition of a kmer iterator (this one put kmer in cannonical form)
-		//ModelCanonical _model(_kmerSize);
-		//Model::
-		//Model _kmerIt(_model);
-		Model model (_kmerSize);
-
-        // We declare an iterator on a given sequence.
-		ModelIt _kmerIt (model);
-
-		Sequence* sequence;
-
-		for (itSeq->first(); !itSeq->isDone(); itSeq->next()){
-
-			_nbReads += 1;
+		MiniKCCountCommand<span> command(_kmerSize, *_counts, _nbReads);
+		getDispatcher()->iterate (itSeq, command, 1000);
+	}
 
-			sequence = &itSeq->item();
+	struct DumpItem{
+		u_int64_t _kmer;
+		CountNumber _count;
+		u_int32_t _partition;
+	};
 
-			_kmerIt.setData (sequence->getData());
+	/** The k-mers are scanned in increasing order by chunks, one chunk per thread at a time. The
+	 * partitions are ranges of k-mers (SimkaDenseRanges), so each chunk goes through them in order.
+	 * The chunks are given to the processor in order, so that the k-mers of each partition stay sorted,
+	 * and a partition is done once a k-mer of a following one comes. */
+	void dump(){
 
-			for (_kmerIt.first(); !_kmerIt.isDone(); _kmerIt.next()){
+		size_t nbThreads = std::max(getDispatcher()->getExecutionUnitsNumber(), (size_t)1);
+		u_int64_t nbCounts = (u_int64_t)1 << (2*_kmerSize);
 
-				//u_int64_t kmer = min(_kmerIt->value(), revcomp(_kmerIt->value(), _kmerSize)).getVal();
-				//Kmer<> canonicalkmer = min(_kmerIt.item(), revcomp(_kmerIt->value()));
-				//cout << _kmerIt->value().toString(kmerSize) << endl;
+		vector<vector<DumpItem> > buffers(nbThreads);
+		Type kmer;
+		CountVector vec(1, 0);
+		size_t partition = 0;
 
-				u_int64_t kmer = _kmerIt->value().getVal();
-				//cout << _model.toString(kmer) << endl;
-				//cout << kmer << endl;
-				(*_counts)[kmer] += 1;
+		for(u_int64_t start=0; start<nbCounts; start+=nbThreads*MINIKC_DUMP_CHUNK_SIZE){
 
-				//cout << kmer << endl;
+			vector<std::thread> threads;
+			for(size_t t=0; t<nbThreads; t++){
+				u_int64_t chunkStart = std::min(start + t*MINIKC_DUMP_CHUNK_SIZE, nbCounts);
+				u_int64_t chunkEnd = std::min(chunkStart + MINIKC_DUMP_CHUNK_SIZE, nbCounts);
+				threads.push_back(std::thread(&MiniKC::dumpChunk, this, chunkStart, chunkEnd, std::ref(buffers[t])));
+			}
+			for(size_t t=0; t<nbThreads; t++) threads[t].join();
+
+			for(size_t t=0; t<nbThreads; t++){
+				for(size_t i=0; i<buffers[t].size(); i++){
+					const DumpItem& item = buffers[t][i];
+					for(; partition < item._partition; partition++) _proc->endPart(0, partition);
+					kmer.setVal(item._kmer);
+					vec[0] = item._count;
+					_proc->process(item._partition, kmer, vec, item._count);
+				}
 			}
 		}
 
 	}
-	void dump(){
 
-		ModelMinimizer model (_kmerSize, 7);
-		Type kmer;
+	void dumpChunk(u_int64_t start, u_int64_t end, vector<DumpItem>& buffer){
 
-		//Kmer<>::ModelCanonical _model(_kmerSize);
-		CountVector vec(1, 0);
+		buffer.clear();
+		if(start >= end) return;
 
-		for(size_t i=0; i<_counts->size(); i++){
+		size_t partition = _ranges.getPartition(start);
 
-			CountNumber count = (*_counts)[i];
-			if(count == 0) continue;
+		for(u_int64_t i=start; i<end; i++){
 
-			kmer.setVal(i);
+			if(!_counts->isCanonical(i)) continue;
 
-			//cout << i << " " << model.toString(kmer) << endl;
-			//Type kmer(i);
-            u_int64_t mini = model.getMinimizerValue(kmer);
-			size_t p = this->_repartition (mini);
+			u_int64_t count = _counts->get(i);
+			if(count == 0) continue;
 
-			vec[0] = count;
-			_proc->process(p, kmer, vec, count);
-		}
+			while(i >= _ranges.getEnd(partition)) partition += 1;
 
+			DumpItem item;
+			item._kmer = i;
+			item._count = std::min(count, (u_int64_t) std::numeric_limits<CountNumber>::max());
+			item._partition = partition;
+			buffer.push_back(item);
+		}
 	}
 
 
@@ -0,0 +1,192 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef GATB_SIMKA_SRC_MINIKC_MINIKCCOUNTS_HPP_
+#define GATB_SIMKA_SRC_MINIKC_MINIKCCOUNTS_HPP_
+
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <iostream>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <SimkaError.hpp>
+
+//Number of independently locked maps holding the counts above the counter capacity
+#define MINIKC_NB_OVERFLOW_SHARDS 64
+
+
+/*********************************************************************
+* ** MiniKCCounts
+*
+* Counters of the canonical k-mers (2 bits per nucleotide, k <= 32) used
+* by MiniKC.
+*
+* A k-mer and its reverse complement share one counter. The counter is
+* found from the middle nucleotide (odd k) or the two middle nucleotides
+* (even k) of the k-mer: the reverse complement maps them to their
+* complement, so of the two k-mers only the one whose middle is in a
+* fixed half of the values gets a counter. This gives 4^k/2 counters for
+* odd k and 10/16 * 4^k for even k (the palindromic middles AT, CG, TA
+* and GC can't be halved), instead of 4^k.
+*
+* Counters are 16 bits, incremented atomically. They saturate, and the
+* counts above their capacity go to small maps locked by shard. The
+* counters are allocated with mmap (zero pages, no initialization pass)
+* and backed by transparent huge pages where available.
+*********************************************************************/
+class MiniKCCounts
+{
+
+public:
+
+	typedef u_int16_t Counter;
+	static const Counter MAX_COUNTER = 0xFFFF;
+
+	MiniKCCounts(size_t kmerSize){
+
+		_kmerSize = kmerSize;
+		_nbMiddleBases = (kmerSize % 2 == 1) ? 1 : 2;
+		_middleShift = 2 * ((kmerSize - _nbMiddleBases) / 2);
+		_lowMask = ((u_int64_t)1 << _middleShift) - 1;
+		_nbOuterBits = 2 * (kmerSize - _nbMiddleBases);
+
+		//Rank of the middles that get a counter (the smallest of a middle and of its reverse complement)
+		size_t nbMiddles = (size_t)1 << (2*_nbMiddleBases);
+		size_t nbRanks = 0;
+		_middleRanks.assign(nbMiddles, -1);
+		for(size_t middle=0; middle<nbMiddles; middle++){
+			if(revcompMiddle(middle) < middle) continue;
+			_middleRanks[middle] = nbRanks;
+			nbRanks += 1;
+		}
+
+		_size = (u_int64_t)nbRanks << _nbOuterBits;
+		_bytes = _size * sizeof(Counter);
+
+		void* data = mmap(NULL, _bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(data == MAP_FAILED){
+			SimkaError::raise(std::string("can't allocate ") + std::to_string(_bytes) + " bytes of k-mer counters");
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(data, _bytes, MADV_HUGEPAGE);
+#endif
+		_counters = (Counter*) data;
+	}
+
+	~MiniKCCounts(){
+		munmap(_counters, _bytes);
+	}
+
+	/** Number of counters. */
+	u_int64_t size() const { return _size; }
+	u_int64_t getBytes() const { return _bytes; }
+
+	/** Add one occurrence of a canonical k-mer, from any thread. */
+	inline void increment(u_int64_t kmer){
+
+		u_int64_t index = getIndex(kmer);
+		volatile Counter* counter = &_counters[index];
+
+		Counter value = *counter;
+		while(value < MAX_COUNTER){
+			if(__sync_bool_compare_and_swap(counter, value, value+1)) return;
+			value = *counter;
+		}
+
+		Overflow& overflow = _overflows[index % MINIKC_NB_OVERFLOW_SHARDS];
+		std::unique_lock<std::mutex> lock(overflow._mutex);
+		overflow._counts[index] += 1;
+	}
+
+	/** Count of a canonical k-mer, once the counting is finished. */
+	inline u_int64_t get(u_int64_t kmer) const {
+
+		u_int64_t index = getIndex(kmer);
+		u_int64_t count = _counters[index];
+		if(count < MAX_COUNTER) return count;
+
+		const Overflow& overflow = _overflows[index % MINIKC_NB_OVERFLOW_SHARDS];
+		std::unordered_map<u_int64_t, u_int64_t>::const_iterator it = overflow._counts.find(index);
+		if(it != overflow._counts.end()) count += it->second;
+		return count;
+	}
+
+	/** The k-mers handled by the counters: the smallest of a k-mer and of its reverse complement. */
+	inline bool isCanonical(u_int64_t kmer) const {
+		return kmer <= revcomp(kmer);
+	}
+
+	inline u_int64_t revcomp(u_int64_t kmer) const {
+		u_int64_t x = kmer;
+		x = ((x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2);
+		x = ((x >> 4 & 0x0F0F0F0F0F0F0F0FULL) | (x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+		x = ((x >> 8 & 0x00FF00FF00FF00FFULL) | (x & 0x00FF00FF00FF00FFULL) << 8);
+		x = ((x >> 16 & 0x0000FFFF0000FFFFULL) | (x & 0x0000FFFF0000FFFFULL) << 16);
+		x = ((x >> 32 & 0x00000000FFFFFFFFULL) | (x & 0x00000000FFFFFFFFULL) << 32);
+		//A=0 C=1 T=2 G=3: the complement flips the high bit of each nucleotide
+		return (x ^ 0xAAAAAAAAAAAAAAAAULL) >> (64 - 2*_kmerSize);
+	}
+
+private:
+
+	/** Reverse complement of the middle nucleotides (low nucleotide first). */
+	size_t revcompMiddle(size_t middle) const {
+		if(_nbMiddleBases == 1) return middle ^ 2;
+		size_t low = middle & 3;
+		size_t high = middle >> 2;
+		return (high ^ 2) | ((low ^ 2) << 2);
+	}
+
+	inline u_int64_t getIndex(u_int64_t kmer) const {
+
+		size_t middle = (kmer >> _middleShift) & ((1 << (2*_nbMiddleBases)) - 1);
+		int rank = _middleRanks[middle];
+		if(rank < 0){
+			kmer = revcomp(kmer);
+			middle = (kmer >> _middleShift) & ((1 << (2*_nbMiddleBases)) - 1);
+			rank = _middleRanks[middle];
+		}
+
+		u_int64_t outer = (kmer & _lowMask) | ((kmer >> (_middleShift + 2*_nbMiddleBases)) << _middleShift);
+		return ((u_int64_t)rank << _nbOuterBits) | outer;
+	}
+
+	struct Overflow{
+		std::mutex _mutex;
+		std::unordered_map<u_int64_t, u_int64_t> _counts;
+	};
+
+	size_t _kmerSize;
+	size_t _nbMiddleBases;
+	size_t _middleShift;
+	u_int64_t _lowMask;
+	size_t _nbOuterBits;
+	std::vector<int> _middleRanks;
+
+	Counter* _counters;
+	u_int64_t _size;
+	u_int64_t _bytes;
+	Overflow _overflows[MINIKC_NB_OVERFLOW_SHARDS];
+};
+
+
+#endif /* GATB_SIMKA_SRC_MINIKC_MINIKCCOUNTS_HPP_ */
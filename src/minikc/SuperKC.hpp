@@ -0,0 +1,791 @@
+/*****************************************************************************
+ *   Simka: Fast kmer-based method for estimating the similarity between numerous metagenomic datasets
+ *   A tool from the GATB (Genome Assembly Tool Box)
+ *   Copyright (C) 2015  INRIA
+ *   Authors: G.Benoit, C.Lemaitre, P.Peterlongo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef GATB_SIMKA_SRC_MINIKC_SUPERKC_HPP_
+#define GATB_SIMKA_SRC_MINIKC_SUPERKC_HPP_
+
+#include <gatb/gatb_core.hpp>
+#include <SimkaPartitionFile.hpp>
+#include "MiniKC.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <sys/mman.h>
+
+//Bytes of super-k-mers buffered by a count thread for a partition before they go to the store
+#define SUPERKC_BUFFER_SIZE (16*1024)
+
+//Datasets of a joint count job at most (the dataset of a k-mer is sorted as a byte)
+#define SUPERKC_MAX_BANKS 64
+
+//Bits set by a k-mer in the word of SuperKCBloom
+#define SUPERKC_BLOOM_NB_HASHES 3
+
+
+/*********************************************************************
+* ** SuperKCBloom
+*
+* Bloom filter of the k-mers already seen by SuperKC (-singleton-filter),
+* used to drop the first occurrence of each k-mer before it is stored:
+* singletons then never reach the partitions nor the sorts, and a k-mer
+* seen c >= 2 times is stored c-1 times, its count is corrected by the
+* counter.
+*
+* A k-mer sets SUPERKC_BLOOM_NB_HASHES bits in a single 64-bit word, with
+* one atomic or: of the threads adding the same k-mer at once, only one
+* sees some of its bits unset.
+*
+* False positives: a first occurrence whose bits are all already set is
+* stored, and the count of the k-mer is overestimated by 1. With n
+* distinct k-mers, m bits and h hashes, this happens with probability
+* about (1 - e^(-hn/m))^h, slightly more as the bits of a k-mer share a
+* word. Counts of k-mers seen at least twice are otherwise exact.
+*********************************************************************/
+class SuperKCBloom
+{
+
+public:
+
+	SuperKCBloom(u_int64_t bytes){
+
+		_nbWords = std::max(bytes / sizeof(u_int64_t), (u_int64_t)1);
+		_bytes = _nbWords * sizeof(u_int64_t);
+
+		void* data = mmap(NULL, _bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(data == MAP_FAILED){
+			SimkaError::raise(std::string("can't allocate ") + std::to_string(_bytes) + " bytes of singleton filter");
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(data, _bytes, MADV_HUGEPAGE);
+#endif
+		_words = (u_int64_t*) data;
+	}
+
+	~SuperKCBloom(){
+		munmap(_words, _bytes);
+	}
+
+	u_int64_t getBytes() const { return _bytes; }
+
+	/** Add a k-mer from any thread.
+	 * \param[in] hash : well mixed hash of the k-mer
+	 * \return true if the k-mer was not seen before */
+	inline bool insert(u_int64_t hash){
+
+		u_int64_t index = (u_int64_t)(((unsigned __int128)hash * _nbWords) >> 64);
+
+		u_int64_t mask = 0;
+		for(size_t i=0; i<SUPERKC_BLOOM_NB_HASHES; i++) mask |= (u_int64_t)1 << ((hash >> (6*i)) & 63);
+
+		u_int64_t previous = __sync_fetch_and_or(&_words[index], mask);
+		return (previous & mask) != mask;
+	}
+
+	/** Probability that a new k-mer is taken for an already seen one, from the fraction of bits set. */
+	double getFalsePositiveRate() const {
+
+		u_int64_t nbBits = 0;
+		for(u_int64_t i=0; i<_nbWords; i++) nbBits += __builtin_popcountll(_words[i]);
+
+		return pow((double)nbBits / (64.0 * _nbWords), SUPERKC_BLOOM_NB_HASHES);
+	}
+
+	/** Murmur3 finalizer, applied to each word of the k-mer.
+	 * \param[in] seed : dataset of the k-mer in a joint count, 0 otherwise */
+	static inline u_int64_t hash(const u_int64_t* words, size_t nbWords, u_int64_t seed){
+
+		u_int64_t h = seed;
+		for(size_t i=0; i<nbWords; i++){
+			h ^= words[i];
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+		}
+		return h;
+	}
+
+private:
+
+	u_int64_t* _words;
+	u_int64_t _nbWords;
+	u_int64_t _bytes;
+};
+
+
+/*********************************************************************
+* ** SuperKCStore
+*
+* Super-k-mers of each partition, encoded by SuperKCFillCommand. They
+* stay in memory while the memory budget allows it; beyond, the
+* partition receiving super-k-mers is written to its file in the temp
+* dir and its memory released.
+*
+* A write error is kept for check, after the fill: append runs on the
+* threads of the dispatcher and in the destructors of the commands. The
+* super-k-mers that come after it are dropped.
+*********************************************************************/
+class SuperKCStore
+{
+
+public:
+
+	/** \param[in] dir : dir of the partition files
+	 * \param[in] maxMemory : bytes of super-k-mers kept in memory */
+	SuperKCStore(const string& dir, size_t nbPartitions, u_int64_t maxMemory){
+		_maxMemory = maxMemory;
+		_memory = 0;
+		_spilledBytes = 0;
+		for(size_t i=0; i<nbPartitions; i++){
+			_partitions.push_back(new Partition(dir + "/superkmers_" + Stringify::format("%i", i)));
+		}
+	}
+
+	~SuperKCStore(){
+		for(size_t i=0; i<_partitions.size(); i++){
+			_error.run([&](){ _partitions[i]->close(); });
+			delete _partitions[i];
+		}
+	}
+
+	size_t size() const { return _partitions.size(); }
+
+	/** From any count thread. */
+	void append(size_t partId, const vector<u_int8_t>& buffer, u_int64_t nbKmers){
+
+		if(_error.isSet()) return;
+
+		Partition* partition = _partitions[partId];
+		std::unique_lock<std::mutex> lock(partition->_mutex);
+
+		partition->_data.insert(partition->_data.end(), buffer.begin(), buffer.end());
+		partition->_nbKmers += nbKmers;
+
+		if(_memory.fetch_add(buffer.size()) + buffer.size() > _maxMemory){
+			u_int64_t bytes = partition->_data.size();
+			_memory.fetch_sub(bytes);
+			if(_error.run([&](){ partition->spill(); })) _spilledBytes += bytes;
+		}
+	}
+
+	/** Throw the first write error of append. */
+	void check(){ _error.check(); }
+
+	u_int64_t getNbKmers(size_t partId) const { return _partitions[partId]->_nbKmers; }
+
+	/** Size of the super-k-mers of a partition, in memory and in its file. */
+	u_int64_t getNbBytes(size_t partId) const { return _partitions[partId]->_nbSpilledBytes + _partitions[partId]->_data.size(); }
+
+	/** Bytes of super-k-mers in memory. */
+	u_int64_t getMemory() const { return _memory.load(); }
+
+	/** Bytes of super-k-mers written to the temp dir by the fill. */
+	u_int64_t getSpilledBytes() const { return _spilledBytes.load(); }
+
+	/** Super-k-mers of a partition, once the fill is done. The partition is emptied. */
+	void load(size_t partId, vector<u_int8_t>& data){
+
+		Partition* partition = _partitions[partId];
+		partition->close();
+
+		data.clear();
+		if(partition->_nbSpilledBytes > 0){
+			SimkaMappedFile file(partition->_filename);
+			data.assign(file.data(), file.data() + file.size());
+		}
+		data.insert(data.end(), partition->_data.begin(), partition->_data.end());
+
+		_memory.fetch_sub(partition->_data.size());
+		vector<u_int8_t>().swap(partition->_data);
+		partition->remove();
+	}
+
+private:
+
+	struct Partition{
+
+		Partition(const string& filename) : _filename(filename), _file(0), _nbKmers(0), _nbSpilledBytes(0) {}
+
+		void spill(){
+
+			if(_file == 0){
+				_file = fopen(_filename.c_str(), "wb");
+				if(_file == 0){
+					SimkaError::raise(std::string("can't create super-k-mer file ") + _filename);
+				}
+			}
+
+			if(!_data.empty() && fwrite(&_data[0], 1, _data.size(), _file) != _data.size()){
+				SimkaError::raise(std::string("can't write super-k-mer file ") + _filename);
+			}
+			_nbSpilledBytes += _data.size();
+			vector<u_int8_t>().swap(_data);
+		}
+
+		void close(){
+			if(_file == 0) return;
+			if(fclose(_file) != 0){
+				SimkaError::raise(std::string("can't write super-k-mer file ") + _filename);
+			}
+			_file = 0;
+		}
+
+		void remove(){
+			if(_nbSpilledBytes > 0) System::file().remove(_filename);
+			_nbSpilledBytes = 0;
+		}
+
+		std::mutex _mutex;
+		string _filename;
+		FILE* _file;
+		vector<u_int8_t> _data;
+		u_int64_t _nbKmers;
+		u_int64_t _nbSpilledBytes;
+	};
+
+	vector<Partition*> _partitions;
+	u_int64_t _maxMemory;
+	std::atomic<u_int64_t> _memory;
+	std::atomic<u_int64_t> _spilledBytes;
+	SimkaError _error;
+};
+
+
+/*********************************************************************
+* ** SuperKCMemoryBudget
+*
+* Memory of the arrays of the count threads of SuperKC, bounded by
+* -max-memory along with the super-k-mers still in the store. A thread
+* reserves the memory its arrays need before loading a partition, and
+* waits while it would exceed the budget. A thread without other
+* reservations always goes: a partition larger than the budget is
+* counted alone.
+*********************************************************************/
+class SuperKCMemoryBudget
+{
+
+public:
+
+	SuperKCMemoryBudget(u_int64_t maxMemory, const SuperKCStore& store) : _store(store){
+		_maxMemory = maxMemory;
+		_reserved = 0;
+		_nbReservations = 0;
+	}
+
+	void reserve(u_int64_t bytes){
+		std::unique_lock<std::mutex> lock(_mutex);
+		_canReserve.wait(lock, [&]{ return _nbReservations == 0 || _reserved + bytes + _store.getMemory() <= _maxMemory; });
+		_reserved += bytes;
+		_nbReservations += 1;
+	}
+
+	void release(u_int64_t bytes){
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_reserved -= bytes;
+			_nbReservations -= 1;
+		}
+		_canReserve.notify_all();
+	}
+
+private:
+
+	const SuperKCStore& _store;
+	u_int64_t _maxMemory;
+	u_int64_t _reserved;
+	size_t _nbReservations;
+	std::mutex _mutex;
+	std::condition_variable _canReserve;
+};
+
+
+/** Split of the sequences given by a dispatcher into super-k-mers (runs of consecutive k-mers with the
+ * same minimizer), sent to the partition of their minimizer. Each thread works on its own copy, with its
+ * own model and partition buffers.
+ *
+ * A super-k-mer is encoded as its number of k-mers, its dataset (joint counts only) and its first k-mer
+ * (varints, see SimkaPartitionVarint), then the last nucleotide of each following k-mer, 4 per byte.
+ *
+ * With a SuperKCBloom, the first occurrence of each k-mer is dropped and ends the super-k-mer. */
+template<size_t span>
+class SuperKCFillCommand
+{
+
+public:
+
+	typedef typename Kmer<span>::Type Type;
+	typedef typename Kmer<span>::ModelCanonical ModelCanonical;
+	typedef typename Kmer<span>::template ModelMinimizer<ModelCanonical> Model;
+	typedef typename Model::Kmer KmerType;
+	typedef SimkaPartitionFile<Type> File;
+
+	/** \param[in] bankId : index of the dataset of the sequences in the job
+	 * \param[in] nbBanks : number of datasets of the job */
+	SuperKCFillCommand(size_t kmerSize, size_t minimizerSize, uint32_t* freqOrder, Repartitor& repartitor, SuperKCStore& store, SuperKCBloom* bloom, size_t bankId, size_t nbBanks, u_int64_t& nbReads)
+	: _model(kmerSize, minimizerSize, typename Kmer<span>::ComparatorMinimizerFrequencyOrLex(), freqOrder), _repartitor(repartitor), _store(store), _bloom(bloom), _nbReads(nbReads)
+	{
+		_kmerSize = kmerSize;
+		_minimizerSize = minimizerSize;
+		_freqOrder = freqOrder;
+		_bankId = bankId;
+		_nbBanks = nbBanks;
+		init();
+	}
+
+	SuperKCFillCommand(const SuperKCFillCommand& copy)
+	: _model(copy._kmerSize, copy._minimizerSize, typename Kmer<span>::ComparatorMinimizerFrequencyOrLex(), copy._freqOrder), _repartitor(copy._repartitor), _store(copy._store), _bloom(copy._bloom), _nbReads(copy._nbReads)
+	{
+		_kmerSize = copy._kmerSize;
+		_minimizerSize = copy._minimizerSize;
+		_freqOrder = copy._freqOrder;
+		_bankId = copy._bankId;
+		_nbBanks = copy._nbBanks;
+		init();
+	}
+
+	~SuperKCFillCommand(){
+		for(size_t i=0; i<_buffers.size(); i++) flush(i);
+		if(_nbLocalReads > 0) __sync_fetch_and_add(&_nbReads, _nbLocalReads);
+	}
+
+	void operator()(Sequence& sequence){
+
+		_nbLocalReads += 1;
+
+		_model.iterate(sequence.getData(), [this](const KmerType& kmer, size_t idx){ this->add(kmer, idx); });
+		closeSuperKmer();
+	}
+
+private:
+
+	void init(){
+		_nbLocalReads = 0;
+		_nbSuperKmerKmers = 0;
+		_lastIdx = 0;
+		_partId = 0;
+		_buffers.resize(_store.size());
+		_bufferKmers.resize(_store.size(), 0);
+	}
+
+	void add(const KmerType& kmer, size_t idx){
+
+		if(!kmer.isValid()){
+			closeSuperKmer();
+			return;
+		}
+
+		//The next stored k-mer is not contiguous, it starts a new super-k-mer
+		if(_bloom != 0 && _bloom->insert(hash(kmer.value()))) return;
+
+		if(_nbSuperKmerKmers > 0 && (kmer.hasChanged() || idx != _lastIdx+1)) closeSuperKmer();
+
+		if(_nbSuperKmerKmers == 0){
+			_partId = _repartitor(kmer.minimizer().value().getVal());
+			_first = kmer.forward();
+			_nucleotides.clear();
+		}
+		else{
+			_nucleotides.push_back(kmer.forward().getVal() & 3);
+		}
+
+		_nbSuperKmerKmers += 1;
+		_lastIdx = idx;
+	}
+
+	void closeSuperKmer(){
+
+		if(_nbSuperKmerKmers == 0) return;
+
+		vector<u_int8_t>& buffer = _buffers[_partId];
+		SimkaPartitionVarint::put(buffer, _nbSuperKmerKmers);
+		if(_nbBanks > 1) SimkaPartitionVarint::put(buffer, _bankId);
+		if(File::NB_WORDS == 1){
+			SimkaPartitionVarint::put(buffer, _first.getVal());
+		}
+		else{
+			u_int64_t words[File::NB_WORDS];
+			File::toWords(_first, words);
+			SimkaPartitionVarint::putWords(buffer, words, File::NB_WORDS);
+		}
+
+		for(size_t i=0; i<_nucleotides.size(); i+=4){
+			u_int8_t byte = 0;
+			for(size_t j=i; j<i+4 && j<_nucleotides.size(); j++) byte |= _nucleotides[j] << (2*(j-i));
+			buffer.push_back(byte);
+		}
+
+		_bufferKmers[_partId] += _nbSuperKmerKmers;
+		_nbSuperKmerKmers = 0;
+
+		if(buffer.size() >= SUPERKC_BUFFER_SIZE) flush(_partId);
+	}
+
+	inline u_int64_t hash(const Type& kmer) const {
+		u_int64_t words[File::NB_WORDS];
+		File::toWords(kmer, words);
+		return SuperKCBloom::hash(words, File::NB_WORDS, _bankId);
+	}
+
+	void flush(size_t partId){
+		if(_buffers[partId].empty()) return;
+		_store.append(partId, _buffers[partId], _bufferKmers[partId]);
+		_buffers[partId].clear();
+		_bufferKmers[partId] = 0;
+	}
+
+	size_t _kmerSize;
+	size_t _minimizerSize;
+	uint32_t* _freqOrder;
+	size_t _bankId;
+	size_t _nbBanks;
+	Model _model;
+	Repartitor& _repartitor;
+	SuperKCStore& _store;
+	SuperKCBloom* _bloom;
+	u_int64_t& _nbReads;
+	u_int64_t _nbLocalReads;
+
+	vector<vector<u_int8_t> > _buffers;
+	vector<u_int64_t> _bufferKmers;
+
+	size_t _partId;
+	Type _first;
+	vector<u_int8_t> _nucleotides;
+	u_int64_t _nbSuperKmerKmers;
+	size_t _lastIdx;
+};
+
+
+/*********************************************************************
+* ** SuperKC
+*
+* K-mer counter of simkaCount for k > SIMKA_DENSE_MAX_KMER_SIZE. The
+* sequences are split into super-k-mers, sent directly to the partitions
+* of simka's repartition table (SuperKCStore). Each partition is then
+* expanded into its canonical k-mers, sorted with an LSD radix sort and
+* counted in memory, and the counts go to the processor, that writes the
+* partition files of the dataset. The partitions are counted in parallel,
+* one per thread, each with its own clone of the processor.
+*
+* A joint count (several small datasets in one job) stores the dataset
+* of each super-k-mer. The k-mers are sorted by value then dataset, and
+* the processor gets one count per dataset.
+*
+* Half of -max-memory holds the super-k-mers, the rest is left to the
+* sorts. With the singleton filter, the super-k-mers and the SuperKCBloom
+* get a quarter each; the filter is released before the sorts.
+*********************************************************************/
+template<size_t span>
+class SuperKC : public Algorithm{
+
+public:
+
+	typedef typename Kmer<span>::Type Type;
+	typedef SimkaPartitionFile<Type> File;
+
+	vector<IBank*> _banks;
+	size_t _kmerSize;
+	const Configuration& _config;
+	Repartitor& _repartitor;
+	SimkaCompressedProcessor<span>* _proc;
+	string _tempDir;
+	bool _singletonFilter;
+	vector<u_int64_t> _nbReads;
+	//Bytes of super-k-mers written to the temp dir, once executed
+	u_int64_t _nbSpilledBytes;
+
+	/** \param[in] banks : datasets of the job, counted one after the other
+	 * \param[in] singletonFilter : drop the first occurrence of each k-mer, only when the processor
+	 * discards the k-mers seen once */
+	SuperKC(IProperties* options, size_t kmerSize, const vector<IBank*>& banks, const Configuration& config, Repartitor& repartitor, SimkaCompressedProcessor<span>* proc, const string& tempDir, bool singletonFilter):
+		Algorithm("superkc", -1, options), _config(config), _repartitor(repartitor)
+	{
+		_banks = banks;
+		_kmerSize = kmerSize;
+		_proc = proc;
+		_tempDir = tempDir;
+		_singletonFilter = singletonFilter;
+		_nbReads.resize(banks.size(), 0);
+		_nbSpilledBytes = 0;
+	}
+
+	void execute(){
+
+		u_int64_t maxMemory = (u_int64_t) getInput()->getInt(STR_MAX_MEMORY) * MBYTE;
+		SuperKCStore store(_tempDir, _config._nb_partitions, _singletonFilter ? maxMemory / 4 : maxMemory / 2);
+
+		if(_singletonFilter){
+			SuperKCBloom bloom(maxMemory / 4);
+			fill(store, &bloom);
+			cout << "Singleton filter: " << bloom.getBytes()/(1024*1024) << " MB, estimated false positive rate " << bloom.getFalsePositiveRate() << endl;
+		}
+		else{
+			fill(store, 0);
+		}
+		store.check();
+		_nbSpilledBytes = store.getSpilledBytes();
+
+		count(store, maxMemory);
+	}
+
+	void fill(SuperKCStore& store, SuperKCBloom* bloom){
+
+		uint32_t* freqOrder = 0;
+		if(_config._minimizerType == 1) freqOrder = _repartitor.getMinimizerFrequencies();
+
+		for(size_t b=0; b<_banks.size(); b++){
+
+			Iterator<Sequence>* itSeq = createIterator(_banks[b]->iterator(), _banks[b]->estimateNbItems(), "Counting");
+			LOCAL(itSeq);
+
+			SuperKCFillCommand<span> command(_kmerSize, _config._minim_size, freqOrder, _repartitor, store, bloom, b, _banks.size(), _nbReads[b]);
+			getDispatcher()->iterate (itSeq, command, 1000);
+		}
+	}
+
+	/** The partitions are taken by the threads in decreasing number of k-mers, so that a large
+	 * partition does not end the count alone. The arrays of a thread are kept from one partition
+	 * to the next, along with their reservation in the memory budget; they are freed before the
+	 * thread waits for a larger one, so that waiting threads never hold memory. After an error,
+	 * the threads stop taking partitions and the error is thrown once they are joined. */
+	void count(SuperKCStore& store, u_int64_t maxMemory){
+
+		size_t nbThreads = std::max(getDispatcher()->getExecutionUnitsNumber(), (size_t)1);
+
+		vector<pair<u_int64_t, size_t> > partitions;
+		for(size_t i=0; i<store.size(); i++) partitions.push_back(make_pair(store.getNbKmers(i), i));
+		sort(partitions.rbegin(), partitions.rend());
+
+		vector<ICountProcessor<span>*> clones;
+		for(size_t t=0; t<nbThreads; t++) clones.push_back(_proc->clone());
+
+		SuperKCMemoryBudget budget(maxMemory, store);
+		std::atomic<size_t> next(0);
+		SimkaError error;
+		vector<std::thread> threads;
+		for(size_t t=0; t<nbThreads; t++){
+			threads.push_back(std::thread([&, t](){
+				SortBuffers buffers;
+				u_int64_t reserved = 0;
+				error.run([&](){
+					size_t i;
+					while(!error.isSet() && (i = next.fetch_add(1)) < partitions.size()){
+						size_t partId = partitions[i].second;
+						u_int64_t needed = getSortMemory(store, partId);
+						if(needed > reserved){
+							if(reserved > 0){
+								buffers = SortBuffers();
+								budget.release(reserved);
+								reserved = 0;
+							}
+							budget.reserve(needed);
+							reserved = needed;
+						}
+						countPartition(store, partId, clones[t], buffers);
+					}
+				});
+				if(reserved > 0) budget.release(reserved);
+			}));
+		}
+		for(size_t t=0; t<nbThreads; t++) threads[t].join();
+
+		_proc->finishClones(clones);
+		for(size_t t=0; t<nbThreads; t++) delete clones[t];
+		error.check();
+	}
+
+private:
+
+	/** Arrays of a count thread, reused from one partition to the next. The datasets of the k-mers
+	 * are only filled in joint counts. */
+	struct SortBuffers{
+		vector<u_int8_t> _data;
+		vector<Type> _kmers;
+		vector<Type> _sorted;
+		vector<u_int8_t> _banks;
+		vector<u_int8_t> _sortedBanks;
+	};
+
+	/** Memory of the arrays of countPartition: the super-k-mers, then the k-mers twice for the sort,
+	 * and their datasets twice in joint counts. */
+	u_int64_t getSortMemory(const SuperKCStore& store, size_t partId) const {
+		u_int64_t nbKmers = store.getNbKmers(partId);
+		return std::max(store.getNbBytes(partId), (u_int64_t)1) + nbKmers * (2*sizeof(Type) + (_banks.size() > 1 ? 2 : 0));
+	}
+
+	void countPartition(SuperKCStore& store, size_t partId, ICountProcessor<span>* proc, SortBuffers& buffers){
+
+		vector<Type>& kmers = buffers._kmers;
+		vector<u_int8_t>& banks = buffers._banks;
+		bool isJoint = _banks.size() > 1;
+
+		u_int64_t nbKmers = store.getNbKmers(partId);
+		store.load(partId, buffers._data);
+
+		kmers.resize(nbKmers);
+		buffers._sorted.resize(nbKmers);
+		banks.resize(isJoint ? nbKmers : 0);
+		buffers._sortedBanks.resize(banks.size());
+		decode(buffers._data, kmers, banks);
+		vector<u_int8_t>().swap(buffers._data);
+
+		radixSort(kmers, buffers._sorted, banks, buffers._sortedBanks);
+
+		//The first occurrences dropped by the singleton filter
+		u_int64_t nbDropped = _singletonFilter ? 1 : 0;
+		u_int64_t maxCount = std::numeric_limits<CountNumber>::max();
+
+		CountVector counts(_banks.size(), 0);
+		for(u_int64_t i=0; i<nbKmers; ){
+			u_int64_t j = i+1;
+			while(j < nbKmers && kmers[j] == kmers[i]) j += 1;
+
+			if(isJoint){
+				//Occurrences of a k-mer are sorted by dataset
+				for(u_int64_t k=i; k<j; ){
+					u_int64_t l = k+1;
+					while(l < j && banks[l] == banks[k]) l += 1;
+					counts[banks[k]] = std::min(l-k+nbDropped, maxCount);
+					k = l;
+				}
+			}
+			else{
+				counts[0] = std::min(j-i+nbDropped, maxCount);
+			}
+
+			proc->process(partId, kmers[i], counts, std::min(j-i, maxCount));
+
+			if(isJoint){
+				for(u_int64_t k=i; k<j; k++) counts[banks[k]] = 0;
+			}
+			i = j;
+		}
+
+		proc->endPart(0, partId);
+	}
+
+	/** Canonical k-mers of the super-k-mers of a partition, and their dataset if banks is not empty. */
+	void decode(const vector<u_int8_t>& data, vector<Type>& kmers, vector<u_int8_t>& banks){
+
+		Type mask = (toType(1) << (2*_kmerSize)) - toType(1);
+		size_t rcShift = 2*(_kmerSize-1);
+		bool isJoint = !banks.empty();
+
+		const u_int8_t* ptr = data.empty() ? 0 : &data[0];
+		const u_int8_t* end = ptr + data.size();
+		u_int64_t nbKmers = 0;
+
+		while(ptr < end){
+
+			u_int64_t nbSuperKmerKmers;
+			ptr = SimkaPartitionVarint::get(ptr, nbSuperKmerKmers);
+
+			u_int64_t bank = 0;
+			if(isJoint){
+				ptr = SimkaPartitionVarint::get(ptr, bank);
+				std::fill(banks.begin() + nbKmers, banks.begin() + nbKmers + nbSuperKmerKmers, (u_int8_t)bank);
+			}
+
+			Type forward;
+			if(File::NB_WORDS == 1){
+				u_int64_t value;
+				ptr = SimkaPartitionVarint::get(ptr, value);
+				forward.setVal(value);
+			}
+			else{
+				u_int64_t words[File::NB_WORDS];
+				ptr = SimkaPartitionVarint::getWords(ptr, words, File::NB_WORDS);
+				File::fromWords(words, forward);
+			}
+
+			//A=0 C=1 T=2 G=3: the complement of a nucleotide flips its high bit
+			Type revcomp = toType(0);
+			for(size_t i=0; i<_kmerSize; i++){
+				revcomp = (revcomp << 2) + toType(((forward >> (2*i)).getVal() & 3) ^ 2);
+			}
+			kmers[nbKmers++] = std::min(forward, revcomp);
+
+			for(u_int64_t i=1; i<nbSuperKmerKmers; i++){
+				u_int64_t nucleotide = (ptr[(i-1)/4] >> (2*((i-1)%4))) & 3;
+				forward = ((forward << 2) + toType(nucleotide)) & mask;
+				revcomp = (revcomp >> 2) + (toType(nucleotide ^ 2) << rcShift);
+				kmers[nbKmers++] = std::min(forward, revcomp);
+			}
+			ptr += (nbSuperKmerKmers + 2) / 4;
+		}
+	}
+
+	/** LSD radix sort by bytes of the 2k bits of the k-mers. Passes where every k-mer has the same
+	 * byte are skipped. The datasets, when given, move with their k-mer and are sorted first, as the
+	 * least significant digit. */
+	void radixSort(vector<Type>& kmers, vector<Type>& buffer, vector<u_int8_t>& banks, vector<u_int8_t>& bankBuffer){
+
+		size_t nbKmers = kmers.size();
+		bool isJoint = !banks.empty();
+		vector<u_int64_t> offsets(256);
+
+		for(int shift=(isJoint ? -8 : 0); shift<(int)(2*_kmerSize); shift+=8){
+
+			std::fill(offsets.begin(), offsets.end(), 0);
+			for(size_t i=0; i<nbKmers; i++) offsets[getDigit(kmers, banks, i, shift)] += 1;
+			if(nbKmers == 0 || offsets[getDigit(kmers, banks, 0, shift)] == nbKmers) continue;
+
+			u_int64_t offset = 0;
+			for(size_t b=0; b<256; b++){
+				u_int64_t nb = offsets[b];
+				offsets[b] = offset;
+				offset += nb;
+			}
+
+			for(size_t i=0; i<nbKmers; i++){
+				u_int64_t position = offsets[getDigit(kmers, banks, i, shift)]++;
+				buffer[position] = kmers[i];
+				if(isJoint) bankBuffer[position] = banks[i];
+			}
+			kmers.swap(buffer);
+			if(isJoint) banks.swap(bankBuffer);
+		}
+	}
+
+	/** Byte of a k-mer at shift, or its dataset for shift -8. */
+	static inline size_t getDigit(const vector<Type>& kmers, const vector<u_int8_t>& banks, size_t i, int shift){
+		if(shift < 0) return banks[i];
+		return getByte(kmers[i], shift);
+	}
+
+	static inline Type toType(u_int64_t value){
+		Type result;
+		result.setVal(value);
+		return result;
+	}
+
+	static inline size_t getByte(const Type& kmer, size_t shift){
+		if(File::NB_WORDS == 1) return (kmer.getVal() >> shift) & 0xFF;
+		return (kmer >> shift).getVal() & 0xFF;
+	}
+};
+
+
+#endif /* GATB_SIMKA_SRC_MINIKC_SUPERKC_HPP_ */
@@ -1124,7 +1124,7 @@ public:
 		LOCAL(bank);
 
 		SimkaSequenceFilter sequenceFilter(_minReadSize, _minReadShannonIndex);
-		IBank* filteredBank = new SimkaPotaraBankFiltered<SimkaSequenceFilter>(bank, sequenceFilter, _maxNbReads, nbBankPerDataset);
+		SimkaPotaraBankFiltered<SimkaSequenceFilter>* filteredBank = new SimkaPotaraBankFiltered<SimkaSequenceFilter>(bank, sequenceFilter, _maxNbReads, nbBankPerDataset, inputFilename);
 
 		LOCAL(filteredBank);
 
@@ -1158,6 +1158,14 @@ public:
 			SelectKmersCommand<span> command(_kmerSize, _sketchSize, _seed, bloomFilter, kmers, _kmerCounts, _useAbundanceFilter);
 			dispatcher->iterate (itSeq, command, 1000);
 		}
+		//Runs on a thread of its own: a read error ends simkaMin
+		try{
+			filteredBank->checkErrors();
+		}
+		catch(std::exception& e){
+			cerr << "ERROR: " << e.what() << endl;
+			exit(1);
+		}
 
 		/*
 		ModelCanonical model;
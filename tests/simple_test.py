@@ -1,5 +1,5 @@
 
-import sys, os, shutil, glob, gzip
+import sys, os, shutil, glob, gzip, struct, zlib, re
 os.chdir(os.path.split(os.path.realpath(__file__))[0])
 
 suffix = " > /dev/null 2>&1"
@@ -8,6 +8,8 @@ dir = "__results__"
 def clear():
 	if os.path.exists("temp_output"):
 		shutil.rmtree("temp_output")
+	if os.path.exists("temp_output_stripe"):
+		shutil.rmtree("temp_output_stripe")
 	if os.path.exists("__results__"):
 		shutil.rmtree("__results__")
 	os.mkdir(dir)
@@ -75,6 +77,21 @@ def test_dists(dir):
 		sys.exit(1)
 
 
+#BGZF copy of a file, as written by bgzip: gzip members of small blocks, each with its size
+#in a 'BC' extra field, then an empty member
+def write_bgzf(filename, bgzf_filename, block_size=4096):
+	data = open(filename, "rb").read()
+	out = open(bgzf_filename, "wb")
+	for start in range(0, len(data), block_size):
+		block = data[start:start+block_size]
+		compressor = zlib.compressobj(6, zlib.DEFLATED, -15)
+		deflated = compressor.compress(block) + compressor.flush()
+		out.write(struct.pack("<BBBBIBBHBBHH", 31, 139, 8, 4, 0, 0, 255, 6, 66, 67, 2, 25 + len(deflated)))
+		out.write(deflated)
+		out.write(struct.pack("<II", zlib.crc32(block) & 0xffffffff, len(block)))
+	out.write(struct.pack("<BBBBIBBHBBHH", 31, 139, 8, 4, 0, 0, 255, 6, 66, 67, 2, 27) + struct.pack("<BBII", 3, 0, 0, 0))
+	out.close()
+
 def test_parallelization():
 	if(__test_matrices(False, "__results__/results_resources1", "__results__/results_resources2")):
 		print("\tOK")
@@ -120,6 +137,116 @@ print(command)
 os.system(command + suffix)
 test_dists("results_k21_t2")
 
+#test k=15 t=0
+clear()
+print("TESTING k=15 t=0")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k15_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 15 -abundance-min 0 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k15_t0")
+
+#test k=15 t=2
+clear()
+print("TESTING k=15 t=2")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k15_t2 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 15 -abundance-min 2 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k15_t2")
+
+#test joint count jobs
+clear()
+print("TESTING joint count")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -joint-count 1000 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
+#test singleton filter
+clear()
+print("TESTING singleton filter")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t2 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 2 -singleton-filter -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t2")
+
+#test codecs
+for codec in ["none", "default"]:
+	clear()
+	print("TESTING codec " + codec)
+	command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -codec " + codec + " -verbose 0"
+	print(command)
+	os.system(command + suffix)
+	test_dists("results_k21_t0")
+
+#test reuse of the counts of a previous run
+clear()
+print("TESTING reuse counts")
+example_dir = os.path.abspath("../example")
+lines = open("../example/simka_input.txt").read().splitlines()
+with open(dir + "/simka_input_first.txt", "w") as f:
+	for line in lines[:3]:
+		name, files = line.split(":")
+		f.write(name + ": " + os.path.join(example_dir, files.strip()) + "\n")
+command = "../build/bin/simka -in " + dir + "/simka_input_first.txt -out ./__results__/results_first -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -keep-tmp -verbose 0"
+print(command)
+os.system(command + suffix)
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -keep-tmp -reuse-counts -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
+#test count cache, counted then restored from the cache
+print("TESTING count cache")
+for run in ["counted", "cached"]:
+	clear()
+	command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -count-cache ./temp_count_cache -verbose 0"
+	print(command)
+	os.system(command + suffix)
+	test_dists("results_k21_t0")
+shutil.rmtree("temp_count_cache")
+
+#test disk budget, count jobs run one at a time under 1 MB
+clear()
+print("TESTING max disk")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -max-disk 1 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
+#test count partitions striped over two temp dirs
+clear()
+print("TESTING striped temp dirs")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output,./temp_output_stripe -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
+#test BGZF inputs, inflated by simka on the cores of the count jobs
+clear()
+print("TESTING bgzf input")
+example_dir = os.path.abspath("../example")
+bgzf_dir = os.path.abspath(dir + "/bgzf")
+os.mkdir(bgzf_dir)
+for filename in glob.glob(os.path.join(example_dir, "*.fasta")):
+	write_bgzf(filename, os.path.join(bgzf_dir, os.path.basename(filename) + ".gz"))
+with open(dir + "/simka_input_bgzf.txt", "w") as f:
+	for line in open("../example/simka_input.txt").read().splitlines():
+		name, files = line.split(":")
+		files = re.sub(r"[^\s,;]+", lambda m: os.path.join(bgzf_dir, m.group(0) + ".gz"), files)
+		f.write(name + ":" + files + "\n")
+command = "../build/bin/simka -in " + dir + "/simka_input_bgzf.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -nb-cores 4 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
+#test k-mer complexity filter
+clear()
+print("TESTING kmer shannon index")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0_kmer_shannon -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -kmer-shannon-index 1.8 -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0_kmer_shannon")
+
 #test resources 1
 clear()
 print("TESTING parallelization")
@@ -129,6 +256,25 @@ command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/
 os.system(command + suffix)
 test_parallelization()
 
+#test in-process jobs
+clear()
+print("TESTING in-process jobs")
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -in-process -verbose 0"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
+#test cluster mode with array jobs
+clear()
+print("TESTING array jobs")
+array_cmd = "'bash ../example/potara_job/local/simka_array_local.sh {nb_tasks} {max_tasks}'"
+command = "../build/bin/simka -in ../example/simka_input.txt -out ./__results__/results_k21_t0 -out-tmp ./temp_output -simple-dist -complex-dist -kmer-size 21 -abundance-min 0 -verbose 0"
+command += " -count-file ../example/potara_job/local/job_count.bash -merge-file ../example/potara_job/local/job_merge.bash"
+command += " -count-cmd " + array_cmd + " -merge-cmd " + array_cmd + " -array-index '$SIMKA_ARRAY_TASK_ID'"
+print(command)
+os.system(command + suffix)
+test_dists("results_k21_t0")
+
 #----------------------------------------------------------------
 #----------------------------------------------------------------
 #----------------------------------------------------------------